@@ -72,6 +72,243 @@ jbig2_realloc (Jbig2Allocator *allocator, void *p, size_t size)
   return allocator->realloc (allocator, p, size);
 }
 
+/* arena allocation. each allocation is preceded by its size, so that
+   realloc knows how much to copy */
+
+typedef union {
+  size_t size;
+  double d;
+  void *p;
+} Jbig2ArenaAlign;
+
+struct _Jbig2ArenaBlock {
+  Jbig2ArenaBlock *next;
+  size_t size;	/* usable bytes following the header */
+  size_t used;
+};
+
+#define JBIG2_ARENA_BLOCK_SIZE 65536
+#define JBIG2_ARENA_ROUND(n) \
+  (((n) + sizeof(Jbig2ArenaAlign) - 1) / sizeof(Jbig2ArenaAlign) * sizeof(Jbig2ArenaAlign))
+
+static void *
+jbig2_arena_alloc (Jbig2Allocator *allocator, size_t size)
+{
+  Jbig2Arena *arena = (Jbig2Arena *)allocator;
+  Jbig2ArenaBlock *block = arena->blocks;
+  const size_t need = JBIG2_ARENA_ROUND(size) + sizeof(Jbig2ArenaAlign);
+  Jbig2ArenaAlign *header;
+
+  if (block == NULL || block->used + need > block->size)
+    {
+      /* large requests get a block of their own, leaving
+         the current block in use for the small ones */
+      const size_t block_size = need > JBIG2_ARENA_BLOCK_SIZE / 4 ?
+        need : JBIG2_ARENA_BLOCK_SIZE;
+
+      block = jbig2_alloc(arena->parent,
+        JBIG2_ARENA_ROUND(sizeof(Jbig2ArenaBlock)) + block_size);
+      if (block == NULL)
+        return NULL;
+      block->size = block_size;
+      block->used = 0;
+      if (block_size != JBIG2_ARENA_BLOCK_SIZE && arena->blocks != NULL)
+        {
+          block->next = arena->blocks->next;
+          arena->blocks->next = block;
+        }
+      else
+        {
+          block->next = arena->blocks;
+          arena->blocks = block;
+        }
+    }
+
+  header = (Jbig2ArenaAlign *)((byte *)block +
+    JBIG2_ARENA_ROUND(sizeof(Jbig2ArenaBlock)) + block->used);
+  header->size = size;
+  block->used += need;
+
+  return header + 1;
+}
+
+static void
+jbig2_arena_free_nop (Jbig2Allocator *allocator, void *p)
+{
+  /* arena memory is only returned by jbig2_arena_free() */
+}
+
+static void *
+jbig2_arena_realloc (Jbig2Allocator *allocator, void *p, size_t size)
+{
+  Jbig2Arena *arena = (Jbig2Arena *)allocator;
+  void *result;
+
+  /* a large allocation has a block to itself, which can be
+     resized by the parent allocator rather than copied */
+  if (p != NULL)
+    {
+      Jbig2ArenaBlock **link = &arena->blocks;
+      byte *start = (byte *)p - sizeof(Jbig2ArenaAlign);
+
+      while (*link != NULL &&
+             (byte *)*link + JBIG2_ARENA_ROUND(sizeof(Jbig2ArenaBlock)) != start)
+        link = &(*link)->next;
+      if (*link != NULL && (*link)->size != JBIG2_ARENA_BLOCK_SIZE)
+        {
+          const size_t need = JBIG2_ARENA_ROUND(size) + sizeof(Jbig2ArenaAlign);
+          Jbig2ArenaBlock *block = jbig2_realloc(arena->parent, *link,
+            JBIG2_ARENA_ROUND(sizeof(Jbig2ArenaBlock)) + need);
+
+          if (block == NULL)
+            return NULL;
+          block->size = block->used = need;
+          *link = block;
+          ((Jbig2ArenaAlign *)((byte *)block +
+            JBIG2_ARENA_ROUND(sizeof(Jbig2ArenaBlock))))->size = size;
+          return (byte *)block + JBIG2_ARENA_ROUND(sizeof(Jbig2ArenaBlock)) +
+            sizeof(Jbig2ArenaAlign);
+        }
+    }
+
+  result = jbig2_arena_alloc(allocator, size);
+
+  if (result != NULL && p != NULL)
+    {
+      size_t old_size = ((Jbig2ArenaAlign *)p - 1)->size;
+      memcpy(result, p, old_size < size ? old_size : size);
+    }
+  return result;
+}
+
+/* memory accounting. like the arena's, each allocation is preceded
+   by its size, here so that a free knows how much is given back */
+
+static void *
+jbig2_accounting_refuse (Jbig2Accounting *acct, size_t size)
+{
+  jbig2_error(acct->ctx, JBIG2_SEVERITY_WARNING, -1,
+    "allocating %lu bytes would exceed the memory limit of %lu bytes "
+    "(%lu in use)", (unsigned long)size, (unsigned long)acct->limit,
+    (unsigned long)acct->used);
+  return NULL;
+}
+
+/* would @size more bytes take the context over its limit? */
+static bool
+jbig2_accounting_over (const Jbig2Accounting *acct, size_t size)
+{
+  if (size > (size_t)-1 - sizeof(Jbig2ArenaAlign))
+    return TRUE;
+  if (acct->limit == 0)
+    return FALSE;
+  return acct->used > acct->limit || size > acct->limit - acct->used;
+}
+
+static void *
+jbig2_accounting_alloc (Jbig2Allocator *allocator, size_t size)
+{
+  Jbig2Accounting *acct = (Jbig2Accounting *)allocator;
+  Jbig2ArenaAlign *header;
+
+  if (jbig2_accounting_over(acct, size))
+    return jbig2_accounting_refuse(acct, size);
+  header = jbig2_alloc(acct->parent, sizeof(Jbig2ArenaAlign) + size);
+  if (header == NULL)
+    return NULL;
+  header->size = size;
+  acct->used += size;
+  if (acct->peak < acct->used)
+    acct->peak = acct->used;
+
+  return header + 1;
+}
+
+static void
+jbig2_accounting_free (Jbig2Allocator *allocator, void *p)
+{
+  Jbig2Accounting *acct = (Jbig2Accounting *)allocator;
+  Jbig2ArenaAlign *header;
+
+  if (p == NULL)
+    return;
+  header = (Jbig2ArenaAlign *)p - 1;
+  acct->used -= header->size;
+  jbig2_free(acct->parent, header);
+}
+
+static void *
+jbig2_accounting_realloc (Jbig2Allocator *allocator, void *p, size_t size)
+{
+  Jbig2Accounting *acct = (Jbig2Accounting *)allocator;
+  Jbig2ArenaAlign *header;
+  size_t old_size;
+
+  if (p == NULL)
+    return jbig2_accounting_alloc(allocator, size);
+  header = (Jbig2ArenaAlign *)p - 1;
+  old_size = header->size;
+  if (size > old_size && jbig2_accounting_over(acct, size - old_size))
+    return jbig2_accounting_refuse(acct, size - old_size);
+  if (size > (size_t)-1 - sizeof(Jbig2ArenaAlign))
+    return jbig2_accounting_refuse(acct, size);
+
+  header = jbig2_realloc(acct->parent, header, sizeof(Jbig2ArenaAlign) + size);
+  if (header == NULL)
+    return NULL;
+  header->size = size;
+  acct->used = acct->used - old_size + size;
+  if (acct->peak < acct->used)
+    acct->peak = acct->used;
+
+  return header + 1;
+}
+
+void
+jbig2_set_memory_limit (Jbig2Ctx *ctx, size_t limit)
+{
+  ctx->accounting.limit = limit;
+}
+
+size_t
+jbig2_get_memory_used (Jbig2Ctx *ctx, size_t *peak)
+{
+  if (peak != NULL)
+    *peak = ctx->accounting.peak;
+  return ctx->accounting.used;
+}
+
+Jbig2Arena *
+jbig2_arena_new (Jbig2Allocator *parent)
+{
+  Jbig2Arena *arena = (Jbig2Arena *)jbig2_alloc(parent, sizeof(Jbig2Arena));
+
+  if (arena == NULL)
+    return NULL;
+  arena->allocator.alloc = jbig2_arena_alloc;
+  arena->allocator.free = jbig2_arena_free_nop;
+  arena->allocator.realloc = jbig2_arena_realloc;
+  arena->parent = parent;
+  arena->blocks = NULL;
+  arena->next = NULL;
+
+  return arena;
+}
+
+void
+jbig2_arena_free (Jbig2Arena *arena)
+{
+  Jbig2ArenaBlock *block = arena->blocks;
+
+  while (block != NULL)
+    {
+      Jbig2ArenaBlock *next = block->next;
+      jbig2_free(arena->parent, block);
+      block = next;
+    }
+  jbig2_free(arena->parent, arena);
+}
+
 static int
 jbig2_default_error(void *data, const char *msg,
                     Jbig2Severity severity, int32_t seg_idx)
@@ -96,6 +333,10 @@ jbig2_error(Jbig2Ctx *ctx, Jbig2Severity severity, int32_t segment_number,
   int n;
   int code;
 
+  /* don't bother formatting messages nobody wants */
+  if (severity < ctx->min_severity)
+    return 0;
+
   va_start (ap, fmt);
   n = vsnprintf (buf, sizeof(buf), fmt, ap);
   va_end (ap);
@@ -107,6 +348,54 @@ jbig2_error(Jbig2Ctx *ctx, Jbig2Severity severity, int32_t segment_number,
   return code;
 }
 
+void
+jbig2_set_min_severity (Jbig2Ctx *ctx, Jbig2Severity severity)
+{
+  if (severity > JBIG2_SEVERITY_FATAL)
+    severity = JBIG2_SEVERITY_FATAL;
+  ctx->min_severity = severity;
+}
+
+void
+jbig2_set_abort_callback (Jbig2Ctx *ctx, Jbig2AbortCallback callback,
+			  void *data)
+{
+  ctx->abort_callback = callback;
+  ctx->abort_callback_data = data;
+}
+
+bool
+jbig2_interrupted (Jbig2Ctx *ctx)
+{
+  if (!ctx->interrupted && ctx->restarted == NULL &&
+      ctx->abort_callback != NULL &&
+      ctx->abort_callback(ctx->abort_callback_data))
+    {
+      ctx->interrupted = TRUE;
+      jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1, "decoding interrupted");
+    }
+  return ctx->interrupted;
+}
+
+int
+jbig2_parse_segment_polled (Jbig2Ctx *ctx, Jbig2Segment *segment,
+			    const uint8_t *segment_data)
+{
+  int code = 0;
+
+  if (segment != ctx->restarted)
+    ctx->restarted = NULL;
+  if (!jbig2_interrupted(ctx))
+    code = jbig2_parse_segment(ctx, segment, segment_data);
+  if (ctx->interrupted)
+    {
+      ctx->restarted = segment;
+      return JBIG2_INTERRUPTED;
+    }
+  ctx->restarted = NULL;
+  return code;
+}
+
 Jbig2Ctx *
 jbig2_ctx_new (Jbig2Allocator *allocator,
 	       Jbig2Options options,
@@ -115,11 +404,15 @@ jbig2_ctx_new (Jbig2Allocator *allocator,
 	       void *error_callback_data)
 {
   Jbig2Ctx *result;
+  Jbig2Severity min_severity = JBIG2_SEVERITY_DEBUG;
 
   if (allocator == NULL)
       allocator = &jbig2_default_allocator;
-  if (error_callback == NULL)
+  if (error_callback == NULL) {
+      /* the default handler only prints fatal errors */
       error_callback = &jbig2_default_error;
+      min_severity = JBIG2_SEVERITY_FATAL;
+  }
 
   result = (Jbig2Ctx *)jbig2_alloc(allocator, sizeof(Jbig2Ctx));
   if (result == NULL) {
@@ -128,26 +421,65 @@ jbig2_ctx_new (Jbig2Allocator *allocator,
     return result;
   }
 
-  result->allocator = allocator;
+  /* everything else goes through the accounting allocator */
+  result->accounting.allocator.alloc = jbig2_accounting_alloc;
+  result->accounting.allocator.free = jbig2_accounting_free;
+  result->accounting.allocator.realloc = jbig2_accounting_realloc;
+  result->accounting.parent = allocator;
+  result->accounting.ctx = result;
+  result->accounting.used = 0;
+  result->accounting.peak = 0;
+  result->accounting.limit = 0;
+  result->allocator = &result->accounting.allocator;
+  allocator = result->allocator;
+
   result->options = options;
   result->global_ctx = (const Jbig2Ctx *)global_ctx;
   result->error_callback = error_callback;
   result->error_callback_data = error_callback_data;
+  result->min_severity = min_severity;
 
   result->state = (options & JBIG2_OPTIONS_EMBEDDED) ?
     JBIG2_FILE_SEQUENTIAL_HEADER :
     JBIG2_FILE_HEADER;
+  result->frozen = FALSE;
 
   result->buf = NULL;
+  result->buf_size = 0;
+  result->buf_rd_ix = 0;
+  result->buf_wr_ix = 0;
 
   result->n_segments = 0;
   result->n_segments_max = 16;
   result->segments = (Jbig2Segment **)jbig2_alloc(allocator, result->n_segments_max * sizeof(Jbig2Segment *));
+  result->segment_lookup = (Jbig2SegmentLookup *)jbig2_alloc(allocator, result->n_segments_max * sizeof(Jbig2SegmentLookup));
+  if (result->segments == NULL || result->segment_lookup == NULL) {
+    error_callback(error_callback_data, "initial context allocation failed!",
+                    JBIG2_SEVERITY_FATAL, -1);
+    jbig2_free(allocator, result->segments);
+    jbig2_free(allocator, result->segment_lookup);
+    jbig2_free(result->accounting.parent, result);
+    return NULL;
+  }
   result->segment_index = 0;
 
+  result->n_page_index = 0;
+  result->page_index = NULL;
+  result->segment_offsets = NULL;
+  result->segment_decoded = NULL;
+  result->partial_page = 0;
+
   result->current_page = 0;
   result->max_page_index = 4;
   result->pages = (Jbig2Page *)jbig2_alloc(allocator, result->max_page_index * sizeof(Jbig2Page));
+  if (result->pages == NULL) {
+    error_callback(error_callback_data, "initial context allocation failed!",
+                    JBIG2_SEVERITY_FATAL, -1);
+    jbig2_free(allocator, result->segments);
+    jbig2_free(allocator, result->segment_lookup);
+    jbig2_free(result->accounting.parent, result);
+    return NULL;
+  }
   {
     int index;
     for (index = 0; index < result->max_page_index; index++) {
@@ -156,6 +488,19 @@ jbig2_ctx_new (Jbig2Allocator *allocator,
         result->pages[index].image = NULL;
     }
   }
+  result->page_pool = NULL;
+  result->stripe_callback = NULL;
+  result->stripe_callback_data = NULL;
+  result->output_callback = NULL;
+  result->output_callback_data = NULL;
+  result->segment_callback = NULL;
+  result->segment_callback_data = NULL;
+  result->abort_callback = NULL;
+  result->abort_callback_data = NULL;
+  result->interrupted = FALSE;
+  result->restarted = NULL;
+  result->coded_bytes = 0;
+  result->arenas = NULL;
 
   return result;
 }
@@ -173,19 +518,10 @@ jbig2_get_int16 (const byte *buf)
 }
 
 
-/**
- * jbig2_data_in: submit data for decoding
- * @ctx: The jbig2dec decoder context
- * @data: a pointer to the data buffer
- * @size: the size of the data buffer in bytes
- *
- * Copies the specified data into internal storage and attempts
- * to (continue to) parse it as part of a jbig2 data stream.
- *
- * Return code: 0 on success
- **/
-int
-jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
+/* append data to the context's internal buffer, compacting or
+   growing it as needed */
+static int
+jbig2_data_buffer (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
 {
   const size_t initial_buf_size = 1024;
 
@@ -197,6 +533,9 @@ jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
 	buf_size <<= 1;
       while (buf_size < size);
       ctx->buf = (byte *)jbig2_alloc(ctx->allocator, buf_size);
+      if (ctx->buf == NULL)
+        return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+          "failed to allocate %lu byte input buffer", (unsigned long)buf_size);
       ctx->buf_size = buf_size;
       ctx->buf_rd_ix = 0;
       ctx->buf_wr_ix = 0;
@@ -218,6 +557,9 @@ jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
 	    buf_size <<= 1;
 	  while (buf_size < ctx->buf_wr_ix - ctx->buf_rd_ix + size);
 	  buf = (byte *)jbig2_alloc(ctx->allocator, buf_size);
+	  if (buf == NULL)
+	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+	      "failed to grow input buffer to %lu bytes", (unsigned long)buf_size);
 	  memcpy(buf, ctx->buf + ctx->buf_rd_ix,
 		  ctx->buf_wr_ix - ctx->buf_rd_ix);
 	  jbig2_free(ctx->allocator, ctx->buf);
@@ -230,8 +572,14 @@ jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
   memcpy(ctx->buf + ctx->buf_wr_ix, data, size);
   ctx->buf_wr_ix += size;
 
-  /* data has now been added to buffer */
+  return 0;
+}
 
+/* parse as many headers and segments as the data between
+   ctx->buf_rd_ix and ctx->buf_wr_ix allows */
+static int
+jbig2_data_parse (Jbig2Ctx *ctx)
+{
   for (;;)
     {
       const byte jbig2_id_string[8] = { 0x97, 0x4a, 0x42, 0x32, 0x0d, 0x0a, 0x1a, 0x0a };
@@ -290,14 +638,39 @@ jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
 					  ctx->buf_wr_ix - ctx->buf_rd_ix,
 					  &header_size);
 	  if (segment == NULL)
-	    return 0; /* need more data */
-	  ctx->buf_rd_ix += header_size;
+	    {
+	      /* a complete header which couldn't be parsed has been
+	         reported already */
+	      if (header_size != 0)
+		return -1;
+	      return 0; /* need more data */
+	    }
 
 	  if (ctx->n_segments == ctx->n_segments_max)
-	    ctx->segments = (Jbig2Segment **)jbig2_realloc(ctx->allocator,
-                ctx->segments, (ctx->n_segments_max <<= 2) * sizeof(Jbig2Segment *));
+	    {
+	      Jbig2Segment **segments;
+	      Jbig2SegmentLookup *lookup;
 
+	      segments = (Jbig2Segment **)jbig2_realloc(ctx->allocator,
+                  ctx->segments, (ctx->n_segments_max << 2) * sizeof(Jbig2Segment *));
+	      if (segments != NULL)
+	        ctx->segments = segments;
+	      lookup = segments == NULL ? NULL :
+	        (Jbig2SegmentLookup *)jbig2_realloc(ctx->allocator,
+                  ctx->segment_lookup, (ctx->n_segments_max << 2) * sizeof(Jbig2SegmentLookup));
+	      if (lookup == NULL)
+	        {
+	          jbig2_free_segment(ctx, segment);
+	          return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+	            "failed to grow the segment list");
+	        }
+	      ctx->segment_lookup = lookup;
+	      ctx->n_segments_max <<= 2;
+	    }
+
+	  ctx->buf_rd_ix += header_size;
 	  ctx->segments[ctx->n_segments++] = segment;
+	  jbig2_segment_lookup_add(ctx, ctx->n_segments - 1);
 	  if (ctx->state == JBIG2_FILE_RANDOM_HEADERS)
 	    {
 	      if ((segment->flags & 63) == 51) /* end of file */
@@ -308,10 +681,16 @@ jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
 	  break;
 	case JBIG2_FILE_SEQUENTIAL_BODY:
 	case JBIG2_FILE_RANDOM_BODIES:
+	  if (ctx->state == JBIG2_FILE_RANDOM_BODIES &&
+	      (ctx->options & JBIG2_OPTIONS_RANDOM_ACCESS))
+	    return 0; /* bodies are decoded by jbig2_decode_page() */
 	  segment = ctx->segments[ctx->segment_index];
 	  if (segment->data_length > ctx->buf_wr_ix - ctx->buf_rd_ix)
 	    return 0; /* need more data */
-	  code = jbig2_parse_segment(ctx, segment, ctx->buf + ctx->buf_rd_ix);
+	  code = jbig2_parse_segment_polled(ctx, segment,
+					    ctx->buf + ctx->buf_rd_ix);
+	  if (ctx->interrupted)
+	    return JBIG2_INTERRUPTED; /* the body is decoded again */
 	  ctx->buf_rd_ix += segment->data_length;
 	  ctx->segment_index++;
 	  if (ctx->state == JBIG2_FILE_RANDOM_BODIES)
@@ -339,6 +718,79 @@ jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
   return 0;
 }
 
+/**
+ * jbig2_data_in: submit data for decoding
+ * @ctx: The jbig2dec decoder context
+ * @data: a pointer to the data buffer
+ * @size: the size of the data buffer in bytes
+ *
+ * Attempts to (continue to) parse the specified data as part of a
+ * jbig2 data stream.
+ *
+ * When no partial segment is left over from a previous call, the
+ * data is parsed in place and only an incomplete trailing segment
+ * (if any) is copied into internal storage. Passing a whole file or
+ * embedded stream in a single call therefore decodes it without an
+ * intermediate copy; the caller's buffer need only remain valid for
+ * the duration of the call.
+ *
+ * If the abort callback stops decoding, the data not yet decoded
+ * is kept and decoding resumes from it on the next call.
+ *
+ * Return code: 0 on success, JBIG2_INTERRUPTED if decoding was
+ * interrupted
+ **/
+int
+jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size)
+{
+  int code;
+
+  if (ctx->frozen)
+    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+        "data submitted to a frozen global context");
+  ctx->interrupted = FALSE;
+
+  if (ctx->buf_rd_ix == ctx->buf_wr_ix)
+    {
+      byte *buf = ctx->buf;
+      size_t buf_size = ctx->buf_size;
+      size_t consumed;
+
+      /* nothing buffered: decode directly from the caller's data.
+         the parsing routines only read through ctx->buf. */
+      ctx->buf = (byte *)data;
+      ctx->buf_size = size;
+      ctx->buf_rd_ix = 0;
+      ctx->buf_wr_ix = size;
+      code = jbig2_data_parse(ctx);
+      consumed = ctx->buf_rd_ix;
+
+      ctx->buf = buf;
+      ctx->buf_size = buf_size;
+      ctx->buf_rd_ix = 0;
+      ctx->buf_wr_ix = 0;
+
+      /* keep whatever wasn't parsed for the next call */
+      if (consumed < size)
+	{
+	  int buffered = jbig2_data_buffer(ctx, data + consumed, size - consumed);
+	  if (buffered < 0)
+	    code = buffered;
+	}
+
+      return code;
+    }
+
+  if (size > 0)
+    {
+      code = jbig2_data_buffer(ctx, data, size);
+      if (code < 0)
+	return code;
+    }
+
+  return jbig2_data_parse(ctx);
+}
+
 void
 jbig2_ctx_free (Jbig2Ctx *ctx)
 {
@@ -351,25 +803,115 @@ jbig2_ctx_free (Jbig2Ctx *ctx)
       jbig2_free_segment(ctx, ctx->segments[i]);
     jbig2_free(ca, ctx->segments);
   }
+  jbig2_free(ca, ctx->segment_lookup);
+
+  if (ctx->page_index != NULL) {
+    for (i = 0; i < ctx->n_page_index; i++)
+      jbig2_free(ca, ctx->page_index[i].segments);
+    jbig2_free(ca, ctx->page_index);
+  }
+  jbig2_free(ca, ctx->segment_offsets);
+  jbig2_free(ca, ctx->segment_decoded);
 
   if (ctx->pages != NULL) {
     for (i = 0; i <= ctx->current_page; i++)
       if (ctx->pages[i].image != NULL)
-	jbig2_image_release(ctx, ctx->pages[i].image);
+	jbig2_page_free_image(ctx, &ctx->pages[i]);
     jbig2_free(ca, ctx->pages);
   }
+  if (ctx->page_pool != NULL)
+    jbig2_image_release(ctx, ctx->page_pool);
+
+  /* only now that every segment has released its
+     references to images in the arenas */
+  while (ctx->arenas != NULL) {
+    Jbig2Arena *next = ctx->arenas->next;
+    jbig2_arena_free(ctx->arenas);
+    ctx->arenas = next;
+  }
+
+  jbig2_free(ctx->accounting.parent, ctx);
+}
+
+int
+jbig2_ctx_reset (Jbig2Ctx *ctx, Jbig2GlobalCtx *global_ctx)
+{
+  Jbig2Allocator *ca = ctx->allocator;
+  int i;
+
+  if (ctx->frozen)
+    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+        "can't reset a global context");
+
+  /* release everything the last stream decoded, in the same order
+     as jbig2_ctx_free() */
+  for (i = 0; i < ctx->n_segments; i++)
+    jbig2_free_segment(ctx, ctx->segments[i]);
+  ctx->n_segments = 0;
+  ctx->segment_index = 0;
+
+  if (ctx->page_index != NULL) {
+    for (i = 0; i < ctx->n_page_index; i++)
+      jbig2_free(ca, ctx->page_index[i].segments);
+    jbig2_free(ca, ctx->page_index);
+    ctx->page_index = NULL;
+  }
+  ctx->n_page_index = 0;
+  jbig2_free(ca, ctx->segment_offsets);
+  ctx->segment_offsets = NULL;
+  jbig2_free(ca, ctx->segment_decoded);
+  ctx->segment_decoded = NULL;
+  ctx->partial_page = 0;
+
+  for (i = 0; i < ctx->max_page_index; i++) {
+    if (ctx->pages[i].image != NULL)
+      jbig2_page_free_image(ctx, &ctx->pages[i]);
+    ctx->pages[i].state = JBIG2_PAGE_FREE;
+    ctx->pages[i].number = 0;
+  }
+  ctx->current_page = 0;
+
+  while (ctx->arenas != NULL) {
+    Jbig2Arena *next = ctx->arenas->next;
+    jbig2_arena_free(ctx->arenas);
+    ctx->arenas = next;
+  }
 
-  jbig2_free(ca, ctx);
+  ctx->global_ctx = (const Jbig2Ctx *)global_ctx;
+  ctx->state = (ctx->options & JBIG2_OPTIONS_EMBEDDED) ?
+    JBIG2_FILE_SEQUENTIAL_HEADER :
+    JBIG2_FILE_HEADER;
+  ctx->buf_rd_ix = 0;
+  ctx->buf_wr_ix = 0;
+  ctx->coded_bytes = 0;
+  ctx->interrupted = FALSE;
+  ctx->restarted = NULL;
+  ctx->accounting.peak = ctx->accounting.used;
+
+  return 0;
 }
 
 Jbig2GlobalCtx *jbig2_make_global_ctx (Jbig2Ctx *ctx)
 {
+  int i;
+
+  if (!ctx->frozen) {
+    for (i = 0; i < ctx->segment_index; i++)
+      jbig2_freeze_segment(ctx, ctx->segments[i], TRUE);
+    ctx->frozen = TRUE;
+  }
   return (Jbig2GlobalCtx *)ctx;
 }
 
 void jbig2_global_ctx_free(Jbig2GlobalCtx *global_ctx)
 {
-  jbig2_ctx_free((Jbig2Ctx *)global_ctx);
+  Jbig2Ctx *ctx = (Jbig2Ctx *)global_ctx;
+  int i;
+
+  /* restore the reference counts so the images are freed normally */
+  for (i = 0; i < ctx->segment_index; i++)
+    jbig2_freeze_segment(ctx, ctx->segments[i], FALSE);
+  jbig2_ctx_free(ctx);
 }
 
 
@@ -382,6 +924,7 @@ typedef struct {
   Jbig2WordStream super;
   const byte *data;
   size_t size;
+  size_t read;	/* how far into data words have been fetched */
 } Jbig2WordStreamBuf;
 
 static uint32_t
@@ -391,6 +934,8 @@ jbig2_word_stream_buf_get_next_word(Jbig2WordStream *self, int offset)
   const byte *data = z->data;
   uint32_t result;
 
+  if (offset + 4 > z->read)
+    z->read = offset + 4 < z->size ? offset + 4 : z->size;
   if (offset + 4 < z->size)
     result = (data[offset] << 24) | (data[offset + 1] << 16) |
       (data[offset + 2] << 8) | data[offset + 3];
@@ -412,9 +957,15 @@ jbig2_word_stream_buf_new(Jbig2Ctx *ctx, const byte *data, size_t size)
 {
   Jbig2WordStreamBuf *result = (Jbig2WordStreamBuf *)jbig2_alloc(ctx->allocator, sizeof(Jbig2WordStreamBuf));
 
+  if (result == NULL) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "failed to allocate word stream");
+    return NULL;
+  }
   result->super.get_next_word = jbig2_word_stream_buf_get_next_word;
   result->data = data;
   result->size = size;
+  result->read = 0;
 
   return &result->super;
 }
@@ -422,5 +973,1454 @@ jbig2_word_stream_buf_new(Jbig2Ctx *ctx, const byte *data, size_t size)
 void
 jbig2_word_stream_buf_free(Jbig2Ctx *ctx, Jbig2WordStream *ws)
 {
+  if (ws == NULL)
+    return;
+  ctx->coded_bytes += ((Jbig2WordStreamBuf *)ws)->read;
   jbig2_free(ctx->allocator, ws);
 }
+
+#ifdef TEST
+/* behaviour tests for the decoding options. The streams are made by
+   a minimal encoder: arithmetically coded generic regions, and symbol
+   dictionaries with text regions placing their symbols. */
+
+#include "jbig2_arith.h"
+#include "jbig2_image.h"
+
+static int test_failures = 0;
+static unsigned int test_seed = 1;
+
+static void
+test_check(int ok, const char *what)
+{
+  if (!ok) {
+    fprintf(stderr, "FAILED: %s\n", what);
+    test_failures++;
+  }
+}
+
+static int
+test_rand(int n)
+{
+  test_seed = test_seed * 1103515245 + 12345;
+  return (test_seed >> 16) % n;
+}
+
+/* growable byte buffer for the encoded data */
+typedef struct {
+  byte *data;
+  size_t size, max;
+} TestBuf;
+
+static void
+test_byte(TestBuf *b, int c)
+{
+  if (b->size == b->max) {
+    b->max = b->max ? b->max << 1 : 256;
+    b->data = realloc(b->data, b->max);
+    if (b->data == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  b->data[b->size++] = (byte)c;
+}
+
+static void
+test_int16(TestBuf *b, int v)
+{
+  test_byte(b, (v >> 8) & 0xff);
+  test_byte(b, v & 0xff);
+}
+
+static void
+test_int32(TestBuf *b, uint32_t v)
+{
+  test_int16(b, v >> 16);
+  test_int16(b, v & 0xffff);
+}
+
+static void
+test_bytes(TestBuf *b, const byte *data, size_t size)
+{
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    test_byte(b, data[i]);
+}
+
+/* MQ encoder, Annex E. Contexts are kept the way the decoder keeps
+   them, the state index with the MPS in the top bit. */
+typedef struct {
+  uint32_t A, C;
+  int CT, B;
+  bool started;
+  TestBuf *out;
+} TestMQ;
+
+static const struct {
+  uint16_t Qe;
+  byte NMPS, NLPS, SWITCH;
+} test_qe[47] = {
+  { 0x5601,  1,  1, 1 }, { 0x3401,  2,  6, 0 }, { 0x1801,  3,  9, 0 },
+  { 0x0AC1,  4, 12, 0 }, { 0x0521,  5, 29, 0 }, { 0x0221, 38, 33, 0 },
+  { 0x5601,  7,  6, 1 }, { 0x5401,  8, 14, 0 }, { 0x4801,  9, 14, 0 },
+  { 0x3801, 10, 14, 0 }, { 0x3001, 11, 17, 0 }, { 0x2401, 12, 18, 0 },
+  { 0x1C01, 13, 20, 0 }, { 0x1601, 29, 21, 0 }, { 0x5601, 15, 14, 1 },
+  { 0x5401, 16, 14, 0 }, { 0x5101, 17, 15, 0 }, { 0x4801, 18, 16, 0 },
+  { 0x3801, 19, 17, 0 }, { 0x3401, 20, 18, 0 }, { 0x3001, 21, 19, 0 },
+  { 0x2801, 22, 19, 0 }, { 0x2401, 23, 20, 0 }, { 0x2201, 24, 21, 0 },
+  { 0x1C01, 25, 22, 0 }, { 0x1801, 26, 23, 0 }, { 0x1601, 27, 24, 0 },
+  { 0x1401, 28, 25, 0 }, { 0x1201, 29, 26, 0 }, { 0x1101, 30, 27, 0 },
+  { 0x0AC1, 31, 28, 0 }, { 0x09C1, 32, 29, 0 }, { 0x08A1, 33, 30, 0 },
+  { 0x0521, 34, 31, 0 }, { 0x0441, 35, 32, 0 }, { 0x02A1, 36, 33, 0 },
+  { 0x0221, 37, 34, 0 }, { 0x0141, 38, 35, 0 }, { 0x0111, 39, 36, 0 },
+  { 0x0085, 40, 37, 0 }, { 0x0049, 41, 38, 0 }, { 0x0025, 42, 39, 0 },
+  { 0x0015, 43, 40, 0 }, { 0x0009, 44, 41, 0 }, { 0x0005, 45, 42, 0 },
+  { 0x0001, 45, 43, 0 }, { 0x5601, 46, 46, 0 }
+};
+
+static void
+test_mq_start(TestMQ *mq, TestBuf *out)
+{
+  mq->A = 0x8000;
+  mq->C = 0;
+  mq->CT = 12;
+  mq->B = 0;
+  mq->started = FALSE;
+  mq->out = out;
+}
+
+/* Figure E.7, with B the byte not yet written out */
+static void
+test_mq_byteout(TestMQ *mq)
+{
+  if (mq->B != 0xff && mq->C >= 0x8000000) {
+    mq->B++;
+    mq->C &= 0x7ffffff;
+  }
+  if (mq->started)
+    test_byte(mq->out, mq->B);
+  mq->started = TRUE;
+  if (mq->B == 0xff) {
+    mq->B = mq->C >> 20;
+    mq->C &= 0xfffff;
+    mq->CT = 7;
+  } else {
+    mq->B = mq->C >> 19;
+    mq->C &= 0x7ffff;
+    mq->CT = 8;
+  }
+}
+
+static void
+test_mq_encode(TestMQ *mq, Jbig2ArithCx *cx, int D)
+{
+  const int I = *cx & 0x7f;
+  int MPS = *cx >> 7;
+  const uint32_t Qe = test_qe[I].Qe;
+
+  mq->A -= Qe;
+  if (D == MPS) {
+    if (mq->A & 0x8000) {
+      mq->C += Qe;
+      return;
+    }
+    if (mq->A < Qe)
+      mq->A = Qe;
+    else
+      mq->C += Qe;
+    *cx = test_qe[I].NMPS | (MPS << 7);
+  } else {
+    if (mq->A < Qe)
+      mq->C += Qe;
+    else
+      mq->A = Qe;
+    if (test_qe[I].SWITCH)
+      MPS = !MPS;
+    *cx = test_qe[I].NLPS | (MPS << 7);
+  }
+  do {
+    mq->A <<= 1;
+    mq->C <<= 1;
+    if (--mq->CT == 0)
+      test_mq_byteout(mq);
+  } while (!(mq->A & 0x8000));
+}
+
+/* Figure E.10, then the 0xff 0xac marker ending the data */
+static void
+test_mq_flush(TestMQ *mq)
+{
+  const uint32_t tempc = mq->C + mq->A;
+
+  mq->C |= 0xffff;
+  if (mq->C >= tempc)
+    mq->C -= 0x8000;
+  mq->C <<= mq->CT;
+  test_mq_byteout(mq);
+  mq->C <<= mq->CT;
+  test_mq_byteout(mq);
+  if (mq->B != 0xff)
+    test_byte(mq->out, mq->B);
+  test_byte(mq->out, 0xff);
+  test_byte(mq->out, 0xac);
+}
+
+/* A.2, the inverse of jbig2_arith_int_decode() */
+static void
+test_mq_int(TestMQ *mq, Jbig2ArithCx *IAx, int32_t value, bool oob)
+{
+  static const struct {
+    uint32_t limit;
+    int prefix, prefix_len, n_tail;
+  } ranges[6] = {
+    { 4, 0x0, 1, 2 }, { 20, 0x2, 2, 4 }, { 84, 0x6, 3, 6 },
+    { 340, 0xe, 4, 8 }, { 4436, 0x1e, 5, 12 }, { 0xffffffff, 0x1f, 5, 32 }
+  };
+  const int S = oob || value < 0;
+  uint32_t V = oob ? 0 : value < 0 ? -value : value;
+  uint32_t offset = 0;
+  int PREV = 1;
+  int r, i, bit;
+
+  test_mq_encode(mq, &IAx[PREV], S);
+  PREV = (PREV << 1) | S;
+  for (r = 0; V >= ranges[r].limit; r++)
+    offset = ranges[r].limit;
+  for (i = ranges[r].prefix_len - 1; i >= 0; i--) {
+    bit = (ranges[r].prefix >> i) & 1;
+    test_mq_encode(mq, &IAx[PREV], bit);
+    PREV = (PREV << 1) | bit;
+  }
+  V -= offset;
+  for (i = ranges[r].n_tail - 1; i >= 0; i--) {
+    bit = (V >> i) & 1;
+    test_mq_encode(mq, &IAx[PREV], bit);
+    PREV = ((PREV << 1) & 511) | (PREV & 256) | bit;
+  }
+}
+
+/* A.3 */
+static void
+test_mq_iaid(TestMQ *mq, Jbig2ArithCx *IAIDx, int codelen, int id)
+{
+  int PREV = 1;
+  int i, bit;
+
+  for (i = codelen - 1; i >= 0; i--) {
+    bit = (id >> i) & 1;
+    test_mq_encode(mq, &IAIDx[PREV], bit);
+    PREV = (PREV << 1) | bit;
+  }
+}
+
+/* the nominal adaptive template pixels for template 0 */
+static const int test_at[8] = { 3, -1, -3, -1, 2, -2, -2, -2 };
+
+/* 6.2.5.3, template 0 without typical prediction */
+static void
+test_mq_generic(TestMQ *mq, Jbig2ArithCx *GB_stats, Jbig2Image *image)
+{
+  int x, y;
+
+  for (y = 0; y < image->height; y++)
+    for (x = 0; x < image->width; x++) {
+      uint32_t CONTEXT = 0;
+
+      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y) << 0;
+      CONTEXT |= jbig2_image_get_pixel(image, x - 2, y) << 1;
+      CONTEXT |= jbig2_image_get_pixel(image, x - 3, y) << 2;
+      CONTEXT |= jbig2_image_get_pixel(image, x - 4, y) << 3;
+      CONTEXT |= jbig2_image_get_pixel(image, x + test_at[0], y + test_at[1]) << 4;
+      CONTEXT |= jbig2_image_get_pixel(image, x + 2, y - 1) << 5;
+      CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 6;
+      CONTEXT |= jbig2_image_get_pixel(image, x + 0, y - 1) << 7;
+      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 8;
+      CONTEXT |= jbig2_image_get_pixel(image, x - 2, y - 1) << 9;
+      CONTEXT |= jbig2_image_get_pixel(image, x + test_at[2], y + test_at[3]) << 10;
+      CONTEXT |= jbig2_image_get_pixel(image, x + test_at[4], y + test_at[5]) << 11;
+      CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 2) << 12;
+      CONTEXT |= jbig2_image_get_pixel(image, x + 0, y - 2) << 13;
+      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 2) << 14;
+      CONTEXT |= jbig2_image_get_pixel(image, x + test_at[6], y + test_at[7]) << 15;
+      test_mq_encode(mq, &GB_stats[CONTEXT], jbig2_image_get_pixel(image, x, y));
+    }
+}
+
+/* segment bodies */
+
+static void
+test_page_info(TestBuf *b, uint32_t width, uint32_t height, int stripe_size)
+{
+  test_int32(b, width);
+  test_int32(b, height);
+  test_int32(b, 0);	/* resolution unknown */
+  test_int32(b, 0);
+  test_byte(b, 0);	/* default pixel 0, combination operator OR */
+  test_int16(b, stripe_size ? 0x8000 | stripe_size : 0);
+}
+
+/* 7.4.1 */
+static void
+test_region_info(TestBuf *b, int width, int height, int x, int y,
+                 Jbig2ComposeOp op)
+{
+  test_int32(b, width);
+  test_int32(b, height);
+  test_int32(b, x);
+  test_int32(b, y);
+  test_byte(b, op);
+}
+
+static void
+test_generic_region(TestBuf *b, Jbig2Image *image, int x, int y,
+                    Jbig2ComposeOp op)
+{
+  Jbig2ArithCx *GB_stats = calloc(65536, 1);
+  TestMQ mq;
+  int i;
+
+  test_region_info(b, image->width, image->height, x, y, op);
+  test_byte(b, 0);	/* arithmetic coding, template 0, no TPGDON */
+  for (i = 0; i < 8; i++)
+    test_byte(b, test_at[i] & 0xff);
+  test_mq_start(&mq, b);
+  test_mq_generic(&mq, GB_stats, image);
+  test_mq_flush(&mq);
+  free(GB_stats);
+}
+
+/* all the symbols are exported, each in a height class of its own,
+   after the n_inputs symbols of the dictionaries referred to */
+static void
+test_symbol_dict(TestBuf *b, int n_inputs, Jbig2Image **symbols,
+                 int n_symbols)
+{
+  Jbig2ArithCx *GB_stats = calloc(65536, 1);
+  Jbig2ArithCx IADH[512], IADW[512], IAEX[512];
+  TestMQ mq;
+  int height = 0;
+  int i;
+
+  memset(IADH, 0, sizeof(IADH));
+  memset(IADW, 0, sizeof(IADW));
+  memset(IAEX, 0, sizeof(IAEX));
+  test_int16(b, 0);	/* arithmetic coding, no refinement, template 0 */
+  for (i = 0; i < 8; i++)
+    test_byte(b, test_at[i] & 0xff);
+  test_int32(b, n_inputs + n_symbols);	/* SDNUMEXSYMS */
+  test_int32(b, n_symbols);	/* SDNUMNEWSYMS */
+  test_mq_start(&mq, b);
+  for (i = 0; i < n_symbols; i++) {
+    test_mq_int(&mq, IADH, symbols[i]->height - height, FALSE);
+    height = symbols[i]->height;
+    test_mq_int(&mq, IADW, symbols[i]->width, FALSE);
+    test_mq_generic(&mq, GB_stats, symbols[i]);
+    test_mq_int(&mq, IADW, 0, TRUE);
+  }
+  /* a run of no symbols not exported, then all of them */
+  test_mq_int(&mq, IAEX, 0, FALSE);
+  test_mq_int(&mq, IAEX, n_inputs + n_symbols, FALSE);
+  test_mq_flush(&mq);
+  free(GB_stats);
+}
+
+typedef struct {
+  int x, y, id;
+} TestInstance;
+
+/* one strip, top left reference corner, each instance in a strip
+   of its own so they can go anywhere */
+static void
+test_text_region(TestBuf *b, int width, int height, int x, int y,
+                 Jbig2ComposeOp op, int n_symbols,
+                 const TestInstance *instances, int n)
+{
+  Jbig2ArithCx IADT[512], IAFS[512], IADS[512], IAID[256];
+  TestMQ mq;
+  int STRIPT = 0, FIRSTS = 0;
+  int codelen, i;
+
+  memset(IADT, 0, sizeof(IADT));
+  memset(IAFS, 0, sizeof(IAFS));
+  memset(IADS, 0, sizeof(IADS));
+  memset(IAID, 0, sizeof(IAID));
+  for (codelen = 0; (1 << codelen) < n_symbols; codelen++);
+  test_region_info(b, width, height, x, y, op);
+  test_int16(b, 0x0010);	/* arithmetic, one strip, TOPLEFT, OR */
+  test_int32(b, n);
+  test_mq_start(&mq, b);
+  test_mq_int(&mq, IADT, 0, FALSE);
+  for (i = 0; i < n; i++) {
+    test_mq_int(&mq, IADT, instances[i].y - STRIPT, FALSE);
+    STRIPT = instances[i].y;
+    test_mq_int(&mq, IAFS, instances[i].x - FIRSTS, FALSE);
+    FIRSTS = instances[i].x;
+    test_mq_iaid(&mq, IAID, codelen, instances[i].id);
+    test_mq_int(&mq, IADS, 0, TRUE);
+  }
+  test_mq_flush(&mq);
+}
+
+/* a file under construction. In the random-access organization the
+   segment headers come first, then all the bodies. */
+typedef struct {
+  TestBuf file;
+  TestBuf bodies;
+  bool random_access;
+  uint32_t n_segments;
+} TestStream;
+
+static void
+test_stream_start(TestStream *s, bool random_access, int n_pages)
+{
+  static const byte id[8] = { 0x97, 0x4a, 0x42, 0x32, 0x0d, 0x0a, 0x1a, 0x0a };
+
+  memset(s, 0, sizeof(*s));
+  s->random_access = random_access;
+  test_bytes(&s->file, id, 8);
+  test_byte(&s->file, random_access ? 0 : 1);
+  test_int32(&s->file, n_pages);
+}
+
+/* add a segment, returning its number */
+static uint32_t
+test_segment(TestStream *s, int type, uint32_t page,
+             const uint32_t *referred, int n_referred, const TestBuf *data)
+{
+  const size_t size = data != NULL ? data->size : 0;
+  int i;
+
+  test_int32(&s->file, s->n_segments);
+  test_byte(&s->file, type);
+  test_byte(&s->file, n_referred << 5);
+  for (i = 0; i < n_referred; i++)
+    test_byte(&s->file, referred[i]);
+  test_byte(&s->file, page);
+  test_int32(&s->file, size);
+  if (size)
+    test_bytes(s->random_access ? &s->bodies : &s->file, data->data, size);
+  return s->n_segments++;
+}
+
+/* finish the file, leaving it in s->file */
+static void
+test_stream_end(TestStream *s)
+{
+  test_segment(s, 51, 0, NULL, 0, NULL);	/* end of file */
+  test_bytes(&s->file, s->bodies.data, s->bodies.size);
+  free(s->bodies.data);
+  s->bodies.data = NULL;
+}
+
+/* images made of a few random rectangles */
+static Jbig2Image *
+test_random_image(Jbig2Ctx *ctx, int width, int height)
+{
+  Jbig2Image *image = jbig2_image_new(ctx, width, height);
+  int n, x, y;
+
+  jbig2_image_clear(ctx, image, 0);
+  for (n = 0; n < 4; n++) {
+    const int x0 = test_rand(width), y0 = test_rand(height);
+    const int x1 = x0 + 1 + test_rand(width - x0);
+    const int y1 = y0 + 1 + test_rand(height - y0);
+
+    for (y = y0; y < y1; y++)
+      for (x = x0; x < x1; x++)
+        jbig2_image_set_pixel(image, x, y, !jbig2_image_get_pixel(image, x, y));
+  }
+  return image;
+}
+
+#define TEST_SYMBOLS 5
+#define TEST_INSTANCES 12
+
+/* build a document of n_pages pages of the given size, each with a
+   generic region and a text region placing symbols from a dictionary
+   shared by all of them, and make the pages it should decode to.
+   The first page's generic region is as wide as the page. */
+static void
+test_document(Jbig2Ctx *ctx, TestBuf *file, bool random_access,
+              int n_pages, int width, int height, Jbig2Image **pages)
+{
+  Jbig2Image *symbols[TEST_SYMBOLS];
+  TestInstance instances[TEST_INSTANCES];
+  TestStream s;
+  TestBuf b;
+  uint32_t dict;
+  int p, i;
+
+  test_stream_start(&s, random_access, n_pages);
+  for (i = 0; i < TEST_SYMBOLS; i++)
+    symbols[i] = test_random_image(ctx, 3 + test_rand(10), 4 + test_rand(11));
+  memset(&b, 0, sizeof(b));
+  test_symbol_dict(&b, 0, symbols, TEST_SYMBOLS);
+  dict = test_segment(&s, 0, 0, NULL, 0, &b);
+
+  for (p = 0; p < n_pages; p++) {
+    const int gw = p ? 1 + test_rand(width) : width;
+    const int gh = 1 + test_rand(height);
+    const int gx = p ? test_rand(width - gw + 1) : 0;
+    const int gy = test_rand(height - gh + 1);
+    const int tw = 24 + test_rand(width - 23), th = 24 + test_rand(height - 23);
+    const int tx = test_rand(width - tw + 1), ty = test_rand(height - th + 1);
+    Jbig2Image *region = test_random_image(ctx, gw, gh);
+
+    pages[p] = jbig2_image_new(ctx, width, height);
+    jbig2_image_clear(ctx, pages[p], 0);
+
+    b.size = 0;
+    test_page_info(&b, width, height, 0);
+    test_segment(&s, 48, p + 1, NULL, 0, &b);
+
+    b.size = 0;
+    test_generic_region(&b, region, gx, gy, JBIG2_COMPOSE_OR);
+    test_segment(&s, 38, p + 1, NULL, 0, &b);
+    jbig2_image_compose(ctx, pages[p], region, gx, gy, JBIG2_COMPOSE_OR);
+    jbig2_image_release(ctx, region);
+
+    for (i = 0; i < TEST_INSTANCES; i++) {
+      const Jbig2Image *symbol;
+
+      instances[i].id = test_rand(TEST_SYMBOLS);
+      symbol = symbols[instances[i].id];
+      instances[i].x = test_rand(tw - symbol->width + 1);
+      instances[i].y = test_rand(th - symbol->height + 1);
+      jbig2_image_compose(ctx, pages[p], symbols[instances[i].id],
+                          tx + instances[i].x, ty + instances[i].y,
+                          JBIG2_COMPOSE_OR);
+    }
+    b.size = 0;
+    test_text_region(&b, tw, th, tx, ty, JBIG2_COMPOSE_OR,
+                     TEST_SYMBOLS, instances, TEST_INSTANCES);
+    test_segment(&s, 6, p + 1, &dict, 1, &b);
+
+    test_segment(&s, 49, p + 1, NULL, 0, NULL);	/* end of page */
+  }
+  test_stream_end(&s);
+  free(b.data);
+  for (i = 0; i < TEST_SYMBOLS; i++)
+    jbig2_image_release(ctx, symbols[i]);
+  *file = s.file;
+}
+
+static bool
+test_same_image(Jbig2Image *a, Jbig2Image *b)
+{
+  int x, y;
+
+  if (a == NULL || b == NULL || a->width != b->width || a->height != b->height)
+    return FALSE;
+  for (y = 0; y < a->height; y++)
+    for (x = 0; x < a->width; x++)
+      if (jbig2_image_get_pixel(a, x, y) != jbig2_image_get_pixel(b, x, y))
+        return FALSE;
+  return TRUE;
+}
+
+static int
+test_quiet_error(void *data, const char *msg, Jbig2Severity severity,
+                 int32_t seg_idx)
+{
+  return 0;
+}
+
+static Jbig2Ctx *
+test_ctx_new(Jbig2Options options)
+{
+  Jbig2Ctx *ctx = jbig2_ctx_new(NULL, options, NULL, test_quiet_error, NULL);
+
+  jbig2_set_min_severity(ctx, JBIG2_SEVERITY_FATAL);
+  return ctx;
+}
+
+/* a context for making the test data and expected pages */
+static Jbig2Ctx *test_ref;
+
+/* decode a whole file, checking that its pages come out in order */
+static void
+test_decode_file(Jbig2Ctx *ctx, const TestBuf *file, Jbig2Image **pages,
+                 int n_pages, const char *what)
+{
+  Jbig2Image *image;
+  int p;
+
+  test_check(jbig2_data_in(ctx, file->data, file->size) == 0, what);
+  for (p = 0; p < n_pages; p++) {
+    image = jbig2_page_out(ctx);
+    test_check(test_same_image(image, pages[p]), what);
+    jbig2_release_page(ctx, image);
+  }
+  test_check(jbig2_page_out(ctx) == NULL, what);
+}
+
+static void
+test_free_pages(Jbig2Image **pages, int n_pages)
+{
+  int p;
+
+  for (p = 0; p < n_pages; p++)
+    jbig2_image_release(test_ref, pages[p]);
+}
+
+/* pages of a random-access file decoded out of order are the same
+   as those of the file decoded in order */
+static void
+test_random_access(void)
+{
+  static const uint32_t order[3] = { 3, 1, 2 };
+  Jbig2Image *pages[3];
+  Jbig2Ctx *ctx;
+  TestBuf file;
+  int i;
+
+  test_document(test_ref, &file, FALSE, 3, 80, 60, pages);
+  ctx = test_ctx_new(0);
+  test_decode_file(ctx, &file, pages, 3, "sequential file");
+  jbig2_ctx_free(ctx);
+  free(file.data);
+  test_free_pages(pages, 3);
+
+  test_document(test_ref, &file, TRUE, 3, 80, 60, pages);
+  ctx = test_ctx_new(0);
+  test_decode_file(ctx, &file, pages, 3, "random-access file, in order");
+  jbig2_ctx_free(ctx);
+
+  ctx = test_ctx_new(JBIG2_OPTIONS_RANDOM_ACCESS);
+  test_check(jbig2_data_in(ctx, file.data, file.size) == 0, "random access headers");
+  test_check(jbig2_page_out(ctx) == NULL, "random access decodes on request");
+  for (i = 0; i < 3; i++) {
+    Jbig2Image *image;
+
+    test_check(jbig2_decode_page(ctx, order[i]) == 0, "random access decode");
+    image = jbig2_page_out(ctx);
+    test_check(test_same_image(image, pages[order[i] - 1]), "random access page");
+    jbig2_release_page(ctx, image);
+  }
+  test_check(jbig2_decode_page(ctx, 4) < 0, "random access to a missing page");
+  jbig2_ctx_free(ctx);
+  free(file.data);
+  test_free_pages(pages, 3);
+}
+
+/* stops decoding at the given poll of the abort callback */
+static int
+test_abort_after(void *data)
+{
+  int *polls = (int *)data;
+
+  return (*polls)-- == 0;
+}
+
+/* a page of a random-access file interrupted at any point and then
+   given up for another page leaves nothing behind: the other page
+   comes out right, and the interrupted one when asked for again */
+static void
+test_page_switch(void)
+{
+  Jbig2Image *pages[3];
+  Jbig2Image *image;
+  Jbig2Ctx *ctx;
+  TestBuf file;
+  int stop, polls, code;
+
+  test_document(test_ref, &file, TRUE, 3, 80, 60, pages);
+  for (stop = 0; stop < 100; stop++) {
+    ctx = test_ctx_new(JBIG2_OPTIONS_RANDOM_ACCESS);
+    test_check(jbig2_data_in(ctx, file.data, file.size) == 0, "page switch headers");
+    polls = stop;
+    jbig2_set_abort_callback(ctx, test_abort_after, &polls);
+    code = jbig2_decode_page(ctx, 3);
+    jbig2_set_abort_callback(ctx, NULL, NULL);
+    if (code == 0) {
+      jbig2_ctx_free(ctx);
+      break;
+    }
+    test_check(code == JBIG2_INTERRUPTED, "page switch interrupted");
+
+    test_check(jbig2_decode_page(ctx, 1) == 0, "page switch decode");
+    image = jbig2_page_out(ctx);
+    test_check(test_same_image(image, pages[0]), "page switch, other page");
+    jbig2_release_page(ctx, image);
+    test_check(jbig2_page_out(ctx) == NULL, "page switch, no partial page");
+
+    test_check(jbig2_decode_page(ctx, 3) == 0, "page switch decode again");
+    image = jbig2_page_out(ctx);
+    test_check(test_same_image(image, pages[2]), "page switch, interrupted page");
+    jbig2_release_page(ctx, image);
+    test_check(jbig2_page_out(ctx) == NULL, "page switch, no more pages");
+    jbig2_ctx_free(ctx);
+  }
+  test_check(stop > 2 && stop < 100, "page switch, interrupt points");
+  free(file.data);
+  test_free_pages(pages, 3);
+}
+
+typedef struct {
+  int polls;
+  int every;
+} TestBudget;
+
+/* stops decoding at every few polls of the abort callback */
+static int
+test_abort_every(void *data)
+{
+  TestBudget *budget = (TestBudget *)data;
+
+  return ++budget->polls % budget->every == 0;
+}
+
+/* decoding asked to stop at every poll, or every few, still gets
+   through a document over repeated calls */
+static void
+test_resume(void)
+{
+  Jbig2Image *pages[3];
+  Jbig2Image *image;
+  TestBudget budget;
+  TestBuf file;
+  Jbig2Ctx *ctx;
+  int calls, code, p;
+
+  test_document(test_ref, &file, FALSE, 3, 80, 300, pages);
+  for (budget.every = 1; budget.every <= 4; budget.every++) {
+    ctx = test_ctx_new(0);
+    budget.polls = 0;
+    jbig2_set_abort_callback(ctx, test_abort_every, &budget);
+    code = jbig2_data_in(ctx, file.data, file.size);
+    for (calls = 1, p = 0; code == JBIG2_INTERRUPTED && calls < 1000; calls++) {
+      while ((image = jbig2_page_out(ctx)) != NULL) {
+        test_check(p < 3 && test_same_image(image, pages[p]), "resume, page");
+        jbig2_release_page(ctx, image);
+        p++;
+      }
+      code = jbig2_data_in(ctx, NULL, 0);
+    }
+    test_check(code == 0 && calls > 1, "resume, finished");
+    while ((image = jbig2_page_out(ctx)) != NULL) {
+      test_check(p < 3 && test_same_image(image, pages[p]), "resume, page");
+      jbig2_release_page(ctx, image);
+      p++;
+    }
+    test_check(p == 3, "resume, all pages");
+    jbig2_ctx_free(ctx);
+  }
+  free(file.data);
+  test_free_pages(pages, 3);
+
+  test_document(test_ref, &file, TRUE, 3, 80, 300, pages);
+  ctx = test_ctx_new(JBIG2_OPTIONS_RANDOM_ACCESS);
+  test_check(jbig2_data_in(ctx, file.data, file.size) == 0, "resume, headers");
+  budget.every = 1;
+  jbig2_set_abort_callback(ctx, test_abort_every, &budget);
+  for (calls = 0; (code = jbig2_decode_page(ctx, 2)) == JBIG2_INTERRUPTED &&
+       calls < 1000; calls++)
+    ;
+  test_check(code == 0 && calls > 0, "resume, random access");
+  image = jbig2_page_out(ctx);
+  test_check(test_same_image(image, pages[1]), "resume, random access page");
+  jbig2_release_page(ctx, image);
+  jbig2_ctx_free(ctx);
+  free(file.data);
+  test_free_pages(pages, 3);
+}
+
+/* with a page pool, a page released before the next one starts
+   lends it its image, which must be cleared for the new page. The
+   file is fed a byte at a time, which also tests the buffering. */
+static void
+test_page_pool(void)
+{
+  Jbig2Image *pages[3];
+  Jbig2Image *pooled = NULL;
+  Jbig2Ctx *ctx;
+  TestBuf file;
+  size_t i;
+  int p = 0;
+
+  test_document(test_ref, &file, FALSE, 3, 80, 60, pages);
+  ctx = test_ctx_new(JBIG2_OPTIONS_PAGE_POOL);
+  for (i = 0; i < file.size; i++) {
+    Jbig2Image *image;
+
+    test_check(jbig2_data_in(ctx, file.data + i, 1) == 0, "page pool data");
+    image = jbig2_page_out(ctx);
+    if (image == NULL)
+      continue;
+    test_check(p < 3 && test_same_image(image, pages[p]), "page pool page");
+    if (p == 0)
+      pooled = image;
+    else
+      test_check(image == pooled, "page pool reuses the image");
+    jbig2_release_page(ctx, image);
+    p++;
+  }
+  test_check(p == 3, "page pool pages");
+  jbig2_ctx_free(ctx);
+  free(file.data);
+  test_free_pages(pages, 3);
+}
+
+typedef struct {
+  int x, y, width, height;
+  Jbig2ComposeOp op;
+  bool text;
+} TestRegion;
+
+static int
+test_count_in_place(void *data, const char *msg, Jbig2Severity severity,
+                    int32_t seg_idx)
+{
+  if (strstr(msg, "directly into page") != NULL)
+    (*(int *)data)++;
+  return 0;
+}
+
+/* regions as wide as the page and below the rows already drawn are
+   decoded straight into the page, which must give the same page as
+   composing them. The page width leaves padding bits in each row. */
+static void
+test_in_place(void)
+{
+  static const TestRegion regions[6] = {
+    { 0, 0, 77, 10, JBIG2_COMPOSE_OR, FALSE },
+    { 0, 20, 77, 10, JBIG2_COMPOSE_REPLACE, FALSE },
+    { 0, 25, 77, 10, JBIG2_COMPOSE_OR, FALSE },	/* over drawn rows */
+    { 0, 35, 77, 15, JBIG2_COMPOSE_OR, TRUE },
+    { 5, 10, 30, 8, JBIG2_COMPOSE_OR, FALSE },	/* not full width */
+    { 0, 4, 77, 10, JBIG2_COMPOSE_OR, TRUE }	/* over drawn rows */
+  };
+  Jbig2Image *symbols[TEST_SYMBOLS];
+  TestInstance instances[TEST_INSTANCES];
+  Jbig2Image *page, *image;
+  Jbig2Ctx *ctx;
+  TestStream s;
+  TestBuf b;
+  uint32_t dict;
+  int in_place = 0;
+  int r, i;
+
+  test_stream_start(&s, FALSE, 1);
+  for (i = 0; i < TEST_SYMBOLS; i++)
+    symbols[i] = test_random_image(test_ref, 3 + test_rand(10), 4 + test_rand(6));
+  memset(&b, 0, sizeof(b));
+  test_symbol_dict(&b, 0, symbols, TEST_SYMBOLS);
+  dict = test_segment(&s, 0, 0, NULL, 0, &b);
+  b.size = 0;
+  test_page_info(&b, 77, 50, 0);
+  test_segment(&s, 48, 1, NULL, 0, &b);
+  page = jbig2_image_new(test_ref, 77, 50);
+  jbig2_image_clear(test_ref, page, 0);
+
+  for (r = 0; r < 6; r++) {
+    const TestRegion *region = &regions[r];
+
+    b.size = 0;
+    if (region->text) {
+      image = jbig2_image_new(test_ref, region->width, region->height);
+      jbig2_image_clear(test_ref, image, 0);
+      for (i = 0; i < TEST_INSTANCES; i++) {
+        const Jbig2Image *symbol;
+
+        instances[i].id = test_rand(TEST_SYMBOLS);
+        symbol = symbols[instances[i].id];
+        instances[i].x = test_rand(region->width - symbol->width + 1);
+        instances[i].y = test_rand(region->height - symbol->height + 1);
+        jbig2_image_compose(test_ref, image, symbols[instances[i].id],
+                            instances[i].x, instances[i].y, JBIG2_COMPOSE_OR);
+      }
+      test_text_region(&b, region->width, region->height, region->x,
+                       region->y, region->op, TEST_SYMBOLS, instances,
+                       TEST_INSTANCES);
+      test_segment(&s, 6, 1, &dict, 1, &b);
+    } else {
+      image = test_random_image(test_ref, region->width, region->height);
+      test_generic_region(&b, image, region->x, region->y, region->op);
+      test_segment(&s, 38, 1, NULL, 0, &b);
+    }
+    /* the page only composes regions with OR, which is all the same
+       for REPLACE onto rows that haven't been drawn yet */
+    jbig2_image_compose(test_ref, page, image, region->x, region->y,
+                        JBIG2_COMPOSE_OR);
+    jbig2_image_release(test_ref, image);
+  }
+  test_segment(&s, 49, 1, NULL, 0, NULL);
+  test_stream_end(&s);
+  free(b.data);
+
+  ctx = jbig2_ctx_new(NULL, 0, NULL, test_count_in_place, &in_place);
+  test_decode_file(ctx, &s.file, &page, 1, "regions decoded in place");
+  test_check(in_place == 3, "regions decoded in place");
+  jbig2_ctx_free(ctx);
+
+  free(s.file.data);
+  jbig2_image_release(test_ref, page);
+  for (i = 0; i < TEST_SYMBOLS; i++)
+    jbig2_image_release(test_ref, symbols[i]);
+}
+
+/* the arena hands out aligned memory that keeps its contents
+   when it's reallocated, small or large, and symbol dictionaries
+   decoded into arenas give the same pages */
+static void
+test_arena(void)
+{
+  Jbig2Image *pages[3];
+  byte *p[64];
+  size_t sizes[64];
+  Jbig2Arena *arena;
+  Jbig2Ctx *ctx;
+  TestBuf file;
+  int i, j, ok = TRUE;
+
+  ctx = test_ctx_new(0);
+  arena = jbig2_arena_new(ctx->allocator);
+  for (i = 0; i < 64; i++) {
+    sizes[i] = i % 8 == 7 ? 20000 + test_rand(40000) : 1 + test_rand(300);
+    p[i] = jbig2_alloc(&arena->allocator, sizes[i]);
+    if (p[i] == NULL || (size_t)p[i] % sizeof(double) != 0)
+      ok = FALSE;
+    else
+      memset(p[i], i, sizes[i]);
+  }
+  for (i = 0; ok && i < 64; i++) {
+    /* grow some, shrink others, and from small to large */
+    const size_t size = i % 3 == 0 ? sizes[i] / 2 + 1 :
+      i % 3 == 1 ? sizes[i] * 2 : sizes[i] + 30000;
+    byte *q = jbig2_realloc(&arena->allocator, p[i], size);
+
+    if (q == NULL || (size_t)q % sizeof(double) != 0) {
+      ok = FALSE;
+      break;
+    }
+    for (j = 0; j < (int)(size < sizes[i] ? size : sizes[i]); j++)
+      if (q[j] != (byte)i)
+        ok = FALSE;
+    jbig2_free(&arena->allocator, p[i]);
+    memset(q, i, size);
+    p[i] = q;
+    sizes[i] = size;
+  }
+  for (i = 0; ok && i < 64; i++)
+    for (j = 0; j < (int)sizes[i]; j++)
+      if (p[i][j] != (byte)i)
+        ok = FALSE;
+  test_check(ok, "arena allocations");
+  jbig2_arena_free(arena);
+  jbig2_ctx_free(ctx);
+
+  test_document(test_ref, &file, TRUE, 3, 80, 60, pages);
+  ctx = test_ctx_new(JBIG2_OPTIONS_ARENA);
+  test_decode_file(ctx, &file, pages, 3, "arena");
+  jbig2_ctx_free(ctx);
+  ctx = test_ctx_new(JBIG2_OPTIONS_ARENA | JBIG2_OPTIONS_RANDOM_ACCESS);
+  test_check(jbig2_data_in(ctx, file.data, file.size) == 0, "arena, random access");
+  for (i = 3; i > 0; i--) {
+    Jbig2Image *image;
+
+    test_check(jbig2_decode_page(ctx, i) == 0, "arena, random access");
+    image = jbig2_page_out(ctx);
+    test_check(test_same_image(image, pages[i - 1]), "arena, random access");
+    jbig2_release_page(ctx, image);
+  }
+  jbig2_ctx_free(ctx);
+  free(file.data);
+  test_free_pages(pages, 3);
+}
+
+/* a page dictionary exporting the symbols of a global one refers to
+   the global images, which stay valid as long as the page context
+   is freed before the global one */
+static void
+test_global_symbols(void)
+{
+  Jbig2Image *symbols[TEST_SYMBOLS + 2];
+  TestInstance instances[TEST_INSTANCES];
+  Jbig2GlobalCtx *global_ctx;
+  Jbig2Image *page, *image;
+  Jbig2Ctx *ctx;
+  TestStream global, s;
+  TestBuf b;
+  uint32_t dict;
+  int i;
+
+  for (i = 0; i < TEST_SYMBOLS + 2; i++)
+    symbols[i] = test_random_image(test_ref, 3 + test_rand(10), 4 + test_rand(11));
+  memset(&b, 0, sizeof(b));
+  test_stream_start(&global, FALSE, 0);
+  test_symbol_dict(&b, 0, symbols, TEST_SYMBOLS);
+  dict = test_segment(&global, 0, 0, NULL, 0, &b);
+
+  test_stream_start(&s, FALSE, 1);
+  s.n_segments = dict + 1;	/* numbered after the global segments */
+  b.size = 0;
+  test_page_info(&b, 60, 40, 0);
+  test_segment(&s, 48, 1, NULL, 0, &b);
+  b.size = 0;
+  test_symbol_dict(&b, TEST_SYMBOLS, symbols + TEST_SYMBOLS, 2);
+  dict = test_segment(&s, 0, 1, &dict, 1, &b);
+  page = jbig2_image_new(test_ref, 60, 40);
+  jbig2_image_clear(test_ref, page, 0);
+  for (i = 0; i < TEST_INSTANCES; i++) {
+    const Jbig2Image *symbol;
+
+    instances[i].id = test_rand(TEST_SYMBOLS + 2);
+    symbol = symbols[instances[i].id];
+    instances[i].x = test_rand(60 - symbol->width + 1);
+    instances[i].y = test_rand(40 - symbol->height + 1);
+    jbig2_image_compose(test_ref, page, symbols[instances[i].id],
+                        instances[i].x, instances[i].y, JBIG2_COMPOSE_OR);
+  }
+  b.size = 0;
+  test_text_region(&b, 60, 40, 0, 0, JBIG2_COMPOSE_OR,
+                   TEST_SYMBOLS + 2, instances, TEST_INSTANCES);
+  test_segment(&s, 6, 1, &dict, 1, &b);
+  test_segment(&s, 49, 1, NULL, 0, NULL);	/* end of page */
+
+  /* embedded streams have no file header */
+  ctx = test_ctx_new(JBIG2_OPTIONS_EMBEDDED);
+  test_check(jbig2_data_in(ctx, global.file.data + 13, global.file.size - 13) == 0,
+             "global symbols, global stream");
+  global_ctx = jbig2_make_global_ctx(ctx);
+  ctx = jbig2_ctx_new(NULL, JBIG2_OPTIONS_EMBEDDED, global_ctx,
+                      test_quiet_error, NULL);
+  jbig2_set_min_severity(ctx, JBIG2_SEVERITY_FATAL);
+  test_check(jbig2_data_in(ctx, s.file.data + 13, s.file.size - 13) == 0,
+             "global symbols, page stream");
+  image = jbig2_page_out(ctx);
+  test_check(test_same_image(image, page), "global symbols, page");
+  jbig2_release_page(ctx, image);
+  jbig2_ctx_free(ctx);
+  jbig2_global_ctx_free(global_ctx);
+
+  free(b.data);
+  free(global.file.data);
+  free(s.file.data);
+  jbig2_image_release(test_ref, page);
+  for (i = 0; i < TEST_SYMBOLS + 2; i++)
+    jbig2_image_release(test_ref, symbols[i]);
+}
+
+/* a symbol dictionary using a custom height class table which can
+   not be built, or which leaves codes unused, fails cleanly */
+static void
+test_bad_huffman_table(void)
+{
+  /* HTPS 1 with four one bit codes, or HTPS 2 with the codes 00 and
+     01 only; in both the low and high lines have no code */
+  static const byte lines[2][3] = {
+    { 0x00, 0xaa, 0x00 },
+    { 0x02, 0x90, 0x00 }
+  };
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    TestStream s;
+    TestBuf b;
+    Jbig2Ctx *ctx;
+    uint32_t table;
+
+    test_stream_start(&s, FALSE, 1);
+    memset(&b, 0, sizeof(b));
+    test_byte(&b, lines[i][0]);
+    test_int32(&b, 0);
+    test_int32(&b, i ? 2 : 4);
+    test_bytes(&b, lines[i] + 1, 2);
+    table = test_segment(&s, 53, 0, NULL, 0, &b);
+    b.size = 0;
+    test_int16(&b, 0x000d);	/* SDHUFF, custom SDHUFFDH */
+    test_int32(&b, 1);
+    test_int32(&b, 1);
+    test_int32(&b, 0xffffffff);
+    test_segment(&s, 0, 0, &table, 1, &b);
+    free(b.data);
+    test_stream_end(&s);
+
+    ctx = test_ctx_new(0);
+    test_check(jbig2_data_in(ctx, s.file.data, s.file.size) < 0,
+      i ? "huffman table with unused codes" : "over-subscribed huffman table");
+    jbig2_ctx_free(ctx);
+    free(s.file.data);
+  }
+}
+
+/* an allocator counting the reallocations made through it */
+typedef struct {
+  Jbig2Allocator super;
+  int n_reallocs;
+} TestAllocator;
+
+static void *
+test_alloc(Jbig2Allocator *allocator, size_t size)
+{
+  return malloc(size);
+}
+
+static void
+test_free(Jbig2Allocator *allocator, void *p)
+{
+  free(p);
+}
+
+static void *
+test_realloc(Jbig2Allocator *allocator, void *p, size_t size)
+{
+  ((TestAllocator *)allocator)->n_reallocs++;
+  return realloc(p, size);
+}
+
+/* the rows passed to the stripe callback, gathered into an image */
+typedef struct {
+  Jbig2Image *image;
+  int next_row;
+  bool ok;
+} TestRows;
+
+static void
+test_collect_rows(void *data, uint32_t page_number, const uint8_t *rows,
+                  int first_row, int n_rows, int width, int stride)
+{
+  TestRows *collected = (TestRows *)data;
+  Jbig2Image *image = collected->image;
+  int y;
+
+  if (first_row != collected->next_row || width != image->width ||
+      first_row + n_rows > image->height) {
+    collected->ok = FALSE;
+    return;
+  }
+  for (y = 0; y < n_rows; y++)
+    memcpy(image->data + (first_row + y) * image->stride,
+           rows + y * stride, image->stride);
+  collected->next_row += n_rows;
+}
+
+#define TEST_STRIPES 40
+
+/* a striped page of unknown height grows with its stripes, whose
+   rows go to the stripe callback as each ends, and the rows a stripe
+   leaves blank take the page's default pixel value */
+static void
+test_striped(void)
+{
+  const int width = 70, stripe = 16, height = TEST_STRIPES * 16;
+  int black;
+
+  for (black = 0; black < 2; black++) {
+    TestAllocator allocator;
+    TestRows collected;
+    TestStream s;
+    TestBuf b;
+    Jbig2Image *expected, *image;
+    Jbig2Ctx *ctx;
+    int k;
+
+    expected = jbig2_image_new(test_ref, width, height);
+    jbig2_image_clear(test_ref, expected, black);
+    test_stream_start(&s, FALSE, 1);
+    memset(&b, 0, sizeof(b));
+    test_page_info(&b, width, 0xffffffff, stripe);
+    if (black)
+      b.data[16] |= 4;	/* default pixel 1 */
+    test_segment(&s, 48, 1, NULL, 0, &b);
+    for (k = 0; k < TEST_STRIPES; k++) {
+      /* every other region is as wide as the page */
+      const int rw = k & 1 ? 1 + test_rand(width) : width;
+      const int rx = test_rand(width - rw + 1);
+      Jbig2Image *region = test_random_image(test_ref, rw, 1 + test_rand(stripe));
+
+      b.size = 0;
+      test_generic_region(&b, region, rx, k * stripe, JBIG2_COMPOSE_OR);
+      test_segment(&s, 38, 1, NULL, 0, &b);
+      jbig2_image_compose(test_ref, expected, region, rx, k * stripe,
+                          JBIG2_COMPOSE_OR);
+      jbig2_image_release(test_ref, region);
+      b.size = 0;
+      test_int32(&b, k * stripe + stripe - 1);
+      test_segment(&s, 50, 1, NULL, 0, &b);	/* end of stripe */
+    }
+    test_segment(&s, 49, 1, NULL, 0, NULL);
+    test_stream_end(&s);
+    free(b.data);
+
+    allocator.super.alloc = test_alloc;
+    allocator.super.free = test_free;
+    allocator.super.realloc = test_realloc;
+    allocator.n_reallocs = 0;
+    collected.image = jbig2_image_new(test_ref, width, height);
+    collected.next_row = 0;
+    collected.ok = TRUE;
+    ctx = jbig2_ctx_new(&allocator.super, 0, NULL, test_quiet_error, NULL);
+    jbig2_set_min_severity(ctx, JBIG2_SEVERITY_FATAL);
+    jbig2_set_stripe_callback(ctx, test_collect_rows, &collected);
+    test_check(jbig2_data_in(ctx, s.file.data, s.file.size) == 0, "striped data");
+    image = jbig2_page_out(ctx);
+    test_check(test_same_image(image, expected), "striped page");
+    jbig2_release_page(ctx, image);
+    test_check(collected.ok && collected.next_row == height &&
+               test_same_image(collected.image, expected), "striped rows");
+    /* the page buffer is not reallocated for every stripe */
+    test_check(allocator.n_reallocs < TEST_STRIPES / 2, "striped page growth");
+    jbig2_ctx_free(ctx);
+
+    jbig2_image_release(test_ref, collected.image);
+    jbig2_image_release(test_ref, expected);
+    free(s.file.data);
+  }
+}
+
+/* the layout of the output buffers handed out for each page */
+typedef struct {
+  Jbig2PageOutput layout;
+  byte *buffers[3];
+} TestOutput;
+
+static void
+test_output_buffer(void *data, uint32_t page_number, int width, int height,
+                   Jbig2PageOutput *output)
+{
+  TestOutput *t = (TestOutput *)data;
+
+  *output = t->layout;
+  output->data = t->buffers[page_number - 1];
+}
+
+/* check an output buffer against the page it was made from, and for
+   a converted one, that the bytes past the output width were left alone */
+static bool
+test_output_matches(const Jbig2PageOutput *output, Jbig2Image *page,
+                    bool direct)
+{
+  const int invert = output->flags & JBIG2_OUTPUT_INVERT ? 1 : 0;
+  const int scale = output->scale ? output->scale : 1;
+  const int width = (output->depth == 8 ? output->width :
+                     (output->width + 7) & ~7);
+  int x, y, i, j;
+
+  for (y = 0; y < output->height; y++) {
+    const byte *row = output->data + y * output->stride;
+
+    for (x = 0; x < width; x++) {
+      int expected, actual;
+
+      if (output->depth == 1) {
+        expected = (x < output->width ? jbig2_image_get_pixel(page, x, y) : 0) ^ invert;
+        actual = (row[x >> 3] >> (7 - (x & 7))) & 1;
+      } else {
+        const int cols = page->width - x * scale < scale ? page->width - x * scale : scale;
+        const int rows = page->height - y * scale < scale ? page->height - y * scale : scale;
+        int count = 0;
+
+        for (j = 0; j < rows; j++)
+          for (i = 0; i < cols; i++)
+            count += jbig2_image_get_pixel(page, x * scale + i, y * scale + j);
+        expected = ((count * 255 + rows * cols / 2) / (rows * cols)) ^ (invert ? 0xff : 0);
+        actual = row[x];
+      }
+      if (actual != expected)
+        return FALSE;
+    }
+    for (x = output->depth == 8 ? width : width >> 3;
+         !direct && x < output->stride; x++)
+      if (row[x] != 0x5a)
+        return FALSE;
+  }
+  return TRUE;
+}
+
+/* pages decoded straight into a client's 1 bpp buffer, or converted
+   into an inverted 1 bpp buffer narrower and shorter than the page,
+   or into an 8 bpp buffer at half scale */
+static void
+test_output(void)
+{
+  static const Jbig2PageOutput layouts[3] = {
+    { NULL, 12, 80, 60, 1, 0, 1 },
+    { NULL, 12, 75, 50, 1, JBIG2_OUTPUT_INVERT, 1 },
+    { NULL, 44, 40, 30, 8, 0, 2 }
+  };
+  Jbig2Image *pages[3];
+  TestBuf file;
+  int l, p;
+
+  test_document(test_ref, &file, FALSE, 3, 80, 60, pages);
+  for (l = 0; l < 3; l++) {
+    const size_t size = layouts[l].stride * layouts[l].height;
+    TestOutput t;
+    Jbig2Ctx *ctx;
+
+    t.layout = layouts[l];
+    for (p = 0; p < 3; p++) {
+      t.buffers[p] = malloc(size);
+      memset(t.buffers[p], 0x5a, size);
+    }
+    ctx = test_ctx_new(0);
+    jbig2_set_page_output_callback(ctx, test_output_buffer, &t);
+    test_check(jbig2_data_in(ctx, file.data, file.size) == 0, "output data");
+    for (p = 0; p < 3; p++) {
+      Jbig2Image *image = jbig2_page_out(ctx);
+
+      test_check(test_same_image(image, pages[p]), "output page");
+      /* only the plain layout is decoded into directly */
+      test_check(image != NULL && (image->data == t.buffers[p]) == (l == 0),
+                 "output decoded directly");
+      t.layout.data = t.buffers[p];
+      test_check(test_output_matches(&t.layout, pages[p], l == 0), "output buffer");
+      jbig2_release_page(ctx, image);
+    }
+    jbig2_ctx_free(ctx);
+    for (p = 0; p < 3; p++)
+      free(t.buffers[p]);
+  }
+  free(file.data);
+  test_free_pages(pages, 3);
+}
+
+/* a reset context decodes another stream as a new one would, whatever
+   state the last stream was left in, and without holding on to more
+   memory each time */
+static void
+test_ctx_reset(void)
+{
+  static const Jbig2Options options[2] = {
+    0, JBIG2_OPTIONS_PAGE_POOL | JBIG2_OPTIONS_ARENA
+  };
+  Jbig2Image *pages_a[3], *pages_b[2];
+  TestBuf file_a, file_b;
+  int o, i;
+
+  test_document(test_ref, &file_a, FALSE, 3, 80, 60, pages_a);
+  test_document(test_ref, &file_b, FALSE, 2, 64, 40, pages_b);
+  for (o = 0; o < 2; o++) {
+    Jbig2Ctx *ctx = test_ctx_new(options[o]);
+    size_t used = 0;
+    Jbig2Image *image;
+
+    for (i = 0; i < 3; i++) {
+      /* part of a stream, with a page out and not released */
+      jbig2_data_in(ctx, file_a.data, file_a.size * 2 / 3);
+      image = jbig2_page_out(ctx);
+      test_check(test_same_image(image, pages_a[0]), "reset, first stream");
+      test_check(jbig2_ctx_reset(ctx, NULL) == 0, "reset");
+      test_decode_file(ctx, &file_b, pages_b, 2, "reset, second stream");
+      test_check(jbig2_ctx_reset(ctx, NULL) == 0, "reset");
+      test_decode_file(ctx, &file_a, pages_a, 3, "reset, whole stream");
+      test_check(jbig2_ctx_reset(ctx, NULL) == 0, "reset");
+      if (i == 0)
+        used = jbig2_get_memory_used(ctx, NULL);
+      else
+        test_check(jbig2_get_memory_used(ctx, NULL) == used, "reset memory");
+    }
+    jbig2_ctx_free(ctx);
+  }
+
+  {
+    Jbig2Ctx *ctx = test_ctx_new(0);
+    Jbig2GlobalCtx *global_ctx = jbig2_make_global_ctx(ctx);
+
+    test_check(jbig2_ctx_reset(ctx, NULL) < 0, "reset a global context");
+    jbig2_global_ctx_free(global_ctx);
+  }
+
+  free(file_a.data);
+  free(file_b.data);
+  test_free_pages(pages_a, 3);
+  test_free_pages(pages_b, 2);
+}
+
+/* submit a file with its start held back in the context's buffer, so
+   parsing is the last thing either call does and nothing after it can
+   fail in its place */
+static int
+test_data_in_buffered(Jbig2Ctx *ctx, const TestBuf *file)
+{
+  int code = jbig2_data_in(ctx, file->data, 4);
+
+  if (code == 0)
+    code = jbig2_data_in(ctx, file->data + 4, file->size - 4);
+  return code;
+}
+
+/* under a memory limit a stream either decodes completely or
+   jbig2_data_in() reports an error, whichever allocation is refused */
+static void
+test_memory_limit(void)
+{
+  Jbig2Image *pages[3];
+  TestBuf file;
+  Jbig2Ctx *ctx;
+  Jbig2Image *image;
+  size_t peak, limit;
+  int n_failed = 0;
+
+  test_document(test_ref, &file, FALSE, 3, 80, 60, pages);
+  ctx = test_ctx_new(0);
+  test_check(test_data_in_buffered(ctx, &file) == 0, "memory limit, unlimited");
+  while ((image = jbig2_page_out(ctx)) != NULL)
+    jbig2_release_page(ctx, image);
+  jbig2_get_memory_used(ctx, &peak);
+  jbig2_ctx_free(ctx);
+
+  /* finely at first, then in steps of about 0.1% up to the peak */
+  limit = 1;
+  for (;;) {
+    int code;
+
+    ctx = test_ctx_new(0);
+    jbig2_set_memory_limit(ctx, limit);
+    code = test_data_in_buffered(ctx, &file);
+    if (code == 0) {
+      int p;
+
+      for (p = 0; p < 3; p++) {
+        image = jbig2_page_out(ctx);
+        test_check(test_same_image(image, pages[p]), "memory limit, decoded page");
+        jbig2_release_page(ctx, image);
+      }
+    } else {
+      test_check(code < 0, "memory limit, error");
+      n_failed++;
+      while ((image = jbig2_page_out(ctx)) != NULL)
+        jbig2_release_page(ctx, image);
+    }
+    test_check(jbig2_page_out(ctx) == NULL, "memory limit, no more pages");
+    jbig2_ctx_free(ctx);
+    /* the peak itself is enough */
+    test_check(limit < peak || code == 0, "memory limit, at the peak");
+    if (limit == peak)
+      break;
+    limit += 1 + limit / 1024;
+    if (limit > peak)
+      limit = peak;
+  }
+  test_check(n_failed > 0, "memory limit, refused allocations");
+
+  free(file.data);
+  test_free_pages(pages, 3);
+}
+
+int
+main(int argc, char **argv)
+{
+  test_ref = test_ctx_new(0);
+
+  test_random_access();
+  test_page_switch();
+  test_resume();
+  test_page_pool();
+  test_in_place();
+  test_arena();
+  test_global_symbols();
+  test_bad_huffman_table();
+  test_striped();
+  test_output();
+  test_ctx_reset();
+  test_memory_limit();
+
+  jbig2_ctx_free(test_ref);
+  printf("%s\n", test_failures ? "FAILED" : "all tests passed");
+  return test_failures ? 1 : 0;
+}
+#endif
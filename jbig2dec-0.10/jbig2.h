@@ -29,7 +29,10 @@ typedef enum {
 } Jbig2Severity;
 
 typedef enum {
-  JBIG2_OPTIONS_EMBEDDED = 1
+  JBIG2_OPTIONS_EMBEDDED = 1,
+  JBIG2_OPTIONS_RANDOM_ACCESS = 2,
+  JBIG2_OPTIONS_PAGE_POOL = 4,
+  JBIG2_OPTIONS_ARENA = 8
 } Jbig2Options;
 
 /* forward public structure declarations */
@@ -53,7 +56,7 @@ typedef struct _Jbig2SymbolDictionary Jbig2SymbolDictionary;
 struct _Jbig2Image {
         int             width, height, stride;
         uint8_t        *data;
-	int		refcount;
+	int		refcount; /* negated while frozen in a global context */
 };
 
 Jbig2Image*     jbig2_image_new(Jbig2Ctx *ctx, int width, int height);
@@ -85,7 +88,9 @@ struct _Jbig2Allocator {
   void *(*realloc) (Jbig2Allocator *allocator, void *p, size_t size);
 };
 
-/* decoder context */
+/* decoder context. With JBIG2_OPTIONS_ARENA, symbol dictionaries are
+   decoded into arenas carved from large blocks obtained from the
+   allocator, which are only returned when the context is freed. */
 Jbig2Ctx *jbig2_ctx_new (Jbig2Allocator *allocator,
 			 Jbig2Options options,
 			 Jbig2GlobalCtx *global_ctx,
@@ -93,20 +98,141 @@ Jbig2Ctx *jbig2_ctx_new (Jbig2Allocator *allocator,
 			 void *error_callback_data);
 void jbig2_ctx_free (Jbig2Ctx *ctx);
 
-/* global context for embedded streams */
+/* return a context to its initial state for another stream, using
+   the given global context, while keeping its allocations: the input
+   buffer, the segment and page arrays and any pooled page image. The
+   options, callbacks and message filter are kept too. Any pages not
+   yet released are freed, as by jbig2_ctx_free(). A frozen global
+   context can't be reset. */
+int jbig2_ctx_reset (Jbig2Ctx *ctx, Jbig2GlobalCtx *global_ctx);
+
+/* messages less severe than the given level are dropped before they
+   are formatted, which saves the cost of debug output nobody reads.
+   This is JBIG2_SEVERITY_FATAL with the default error handler, which
+   only prints fatal errors, and JBIG2_SEVERITY_DEBUG otherwise. Fatal
+   errors are always reported. Debug messages from the inner decoding
+   loops are only compiled in with JBIG2_DEBUG defined. */
+void jbig2_set_min_severity (Jbig2Ctx *ctx, Jbig2Severity severity);
+
+/* memory accounting. A context counts the bytes it has allocated,
+   and the most it has had allocated at once since it was created or
+   last reset. With a limit set, an allocation which would take it
+   over the limit fails, and so does the segment which needed it.
+   Pass 0 for no limit, which is the default. */
+void jbig2_set_memory_limit (Jbig2Ctx *ctx, size_t limit);
+size_t jbig2_get_memory_used (Jbig2Ctx *ctx, size_t *peak);
+
+/* global context for embedded streams. Once all the global data
+   has been submitted, jbig2_make_global_ctx() freezes the context:
+   it accepts no more data and its decoded segments are not modified
+   by the page contexts using it, so any number of those may decode
+   concurrently in different threads against one global context.
+   The page contexts refer to the global segments without copying
+   them, so the global context must outlive every page context
+   created against it: free those before jbig2_global_ctx_free(). */
 Jbig2GlobalCtx *jbig2_make_global_ctx (Jbig2Ctx *ctx);
 void jbig2_global_ctx_free (Jbig2GlobalCtx *global_ctx);
 
 /* submit data to the decoder */
 int jbig2_data_in (Jbig2Ctx *ctx, const unsigned char *data, size_t size);
 
+/* decoding can be interrupted, to give up on a page or to bound the
+   time a call takes. The abort callback is polled between segments
+   and every few rows of generic, refinement and text regions. Once
+   it returns nonzero the segment being decoded is abandoned, and
+   jbig2_data_in() or jbig2_decode_page() returns JBIG2_INTERRUPTED.
+   A later call decodes that segment again from the start, this time
+   to the end without polling, so each call resuming decoding makes
+   progress however soon the callback asks to stop: call
+   jbig2_data_in() with no data to just resume. To give up on the
+   stream instead, reset or free the context. */
+#define JBIG2_INTERRUPTED 1
+typedef int (*Jbig2AbortCallback) (void *data);
+void jbig2_set_abort_callback (Jbig2Ctx *ctx, Jbig2AbortCallback callback,
+			       void *data);
+
 /* get the next available decoded page image. NULL means there isn't one. */
 Jbig2Image *jbig2_page_out (Jbig2Ctx *ctx);
-/* mark a returned page image as no longer needed. */
+/* mark a returned page image as no longer needed. The image is freed,
+   or with JBIG2_OPTIONS_PAGE_POOL kept to be reused for the next page
+   if that has the same dimensions. */
 int jbig2_release_page (Jbig2Ctx *ctx, Jbig2Image *image);
 /* mark the current page as complete, simulating an end-of-page segment (for broken streams) */
 int jbig2_complete_page (Jbig2Ctx *ctx);
 
+/* rows of striped pages can be had before the page is complete. With
+   a stripe callback set, each end of stripe segment passes the rows it
+   finishes to the callback, and the end of the page passes any rows
+   left over (all of them, for a page which is not striped). rows
+   points at row first_row of the page image, and the n_rows rows
+   given are stride bytes apart and width pixels wide. The pointer is
+   only valid during the call, since the image of a page of unknown
+   height may be reallocated as it grows. Completed pages are still
+   returned by jbig2_page_out(). */
+typedef void (*Jbig2StripeCallback) (void *data, uint32_t page_number,
+				     const uint8_t *rows, int first_row,
+				     int n_rows, int width, int stride);
+void jbig2_set_stripe_callback (Jbig2Ctx *ctx, Jbig2StripeCallback callback,
+				void *data);
+
+/* pages can also be written straight into a buffer supplied by the
+   client, in the layout it needs. The output callback is called for
+   each page once its size is known (height is -1 for a page of unknown
+   height) and either fills in @output or leaves output->data NULL.
+   A 1 bpp output without flags that covers the whole page is decoded
+   into directly; any other is converted from the page image as its
+   rows are completed, just before they go to the stripe callback.
+   Pixels beyond the output width and height are dropped. Past the
+   page width, pixels up to the end of the byte (or with NATIVE_WORDS,
+   the word) are set to white and any beyond that are left alone,
+   except in a buffer decoded into directly: that is the page image,
+   so the whole of each row up to the stride may be written.
+   An 8 bpp output may be reduced by a scale of 2, 4 or 8, for previews:
+   each pixel is then the gray level of the scale x scale block of page
+   pixels it covers, and the output holds (width + scale - 1) / scale
+   pixels per row for a page width pixels wide. */
+typedef enum {
+  JBIG2_OUTPUT_INVERT = 1,	/* 0 is black */
+  JBIG2_OUTPUT_LSB_FIRST = 2,	/* leftmost pixel in the low bit, 1 bpp only */
+  JBIG2_OUTPUT_NATIVE_WORDS = 4	/* rows of 32 bit words in host byte order */
+} Jbig2OutputFlags;
+
+typedef struct {
+  uint8_t *data;	/* the first row */
+  int stride;		/* bytes per row, a multiple of 4 with NATIVE_WORDS */
+  int width, height;	/* in pixels */
+  int depth;		/* 1 or 8 bits per pixel */
+  int flags;		/* Jbig2OutputFlags */
+  int scale;		/* 1 (or 0), 2, 4 or 8 page pixels per output pixel */
+} Jbig2PageOutput;
+
+typedef void (*Jbig2PageOutputCallback) (void *data, uint32_t page_number,
+					 int width, int height,
+					 Jbig2PageOutput *output);
+void jbig2_set_page_output_callback (Jbig2Ctx *ctx,
+				     Jbig2PageOutputCallback callback,
+				     void *data);
+
+/* random access to pages. If a context is created with the
+   JBIG2_OPTIONS_RANDOM_ACCESS option and the file uses the
+   random-access organization, jbig2_data_in() only parses the
+   segment headers. Individual pages are then decoded on request,
+   together with just the (global) segments they depend on, and
+   can be retrieved with jbig2_page_out(). All of the data must
+   have been submitted before calling this. */
+int jbig2_decode_page (Jbig2Ctx *ctx, uint32_t page_number);
+
+
+/* segment callback, for tracing and profiling. It is called just
+   before each segment body is decoded with done = 0, and again just
+   after with done = 1, the code the decoder returned and the number
+   of bytes the arithmetic, Huffman or MMR decoders read from the
+   segment data (approximate, since they read ahead a little). */
+typedef void (*Jbig2SegmentCallback) (void *data, const Jbig2Segment *segment,
+				      const uint8_t *segment_data, int done,
+				      int code, size_t coded_bytes);
+void jbig2_set_segment_callback (Jbig2Ctx *ctx, Jbig2SegmentCallback callback,
+				 void *data);
 
 /* segment header routines */
 
@@ -120,6 +246,9 @@ struct _Jbig2Segment {
   void *result;
 };
 
+/* NULL with *p_header_size 0 means buf doesn't hold the whole header
+   yet; NULL with it set to the header size means the header couldn't
+   be parsed */
 Jbig2Segment *jbig2_parse_segment_header (Jbig2Ctx *ctx, uint8_t *buf, size_t buf_size,
 			    size_t *p_header_size);
 int jbig2_parse_segment (Jbig2Ctx *ctx, Jbig2Segment *segment,
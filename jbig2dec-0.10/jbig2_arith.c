@@ -180,8 +180,16 @@ jbig2_arith_new (Jbig2Ctx *ctx, Jbig2WordStream *ws)
 {
   Jbig2ArithState *result;
 
+  /* a failed jbig2_word_stream_buf_new() is passed straight on */
+  if (ws == NULL)
+    return NULL;
   result = (Jbig2ArithState *)jbig2_alloc(ctx->allocator,
 	sizeof(Jbig2ArithState));
+  if (result == NULL) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "failed to allocate arithmetic decoder state");
+    return NULL;
+  }
 
   result->ws = ws;
 
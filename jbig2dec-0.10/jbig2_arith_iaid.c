@@ -46,8 +46,19 @@ jbig2_arith_iaid_ctx_new(Jbig2Ctx *ctx, int SBSYMCODELEN)
   Jbig2ArithIaidCtx *result = jbig2_new(ctx, Jbig2ArithIaidCtx, 1);
   int ctx_size = 1 << SBSYMCODELEN;
 
+  if (result == NULL) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "failed to allocate symbol id decoding context");
+    return NULL;
+  }
   result->SBSYMCODELEN = SBSYMCODELEN;
   result->IAIDx = jbig2_alloc(ctx->allocator, ctx_size);
+  if (result->IAIDx == NULL) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "failed to allocate symbol id decoding context");
+    jbig2_free(ctx->allocator, result);
+    return NULL;
+  }
   memset(result->IAIDx, 0, ctx_size);
 
   return result;
@@ -86,6 +97,8 @@ jbig2_arith_iaid_decode(Jbig2ArithIaidCtx *ctx, Jbig2ArithState *as,
 void
 jbig2_arith_iaid_ctx_free(Jbig2Ctx *ctx, Jbig2ArithIaidCtx *iax)
 {
+  if (iax == NULL)
+    return;
   jbig2_free(ctx->allocator, iax->IAIDx);
   jbig2_free(ctx->allocator, iax);
 }
@@ -40,6 +40,11 @@ jbig2_arith_int_ctx_new(Jbig2Ctx *ctx)
 {
   Jbig2ArithIntCtx *result = jbig2_new(ctx, Jbig2ArithIntCtx, 1);
 
+  if (result == NULL) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "failed to allocate integer decoding context");
+    return NULL;
+  }
   memset(result->IAx, 0, sizeof(result->IAx));
 
   return result;
@@ -76,6 +76,9 @@ jbig2_decode_generic_template0(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (jbig2_poll_rows(ctx, y))
+        return -1;
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 6 : 0;
       CONTEXT = (line_m1 & 0x7f0) | (line_m2 & 0xf800);
@@ -134,6 +137,8 @@ jbig2_decode_generic_template0_unopt(Jbig2Ctx *ctx,
   /* this version is generic and easy to understand, but very slow */
 
   for (y = 0; y < GBH; y++) {
+    if (jbig2_poll_rows(ctx, y))
+      return -1;
     for (x = 0; x < GBW; x++) {
       CONTEXT = 0;
       CONTEXT |= jbig2_image_get_pixel(image, x - 1, y) << 0;
@@ -190,6 +195,9 @@ jbig2_decode_generic_template1(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (jbig2_poll_rows(ctx, y))
+        return -1;
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 5 : 0;
       CONTEXT = ((line_m1 >> 1) & 0x1f8) | ((line_m2 >> 1) & 0x1e00);
@@ -258,6 +266,9 @@ jbig2_decode_generic_template2(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (jbig2_poll_rows(ctx, y))
+        return -1;
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 4 : 0;
       CONTEXT = ((line_m1 >> 3) & 0x7c) | ((line_m2 >> 3) & 0x380);
@@ -326,6 +337,9 @@ jbig2_decode_generic_template2a(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (jbig2_poll_rows(ctx, y))
+        return -1;
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 4 : 0;
       CONTEXT = ((line_m1 >> 3) & 0x78) | ((line_m1 >> 2) & 0x4) | ((line_m2 >> 3) & 0x380);
@@ -394,6 +408,9 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
       uint32_t line_m1;
       int padded_width = (GBW + 7) & -8;
 
+      if (jbig2_poll_rows(ctx, y))
+        return -1;
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       CONTEXT = (line_m1 >> 1) & 0x3f0;
 
@@ -446,6 +463,8 @@ jbig2_decode_generic_template3_unopt(Jbig2Ctx *ctx,
   /* this version is generic and easy to understand, but very slow */
 
   for (y = 0; y < GBH; y++) {
+    if (jbig2_poll_rows(ctx, y))
+      return -1;
     for (x = 0; x < GBW; x++) {
       CONTEXT = 0;
       CONTEXT |= jbig2_image_get_pixel(image, x - 1, y) << 0;
@@ -552,6 +571,9 @@ jbig2_immediate_generic_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
   Jbig2GenericRegionParams params;
   int code;
   Jbig2Image *image;
+  Jbig2Image page_rows;
+  Jbig2Page *page = &ctx->pages[ctx->current_page];
+  bool in_place;
   Jbig2WordStream *ws;
   Jbig2ArithState *as;
   Jbig2ArithCx *GB_stats = NULL;
@@ -595,10 +617,19 @@ jbig2_immediate_generic_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
   params.USESKIP = 0;
   memcpy (params.gbat, gbat, gbat_bytes);
 
-  image = jbig2_image_new(ctx, rsi.width, rsi.height);
-  jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
-    "allocated %d x %d image buffer for region decode results",
-        rsi.width, rsi.height);
+  in_place = jbig2_page_region_in_place(ctx, page, &page_rows,
+      rsi.x, rsi.y, rsi.width, rsi.height, rsi.op);
+  if (in_place) {
+    image = &page_rows;
+  } else {
+    image = jbig2_image_new(ctx, rsi.width, rsi.height);
+    if (image == NULL)
+      return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+        "unable to allocate generic region image");
+    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
+      "allocated %d x %d image buffer for region decode results",
+          rsi.width, rsi.height);
+  }
 
   if (params.MMR)
     {
@@ -610,23 +641,36 @@ jbig2_immediate_generic_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
     {
       int stats_size = jbig2_generic_stats_size(ctx, params.GBTEMPLATE);
       GB_stats = jbig2_alloc(ctx->allocator, stats_size);
-      memset(GB_stats, 0, stats_size);
-
       ws = jbig2_word_stream_buf_new(ctx,
 				     segment_data + offset,
 				     segment->data_length - offset);
       as = jbig2_arith_new(ctx, ws);
-      code = jbig2_decode_generic_region(ctx, segment, &params,
-					 as, image, GB_stats);
+      if (GB_stats == NULL || as == NULL)
+        code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+          "failed to allocate generic region decoding state");
+      else {
+        memset(GB_stats, 0, stats_size);
+        code = jbig2_decode_generic_region(ctx, segment, &params,
+					   as, image, GB_stats);
+      }
       jbig2_free(ctx->allocator, as);
       jbig2_word_stream_buf_free(ctx, ws);
 
       jbig2_free(ctx->allocator, GB_stats);
     }
 
-  jbig2_page_add_result(ctx, &ctx->pages[ctx->current_page],
-			image, rsi.x, rsi.y, JBIG2_COMPOSE_OR);
-  jbig2_image_release(ctx, image);
+  /* an interrupted region leaves the page as it found it, to be
+     decoded again when decoding resumes */
+  if (in_place && ctx->interrupted) {
+    jbig2_image_clear(ctx, image, 0);
+  } else if (in_place) {
+    jbig2_page_region_in_place_done(ctx, page, image);
+  } else if (ctx->interrupted) {
+    jbig2_image_release(ctx, image);
+  } else {
+    jbig2_page_add_result(ctx, page, image, rsi.x, rsi.y, JBIG2_COMPOSE_OR);
+    jbig2_image_release(ctx, image);
+  }
 
   return code;
 }
@@ -60,6 +60,8 @@ typedef struct {
 } Jbig2HalftoneRegionParams;
 
 
+void jbig2_hd_release(Jbig2Ctx *ctx, Jbig2PatternDict *dict);
+
 /**
  * jbig2_hd_new: create a new dictionary from a collective bitmap
  */
@@ -91,6 +93,11 @@ jbig2_hd_new(Jbig2Ctx *ctx,
     /* 6.7.5(4) - copy out the individual pattern images */
     for (i = 0; i < N; i++) {
       new->patterns[i] = jbig2_image_new(ctx, HPW, HPH);
+      if (new->patterns[i] == NULL) {
+        new->n_patterns = i;
+        jbig2_hd_release(ctx, new);
+        return NULL;
+      }
       /* compose with the REPLACE operator; the source
          will be clipped to the destintion, selecting the
          proper sub image */
@@ -175,12 +182,20 @@ jbig2_decode_pattern_dict(Jbig2Ctx *ctx, Jbig2Segment *segment,
     Jbig2WordStream *ws = jbig2_word_stream_buf_new(ctx, data, size);
     Jbig2ArithState *as = jbig2_arith_new(ctx, ws);
 
-    code = jbig2_decode_generic_region(ctx, segment, &rparams,
-		as, image, GB_stats);
+    if (as == NULL)
+      code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+        "failed to allocate pattern dictionary decoding state");
+    else
+      code = jbig2_decode_generic_region(ctx, segment, &rparams,
+		  as, image, GB_stats);
 
     jbig2_free(ctx->allocator, as);
     jbig2_word_stream_buf_free(ctx, ws);
   }
+  if (ctx->interrupted) {
+    jbig2_image_release(ctx, image);
+    return NULL;
+  }
   if (code != 0) {
     jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
 	"error decoding collective pattern dictionary bitmap!");
@@ -234,6 +249,9 @@ jbig2_pattern_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
     /* allocate and zero arithmetic coding stats */
     int stats_size = jbig2_generic_stats_size(ctx, params.HDTEMPLATE);
     GB_stats = jbig2_alloc(ctx->allocator, stats_size);
+    if (GB_stats == NULL)
+      return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+        "failed to allocate pattern dictionary statistics");
     memset(GB_stats, 0, stats_size);
   }
 
@@ -277,7 +295,7 @@ jbig2_halftone_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segment_
   Jbig2RegionSegmentInfo region_info;
   Jbig2HalftoneRegionParams params;
   Jbig2Image *image;
-  Jbig2ArithCx *GB_stats;
+  Jbig2ArithCx *GB_stats = NULL;
   int code;
 
   /* 7.4.5.1 */
@@ -339,14 +357,23 @@ jbig2_halftone_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segment_
     /* allocate and zero arithmetic coding stats */
     int stats_size = jbig2_generic_stats_size(ctx, params.HTEMPLATE);
     GB_stats = jbig2_alloc(ctx->allocator, stats_size);
+    if (GB_stats == NULL)
+      return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+        "failed to allocate halftone region statistics");
     memset(GB_stats, 0, stats_size);
   }
 
   image = jbig2_image_new(ctx, region_info.width, region_info.height);
-
-  code = jbig2_decode_halftone_region(ctx, segment, &params,
-		segment_data + offset, segment->data_length - offset,
-		image, GB_stats);
+  if (image == NULL)
+    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+      "failed to allocate halftone region image");
+  else {
+    code = jbig2_decode_halftone_region(ctx, segment, &params,
+		  segment_data + offset, segment->data_length - offset,
+		  image, GB_stats);
+    /* nothing is composed onto the page yet */
+    jbig2_image_release(ctx, image);
+  }
 
   /* todo: retain GB_stats? */
   if (!params.HMMR) {
@@ -36,6 +36,7 @@
 #define JBIG2_HUFFMAN_FLAGS_ISOOB 1
 #define JBIG2_HUFFMAN_FLAGS_ISLOW 2
 #define JBIG2_HUFFMAN_FLAGS_ISEXT 4
+#define JBIG2_HUFFMAN_FLAGS_ISERR 8
 
 
 
@@ -61,10 +62,16 @@ jbig2_huffman_new (Jbig2Ctx *ctx, Jbig2WordStream *ws)
 {
   Jbig2HuffmanState *result;
 
+  /* a failed jbig2_word_stream_buf_new() is passed straight on */
+  if (ws == NULL)
+    return NULL;
   result = (Jbig2HuffmanState *)jbig2_alloc(ctx->allocator,
 	sizeof(Jbig2HuffmanState));
 
-  if (result != NULL) {
+  if (result == NULL)
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "failed to allocate huffman decoder state");
+  else {
       result->offset = 0;
       result->offset_bits = 0;
       result->this_word = ws->get_next_word (ws, 0);
@@ -82,7 +89,8 @@ jbig2_huffman_new (Jbig2Ctx *ctx, Jbig2WordStream *ws)
 void
 jbig2_huffman_free (Jbig2Ctx *ctx, Jbig2HuffmanState *hs)
 {
-  if (hs != NULL) free(hs);
+  if (hs != NULL)
+    jbig2_free(ctx->allocator, hs);
   return;
 }
 
@@ -194,6 +202,9 @@ jbig2_huffman_get_bits (Jbig2HuffmanState *hs, const int bits)
   return result;
 }
 
+/* decode a value with table. *oob is set to 1 for the out-of-band
+   value and to -1, with -1 returned, when the next bits start no code
+   of the table */
 int32_t
 jbig2_huffman_get (Jbig2HuffmanState *hs,
 		   const Jbig2HuffmanTable *table, bool *oob)
@@ -214,6 +225,15 @@ jbig2_huffman_get (Jbig2HuffmanState *hs,
       entry = &table->entries[this_word >> (32 - log_table_size)];
       flags = entry->flags;
       PREFLEN = entry->PREFLEN;
+      if (flags & JBIG2_HUFFMAN_FLAGS_ISERR)
+	{
+	  /* no code of the table starts with these bits */
+	  hs->this_word = this_word;
+	  hs->offset_bits = offset_bits;
+	  if (oob != NULL)
+	    *oob = -1;
+	  return -1;
+	}
 
       next_word = hs->next_word;
       offset_bits += PREFLEN;
@@ -274,10 +294,121 @@ if (RANGELEN)
   return result;
 }
 
-/* TODO: more than 8 bits here is wasteful of memory. We have support
-   for sub-trees in jbig2_huffman_get() above, but don't use it here.
-   We should, and then revert to 8 bits */
-#define LOG_TABLE_SIZE_MAX 16
+/* the first level of a decode table is indexed by at most this many
+   bits; longer codes continue in extension tables reached through the
+   entries for their first bits, see jbig2_huffman_get() above */
+#define LOG_TABLE_SIZE_MAX 8
+
+/* build the lookup table for the codes that start with the depth bits
+   of prefix, indexed by the bits following them. range bits are folded
+   into the table when they fit, otherwise they are read separately */
+static Jbig2HuffmanTable *
+jbig2_build_huffman_subtable (Jbig2Ctx *ctx, const Jbig2HuffmanParams *params,
+			      const uint32_t *codes, int depth, uint32_t prefix)
+{
+  const Jbig2HuffmanLine *lines = params->lines;
+  int n_lines = params->n_lines;
+  int log_table_size = 0;
+  int max_j;
+  int i, j;
+  Jbig2HuffmanTable *result;
+  Jbig2HuffmanEntry *entries;
+
+  for (i = 0; i < n_lines; i++)
+    {
+      int PREFLEN = lines[i].PREFLEN;
+      int lts;
+
+      if (PREFLEN <= depth ||
+	  (depth > 0 && (codes[i] >> (PREFLEN - depth)) != prefix))
+	continue;
+      lts = PREFLEN - depth + lines[i].RANGELEN;
+      if (lts > LOG_TABLE_SIZE_MAX)
+	lts = PREFLEN - depth;
+      if (lts > LOG_TABLE_SIZE_MAX)
+	lts = LOG_TABLE_SIZE_MAX;
+      if (log_table_size < lts)
+	log_table_size = lts;
+    }
+  max_j = 1 << log_table_size;
+
+  result = (Jbig2HuffmanTable *)jbig2_alloc(ctx->allocator, sizeof(Jbig2HuffmanTable));
+  if (result == NULL)
+    return NULL;
+  result->log_table_size = log_table_size;
+  entries = (Jbig2HuffmanEntry *)jbig2_alloc(ctx->allocator, max_j * sizeof(Jbig2HuffmanEntry));
+  if (entries == NULL) {
+    jbig2_free(ctx->allocator, result);
+    return NULL;
+  }
+  /* unused codes are reported as errors by jbig2_huffman_get() */
+  memset(entries, 0, max_j * sizeof(Jbig2HuffmanEntry));
+  for (j = 0; j < max_j; j++)
+    entries[j].flags = JBIG2_HUFFMAN_FLAGS_ISERR;
+  result->entries = entries;
+
+  for (i = 0; i < n_lines; i++)
+    {
+      int PREFLEN = lines[i].PREFLEN;
+      int RANGELEN = lines[i].RANGELEN;
+      int rem = PREFLEN - depth;
+      uint32_t code;
+      byte eflags = 0;
+
+      if (PREFLEN <= depth ||
+	  (depth > 0 && (codes[i] >> rem) != prefix))
+	continue;
+      code = rem < 32 ? codes[i] & ((1U << rem) - 1) : codes[i];
+
+      if (params->HTOOB && i == n_lines - 1)
+	eflags |= JBIG2_HUFFMAN_FLAGS_ISOOB;
+      if (i == n_lines - (params->HTOOB ? 3 : 2))
+	eflags |= JBIG2_HUFFMAN_FLAGS_ISLOW;
+
+      if (rem > log_table_size) {
+	  /* the code continues in an extension table */
+	  j = code >> (rem - log_table_size);
+	  if (entries[j].flags & JBIG2_HUFFMAN_FLAGS_ISEXT)
+	    continue;
+	  entries[j].u.ext_table = jbig2_build_huffman_subtable(ctx, params,
+	    codes, depth + log_table_size, (prefix << log_table_size) | j);
+	  if (entries[j].u.ext_table == NULL) {
+	    jbig2_release_huffman_table(ctx, result);
+	    return NULL;
+	  }
+	  entries[j].PREFLEN = log_table_size;
+	  entries[j].RANGELEN = 0;
+	  entries[j].flags = JBIG2_HUFFMAN_FLAGS_ISEXT;
+      } else {
+	  int shift = log_table_size - rem;
+	  int start_j = code << shift;
+	  int end_j = (code + 1) << shift;
+
+	  if (rem + RANGELEN > log_table_size) {
+	      for (j = start_j; j < end_j; j++) {
+		  entries[j].u.RANGELOW = lines[i].RANGELOW;
+		  entries[j].PREFLEN = rem;
+		  entries[j].RANGELEN = RANGELEN;
+		  entries[j].flags = eflags;
+		}
+	  } else {
+	      for (j = start_j; j < end_j; j++) {
+		  int32_t HTOFFSET = (j >> (shift - RANGELEN)) &
+		    ((1 << RANGELEN) - 1);
+		  if (eflags & JBIG2_HUFFMAN_FLAGS_ISLOW)
+		    entries[j].u.RANGELOW = lines[i].RANGELOW - HTOFFSET;
+		  else
+		    entries[j].u.RANGELOW = lines[i].RANGELOW + HTOFFSET;
+		  entries[j].PREFLEN = rem + RANGELEN;
+		  entries[j].RANGELEN = 0;
+		  entries[j].flags = eflags;
+		}
+	  }
+      }
+    }
+
+  return result;
+}
 
 /** Build an in-memory representation of a Huffman table from the
  *  set of template params provided by the spec or a table segment
@@ -290,191 +421,462 @@ jbig2_build_huffman_table (Jbig2Ctx *ctx, const Jbig2HuffmanParams *params)
   const int lencountsize = 256 * sizeof(*LENCOUNT);
   const Jbig2HuffmanLine *lines = params->lines;
   int n_lines = params->n_lines;
-  int i, j;
-  int max_j;
-  int log_table_size = 0;
-  Jbig2HuffmanTable *result;
-  Jbig2HuffmanEntry *entries;
+  uint32_t *codes;
+  int i;
   int CURLEN;
-  int firstcode = 0;
-  int CURCODE;
+  uint32_t firstcode = 0;
+  uint32_t CURCODE;
   int CURTEMP;
+  int avail;
+  Jbig2HuffmanTable *result;
 
   LENCOUNT = jbig2_alloc(ctx->allocator, lencountsize);
-  if (LENCOUNT == NULL) {
+  codes = jbig2_alloc(ctx->allocator, (n_lines ? n_lines : 1) * sizeof(*codes));
+  if (LENCOUNT == NULL || codes == NULL) {
     jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
       "couldn't allocate storage for huffman histogram");
+    jbig2_free(ctx->allocator, LENCOUNT);
+    jbig2_free(ctx->allocator, codes);
     return NULL;
   }
   memset(LENCOUNT, 0, lencountsize);
 
   /* B.3, 1. */
-  for (i = 0; i < params->n_lines; i++)
+  for (i = 0; i < n_lines; i++)
     {
       int PREFLEN = lines[i].PREFLEN;
-      int lts;
 
+      if (PREFLEN < 0 || PREFLEN > 32 || lines[i].RANGELEN < 0 ||
+	  lines[i].RANGELEN > 32) {
+	jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+	  "huffman table line %d is out of range (%d, %d)",
+	  i, PREFLEN, lines[i].RANGELEN);
+	goto fail;
+      }
       if (PREFLEN > LENMAX)
-		{
-			for (j = LENMAX + 1; j < PREFLEN + 1; j++)
-				LENCOUNT[j] = 0;
-			LENMAX = PREFLEN;
-		}
+	LENMAX = PREFLEN;
       LENCOUNT[PREFLEN]++;
-
-      lts = PREFLEN + lines[i].RANGELEN;
-      if (lts > LOG_TABLE_SIZE_MAX)
-		lts = PREFLEN;
-      if (lts <= LOG_TABLE_SIZE_MAX && log_table_size < lts)
-		log_table_size = lts;
     }
-  jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
-	"constructing huffman table log size %d", log_table_size);
-  max_j = 1 << log_table_size;
 
-  result = (Jbig2HuffmanTable *)jbig2_alloc(ctx->allocator, sizeof(Jbig2HuffmanTable));
-  result->log_table_size = log_table_size;
-  entries = (Jbig2HuffmanEntry *)jbig2_alloc(ctx->allocator, max_j * sizeof(Jbig2HuffmanEntry));
-  result->entries = entries;
+  /* a table with no codes would have an empty lookup table */
+  if (LENMAX <= 0) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "huffman table has no codes");
+    goto fail;
+  }
 
+  /* the lengths must leave room for a prefix code; the count of free
+     codes is capped since any more than n_lines are never needed */
   LENCOUNT[0] = 0;
-
+  avail = 1;
   for (CURLEN = 1; CURLEN <= LENMAX; CURLEN++)
     {
-      int shift = log_table_size - CURLEN;
+      avail = avail * 2 - LENCOUNT[CURLEN];
+      if (avail < 0) {
+	jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+	  "huffman table has too many codes of length %d", CURLEN);
+	goto fail;
+      }
+      if (avail > n_lines)
+	avail = n_lines;
+    }
 
+  /* B.3, 2. and 3. assign the codes */
+  for (CURLEN = 1; CURLEN <= LENMAX; CURLEN++)
+    {
       /* B.3 3.(a) */
       firstcode = (firstcode + LENCOUNT[CURLEN - 1]) << 1;
       CURCODE = firstcode;
       /* B.3 3.(b) */
       for (CURTEMP = 0; CURTEMP < n_lines; CURTEMP++)
-	{
-	  int PREFLEN = lines[CURTEMP].PREFLEN;
-	  if (PREFLEN == CURLEN)
-	    {
-	      int RANGELEN = lines[CURTEMP].RANGELEN;
-	      int start_j = CURCODE << shift;
-	      int end_j = (CURCODE + 1) << shift;
-	      byte eflags = 0;
-
-	      if (end_j > max_j) {
-		jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
-		  "ran off the end of the entries table! (%d >= %d)",
-		  end_j, max_j);
-		jbig2_free(ctx->allocator, result->entries);
-		jbig2_free(ctx->allocator, result);
-		jbig2_free(ctx->allocator, LENCOUNT);
-		return NULL;
-	      }
-	      /* todo: build extension tables */
-	      if (params->HTOOB && CURTEMP == n_lines - 1)
-		eflags |= JBIG2_HUFFMAN_FLAGS_ISOOB;
-	      if (CURTEMP == n_lines - (params->HTOOB ? 3 : 2))
-		eflags |= JBIG2_HUFFMAN_FLAGS_ISLOW;
-	      if (PREFLEN + RANGELEN > LOG_TABLE_SIZE_MAX) {
-		  for (j = start_j; j < end_j; j++) {
-		      entries[j].u.RANGELOW = lines[CURTEMP].RANGELOW;
-		      entries[j].PREFLEN = PREFLEN;
-		      entries[j].RANGELEN = RANGELEN;
-		      entries[j].flags = eflags;
-		    }
-	      } else {
-		  for (j = start_j; j < end_j; j++) {
-		      int32_t HTOFFSET = (j >> (shift - RANGELEN)) &
-			((1 << RANGELEN) - 1);
-		      if (eflags & JBIG2_HUFFMAN_FLAGS_ISLOW)
-			entries[j].u.RANGELOW = lines[CURTEMP].RANGELOW -
-			  HTOFFSET;
-		      else
-			entries[j].u.RANGELOW = lines[CURTEMP].RANGELOW +
-			  HTOFFSET;
-		      entries[j].PREFLEN = PREFLEN + RANGELEN;
-		      entries[j].RANGELEN = 0;
-		      entries[j].flags = eflags;
-		    }
-		}
-	      CURCODE++;
-	    }
-	}
+	if (lines[CURTEMP].PREFLEN == CURLEN)
+	  codes[CURTEMP] = CURCODE++;
     }
 
-  jbig2_free(ctx->allocator, LENCOUNT);
+  result = jbig2_build_huffman_subtable(ctx, params, codes, 0, 0);
+  if (result == NULL)
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+      "couldn't allocate storage for huffman table");
+  else
+    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
+      "constructed huffman table, first level log size %d",
+      result->log_table_size);
 
+  jbig2_free(ctx->allocator, LENCOUNT);
+  jbig2_free(ctx->allocator, codes);
   return result;
+
+ fail:
+  jbig2_free(ctx->allocator, LENCOUNT);
+  jbig2_free(ctx->allocator, codes);
+  return NULL;
 }
 
 /** Free the memory associated with the representation of table */
 void
 jbig2_release_huffman_table (Jbig2Ctx *ctx, Jbig2HuffmanTable *table)
 {
+  int j;
+
   if (table != NULL) {
+      for (j = 0; j < (1 << table->log_table_size); j++)
+	if (table->entries[j].flags & JBIG2_HUFFMAN_FLAGS_ISEXT)
+	  jbig2_release_huffman_table(ctx, table->entries[j].u.ext_table);
       jbig2_free(ctx->allocator, table->entries);
       jbig2_free(ctx->allocator, table);
   }
   return;
 }
 
+/* read bitlen bits, most significant first, from a table segment.
+   returns -1 when the data runs out */
+static int32_t
+jbig2_table_read_bits(const byte *data, size_t size, size_t *bitoffset,
+		      int bitlen)
+{
+  int32_t result = 0;
+
+  if (*bitoffset + bitlen > size * 8)
+    return -1;
+  while (bitlen--) {
+    result = (result << 1) |
+      ((data[*bitoffset >> 3] >> (7 - (*bitoffset & 7))) & 1);
+    (*bitoffset)++;
+  }
+  return result;
+}
+
+/* 7.4.13 code table segment: decode the table lines (B.2) and keep
+   them as the segment result, ready for jbig2_build_huffman_table() */
+int
+jbig2_table(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segment_data)
+{
+  Jbig2HuffmanParams *params;
+  Jbig2HuffmanLine *line;
+  const byte *lines_data;
+  size_t lines_size;
+  size_t boffset = 0;
+  int n_lines_max;
+  int NTEMP = 0;
+  int HTPS, HTRS;
+  int32_t HTLOW, HTHIGH;
+  int32_t CURRANGELOW;
+  uint32_t remaining;
+  byte flags;
+
+  if (segment->data_length < 9)
+    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+      "code table segment too short");
+
+  /* 7.4.13.1 */
+  flags = segment_data[0];
+  HTPS = ((flags >> 1) & 0x07) + 1;
+  HTRS = ((flags >> 4) & 0x07) + 1;
+  HTLOW = jbig2_get_int32(segment_data + 1);
+  HTHIGH = jbig2_get_int32(segment_data + 5);
+  if (HTLOW >= HTHIGH)
+    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+      "code table has an empty range (%d >= %d)", HTLOW, HTHIGH);
+
+  lines_data = segment_data + 9;
+  lines_size = segment->data_length - 9;
+  /* every line takes at least HTPS bits, and the range lines
+     and the out-of-band line are not counted by the first part */
+  n_lines_max = (int)(lines_size * 8 / HTPS) + 3;
+
+  params = jbig2_new(ctx, Jbig2HuffmanParams, 1);
+  line = params != NULL ? jbig2_new(ctx, Jbig2HuffmanLine, n_lines_max) : NULL;
+  if (line == NULL) {
+    jbig2_free(ctx->allocator, params);
+    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+      "could not allocate code table");
+  }
+  params->HTOOB = flags & 0x01;
+  params->lines = line;
+
+  /* B.2 1. - 4. the lines covering HTLOW to HTHIGH */
+  CURRANGELOW = HTLOW;
+  remaining = (uint32_t)HTHIGH - (uint32_t)HTLOW;
+  while (remaining > 0) {
+    line[NTEMP].PREFLEN = jbig2_table_read_bits(lines_data, lines_size, &boffset, HTPS);
+    line[NTEMP].RANGELEN = jbig2_table_read_bits(lines_data, lines_size, &boffset, HTRS);
+    if (line[NTEMP].RANGELEN < 0 || NTEMP >= n_lines_max - 3)
+      goto too_short;
+    if (line[NTEMP].RANGELEN > 31) {
+      jbig2_table_free(ctx, params);
+      return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	"code table line %d has too large a range", NTEMP);
+    }
+    line[NTEMP].RANGELOW = CURRANGELOW;
+    if ((1U << line[NTEMP].RANGELEN) >= remaining)
+      remaining = 0;
+    else {
+      remaining -= 1U << line[NTEMP].RANGELEN;
+      CURRANGELOW = (int32_t)((uint32_t)CURRANGELOW + (1U << line[NTEMP].RANGELEN));
+    }
+    NTEMP++;
+  }
+
+  /* B.2 5. - 8. the lower range line */
+  line[NTEMP].PREFLEN = jbig2_table_read_bits(lines_data, lines_size, &boffset, HTPS);
+  line[NTEMP].RANGELEN = 32;
+  line[NTEMP].RANGELOW = HTLOW - 1;
+  NTEMP++;
+
+  /* B.2 9. - 12. the upper range line */
+  line[NTEMP].PREFLEN = jbig2_table_read_bits(lines_data, lines_size, &boffset, HTPS);
+  line[NTEMP].RANGELEN = 32;
+  line[NTEMP].RANGELOW = HTHIGH;
+  NTEMP++;
+
+  /* B.2 13. the out-of-band line */
+  if (params->HTOOB) {
+    line[NTEMP].PREFLEN = jbig2_table_read_bits(lines_data, lines_size, &boffset, HTPS);
+    line[NTEMP].RANGELEN = 0;
+    line[NTEMP].RANGELOW = 0;
+    NTEMP++;
+  }
+  if (line[NTEMP - 1].PREFLEN < 0 || line[NTEMP - 2].PREFLEN < 0 ||
+      (params->HTOOB && line[NTEMP - 3].PREFLEN < 0))
+    goto too_short;
+
+  params->n_lines = NTEMP;
+  segment->result = params;
+
+  jbig2_error(ctx, JBIG2_SEVERITY_INFO, segment->number,
+    "code table with %d lines covering %d to %d%s",
+    NTEMP, HTLOW, HTHIGH, params->HTOOB ? " and OOB" : "");
+
+  return 0;
+
+ too_short:
+  params->n_lines = NTEMP;
+  jbig2_table_free(ctx, params);
+  return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+    "code table segment too short");
+}
+
+/* free the decoded lines of a code table segment */
+void
+jbig2_table_free(Jbig2Ctx *ctx, Jbig2HuffmanParams *params)
+{
+  if (params != NULL) {
+    jbig2_free(ctx->allocator, (void *)params->lines);
+    jbig2_free(ctx->allocator, params);
+  }
+}
+
+/* return the index'th code table segment referred to by a segment,
+   counting from zero. custom tables are taken from them in the order
+   the region or dictionary header lists its table selections */
+const Jbig2HuffmanParams *
+jbig2_find_table(Jbig2Ctx *ctx, Jbig2Segment *segment, int index)
+{
+  int i;
+  int n_tables = 0;
+
+  for (i = 0; i < segment->referred_to_segment_count; i++) {
+    const Jbig2Segment * const rsegment =
+      jbig2_find_segment(ctx, segment->referred_to_segments[i]);
+
+    if (rsegment && (rsegment->flags & 63) == 53) {
+      if (n_tables++ == index)
+	return (const Jbig2HuffmanParams *)rsegment->result;
+    }
+  }
+  return NULL;
+}
+
 #ifdef TEST
 #include <stdio.h>
 
-/* a test bitstream, and a list of the table indicies
-   to use in decoding it. 1 = table B.1 (A), 2 = table B.2 (B), and so on */
-/* this test stream should decode to { 8, 5, oob, 8 } */
+/* a value to decode, the table to decode it with and its code in the
+   stream, written out as '0' and '1' with spaces for readability */
+typedef struct {
+  const Jbig2HuffmanParams *params;
+  const char *bits;
+  int32_t value;
+  bool oob;
+} TestCode;
+
+/* codes longer than the 8 bit first level table, ending in a
+   range line and the low and high lines */
+static const Jbig2HuffmanLine test_long_lines[] = {
+  {1, 0, 0}, {2, 0, 1}, {3, 0, 2}, {4, 0, 3}, {5, 0, 4}, {6, 0, 5},
+  {7, 0, 6}, {8, 0, 7}, {9, 0, 8}, {10, 0, 9}, {11, 0, 10},
+  {12, 4, 11},
+  {13, 32, -1},  /* low */
+  {13, 32, 27}   /* high */
+};
+static const Jbig2HuffmanParams test_long = { FALSE, 14, test_long_lines };
+
+/* four one bit codes, as in a broken code table segment */
+static const Jbig2HuffmanLine test_over_lines[] = {
+  {1, 0, 0}, {1, 0, 1}, {1, 0, 2}, {1, 0, 3},
+  {0, 32, -1},  /* low */
+  {0, 32, 4}    /* high */
+};
+static const Jbig2HuffmanParams test_over = { FALSE, 6, test_over_lines };
+
+/* no codes at all */
+static const Jbig2HuffmanLine test_empty_lines[] = {
+  {0, 0, 0},
+  {0, 32, -1},  /* low */
+  {0, 32, 1}    /* high */
+};
+static const Jbig2HuffmanParams test_empty = { FALSE, 3, test_empty_lines };
+
+/* only the codes 00 and 01; anything starting with 1 is invalid */
+static const Jbig2HuffmanLine test_sparse_lines[] = {
+  {2, 0, 0}, {2, 0, 1},
+  {0, 32, -1},  /* low */
+  {0, 32, 2}    /* high */
+};
+static const Jbig2HuffmanParams test_sparse = { FALSE, 4, test_sparse_lines };
+
+static const TestCode test_codes[] = {
+  /* the original test stream, 0xe9 0xcb 0xf4 */
+  { &jbig2_huffman_params_D, "1110 100", 8, FALSE },
+  { &jbig2_huffman_params_B, "1110 010", 5, FALSE },
+  { &jbig2_huffman_params_B, "111111", 0, TRUE },
+  { &jbig2_huffman_params_A, "0 1000", 8, FALSE },
+  /* Table B.11 */
+  { &jbig2_huffman_params_K, "0", 1, FALSE },
+  { &jbig2_huffman_params_K, "10 1", 3, FALSE },
+  { &jbig2_huffman_params_K, "1100", 4, FALSE },
+  { &jbig2_huffman_params_K, "11101 11", 12, FALSE },
+  { &jbig2_huffman_params_K, "1111011 000", 21, FALSE },
+  { &jbig2_huffman_params_K, "1111110 111111", 140, FALSE },
+  { &jbig2_huffman_params_K,
+    "1111111 00000000 00000000 00000000 00000101", 146, FALSE },
+  /* Table B.12 */
+  { &jbig2_huffman_params_L, "10", 2, FALSE },
+  { &jbig2_huffman_params_L, "110 1", 4, FALSE },
+  { &jbig2_huffman_params_L, "11101 1", 7, FALSE },
+  { &jbig2_huffman_params_L, "1111110 1111", 40, FALSE },
+  { &jbig2_huffman_params_L, "11111110 11111", 72, FALSE },
+  /* Table B.13 */
+  { &jbig2_huffman_params_M, "100", 2, FALSE },
+  { &jbig2_huffman_params_M, "101 111", 14, FALSE },
+  { &jbig2_huffman_params_M, "11100", 4, FALSE },
+  { &jbig2_huffman_params_M, "1101 0", 5, FALSE },
+  { &jbig2_huffman_params_M, "111110 00001", 46, FALSE },
+  { &jbig2_huffman_params_M, "1111110 000000", 77, FALSE },
+  /* Table B.14 */
+  { &jbig2_huffman_params_N, "0", 0, FALSE },
+  { &jbig2_huffman_params_N, "100", -2, FALSE },
+  { &jbig2_huffman_params_N, "101", -1, FALSE },
+  { &jbig2_huffman_params_N, "110", 1, FALSE },
+  { &jbig2_huffman_params_N, "111", 2, FALSE },
+  /* codes continuing in extension tables */
+  { &test_long, "0", 0, FALSE },
+  { &test_long, "10", 1, FALSE },
+  { &test_long, "11111111 110", 10, FALSE },
+  { &test_long, "11111111 1110 0101", 16, FALSE },
+  { &test_long, "11111111 11110 00000000 00000000 00000000 00000011",
+    -4, FALSE },
+  { &test_long, "11111111 11111 00000000 00000000 00000000 00000101",
+    32, FALSE },
+  { &test_long, "11111111 11111 11111111 11111111 11111111 11111111",
+    (int32_t)(27U + 0xffffffffU), FALSE },
+  /* and an invalid code, which consumes nothing */
+  { &test_sparse, "01", 1, FALSE },
+  { &test_sparse, "", -1, -1 },
+  { &test_sparse, "11", -1, -1 },
+};
+
+static int
+test_quiet_error(void *data, const char *msg, Jbig2Severity severity,
+		 int32_t seg_idx)
+{
+  return 0;
+}
 
-const byte	test_stream[] = { 0xe9, 0xcb, 0xf4, 0x00 };
-const byte	test_tabindex[] = { 4, 2, 2, 1 };
+/* pack the bits of all the codes into one stream */
+static size_t
+test_pack_codes(byte *data, size_t size)
+{
+  size_t n_bits = 0;
+  size_t i;
+  const char *p;
+
+  memset(data, 0, size);
+  for (i = 0; i < sizeof(test_codes) / sizeof(*test_codes); i++)
+    for (p = test_codes[i].bits; *p; p++) {
+      if (*p == ' ')
+	continue;
+      if (*p == '1')
+	data[n_bits >> 3] |= 0x80 >> (n_bits & 7);
+      n_bits++;
+    }
+  return (n_bits + 7) >> 3;
+}
 
-static uint32_t
-test_get_word (Jbig2WordStream *self, int offset)
+static int
+test_rejected(Jbig2Ctx *ctx, const Jbig2HuffmanParams *params,
+	      const char *what)
 {
-	/* assume test_stream[] is at least 4 bytes */
-	if (offset+3 > sizeof(test_stream))
-		return 0;
-	else
-		return ( (test_stream[offset] << 24) |
-				 (test_stream[offset+1] << 16) |
-				 (test_stream[offset+2] << 8) |
-				 (test_stream[offset+3]) );
+  Jbig2HuffmanTable *table = jbig2_build_huffman_table(ctx, params);
+
+  if (table == NULL)
+    return 0;
+  printf("FAILED: %s table was accepted\n", what);
+  jbig2_release_huffman_table(ctx, table);
+  return 1;
 }
 
 int
 main (int argc, char **argv)
 {
   Jbig2Ctx *ctx;
-  Jbig2HuffmanTable *tables[5];
+  byte data[64];
+  Jbig2WordStream *ws;
   Jbig2HuffmanState *hs;
-  Jbig2WordStream ws;
-  bool oob;
-  int32_t code;
-
-  ctx = jbig2_ctx_new(NULL, 0, NULL, NULL, NULL);
+  int failures = 0;
+  size_t i;
 
-  tables[0] = NULL;
-  tables[1] = jbig2_build_huffman_table (ctx, &jbig2_huffman_params_A);
-  tables[2] = jbig2_build_huffman_table (ctx, &jbig2_huffman_params_B);
-  tables[3] = NULL;
-  tables[4] = jbig2_build_huffman_table (ctx, &jbig2_huffman_params_D);
-  ws.get_next_word = test_get_word;
-  hs = jbig2_huffman_new (ctx, &ws);
+  ctx = jbig2_ctx_new(NULL, 0, NULL, test_quiet_error, NULL);
+  if (ctx == NULL)
+    return 1;
 
-  printf("testing jbig2 huffmann decoding...");
-  printf("\t(should be 8 5 (oob) 8)\n");
+  printf("testing jbig2 huffman decoding...\n");
 
-  {
-	int i;
-	int sequence_length = sizeof(test_tabindex);
-
-	for (i = 0; i < sequence_length; i++) {
-		code = jbig2_huffman_get (hs, tables[test_tabindex[i]], &oob);
-		if (oob) printf("(oob) ");
-		else printf("%d ", code);
-	}
+  ws = jbig2_word_stream_buf_new(ctx, data, test_pack_codes(data, sizeof(data)));
+  hs = jbig2_huffman_new(ctx, ws);
+  if (hs == NULL) {
+    jbig2_ctx_free(ctx);
+    return 1;
   }
+  for (i = 0; i < sizeof(test_codes) / sizeof(*test_codes); i++) {
+    const TestCode *t = &test_codes[i];
+    Jbig2HuffmanTable *table = jbig2_build_huffman_table(ctx, t->params);
+    int32_t value;
+    bool oob = 0;
+
+    if (table == NULL) {
+      printf("FAILED: could not build the table for code %d\n", (int)i);
+      failures++;
+      break;
+    }
+    value = jbig2_huffman_get(hs, table, &oob);
+    if (oob != t->oob || (!oob && value != t->value) ||
+	(oob < 0 && value != -1)) {
+      printf("FAILED: code %d \"%s\" decoded as %d (oob %d),"
+	" expected %d (oob %d)\n", (int)i, t->bits, value, oob,
+	t->value, t->oob);
+      failures++;
+    }
+    jbig2_release_huffman_table(ctx, table);
+  }
+  jbig2_huffman_free(ctx, hs);
+  jbig2_word_stream_buf_free(ctx, ws);
 
-  printf("\n");
+  failures += test_rejected(ctx, &test_over, "over-subscribed");
+  failures += test_rejected(ctx, &test_empty, "empty");
 
   jbig2_ctx_free(ctx);
 
-  return 0;
+  printf(failures ? "FAILED\n" : "all tests passed\n");
+  return failures ? 1 : 0;
 }
 #endif
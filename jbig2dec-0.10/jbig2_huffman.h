@@ -84,6 +84,16 @@ jbig2_build_huffman_table (Jbig2Ctx *ctx, const Jbig2HuffmanParams *params);
 void
 jbig2_release_huffman_table (Jbig2Ctx *ctx, Jbig2HuffmanTable *table);
 
+/* 7.4.13 code table segment */
+int
+jbig2_table (Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segment_data);
+
+void
+jbig2_table_free (Jbig2Ctx *ctx, Jbig2HuffmanParams *params);
+
+const Jbig2HuffmanParams *
+jbig2_find_table (Jbig2Ctx *ctx, Jbig2Segment *segment, int index);
+
 /* standard Huffman templates defined by the specification */
 extern const Jbig2HuffmanParams jbig2_huffman_params_A; /* Table B.1  */
 extern const Jbig2HuffmanParams jbig2_huffman_params_B; /* Table B.2  */
@@ -237,7 +237,7 @@ const Jbig2HuffmanLine
 jbig2_huffman_lines_K[] = {
 	{1, 0, 1},
 	{2, 1, 2},
-	{4, 0, 3},
+	{4, 0, 4},
 	{4, 1, 5},
 	{5, 1, 7},
 	{5, 2, 9},
@@ -247,11 +247,12 @@ jbig2_huffman_lines_K[] = {
 	{7, 4, 29},
 	{7, 5, 45},
 	{7, 6, 77},
-	{7, 32, 141} /* high */
+	{0, 32, 0},   /* low */
+	{7, 32, 141}  /* high */
 };
 
 const Jbig2HuffmanParams
-jbig2_huffman_params_K = { FALSE, 13, jbig2_huffman_lines_K };
+jbig2_huffman_params_K = { FALSE, 14, jbig2_huffman_lines_K };
 
 /* Table B.12 */
 const Jbig2HuffmanLine
@@ -268,11 +269,12 @@ jbig2_huffman_lines_L[] = {
 	{7, 3, 17},
 	{7, 4, 25},
 	{8, 5, 41},
-	{8, 32, 73}
+	{0, 32, 0},  /* low */
+	{8, 32, 73}  /* high */
 };
 
 const Jbig2HuffmanParams
-jbig2_huffman_params_L = { FALSE, 13, jbig2_huffman_lines_L };
+jbig2_huffman_params_L = { FALSE, 14, jbig2_huffman_lines_L };
 
 
 /* Table B.13 */
@@ -290,11 +292,12 @@ jbig2_huffman_lines_M[] = {
 	{6, 4, 29},
 	{6, 5, 45},
 	{7, 6, 77},
-	{7, 32, 141} /* high */
+	{0, 32, 0},   /* low */
+	{7, 32, 141}  /* high */
 };
 
 const Jbig2HuffmanParams
-jbig2_huffman_params_M = { FALSE, 13, jbig2_huffman_lines_M };
+jbig2_huffman_params_M = { FALSE, 14, jbig2_huffman_lines_M };
 
 /* Table B.14 */
 const Jbig2HuffmanLine
@@ -302,8 +305,8 @@ jbig2_huffman_lines_N[] = {
   { 3, 0, -2 },
   { 3, 0, -1 },
   { 1, 0, 0 },
-  { 3, 3, 1 },
-  { 3, 6, 2 },
+  { 3, 0, 1 },
+  { 3, 0, 2 },
   { 0, 32, -1 }, /* low */
   { 0, 32, 3 }, /* high */
 };
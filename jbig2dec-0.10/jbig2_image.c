@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> /* memcpy() */
+#include <limits.h> /* INT_MAX */
 
 #include "jbig2.h"
 #include "jbig2_priv.h"
@@ -41,7 +42,15 @@ Jbig2Image* jbig2_image_new(Jbig2Ctx *ctx, int width, int height)
 	}
 
 	stride = ((width - 1) >> 3) + 1; /* generate a byte-aligned stride */
-	image->data = (uint8_t *)jbig2_alloc(ctx->allocator, stride*height);
+	/* the dimensions come from the stream, so don't let their product
+	   wrap around to a small allocation */
+	if (width < 0 || height < 0 || (height > 0 && stride > INT_MAX / height)) {
+		jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+			"image dimensions %dx%d are out of range", width, height);
+		jbig2_free(ctx->allocator, image);
+		return NULL;
+	}
+	image->data = (uint8_t *)jbig2_alloc(ctx->allocator, (size_t)stride*height);
 	if (image->data == NULL) {
                 jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
                     "could not allocate image data buffer! [%d bytes]\n", stride*height);
@@ -57,16 +66,20 @@ Jbig2Image* jbig2_image_new(Jbig2Ctx *ctx, int width, int height)
 	return image;
 }
 
-/* clone an image pointer by bumping its reference count */
+/* clone an image pointer by bumping its reference count.
+   frozen images (negative refcount) belong to a global context
+   which outlives its users, and are shared without counting so
+   that several threads can use them at once */
 Jbig2Image* jbig2_image_clone(Jbig2Ctx *ctx, Jbig2Image *image)
 {
-	image->refcount++;
+	if (image->refcount > 0) image->refcount++;
 	return image;
 }
 
 /* release an image pointer, freeing it it appropriate */
 void jbig2_image_release(Jbig2Ctx *ctx, Jbig2Image *image)
 {
+	if (image->refcount < 0) return;
 	image->refcount--;
 	if (!image->refcount) jbig2_image_free(ctx, image);
 }
@@ -101,9 +114,10 @@ Jbig2Image *jbig2_image_resize(Jbig2Ctx *ctx, Jbig2Image *image,
 	    /* we must allocate a new image buffer and copy */
 	    jbig2_error(ctx, JBIG2_SEVERITY_WARNING, -1,
 		"jbig2_image_resize called with a different width (NYI)");
+	    return NULL;
 	}
 
-	return NULL;
+	return image;
 }
 
 /* composite one jbig2_image onto another
@@ -156,7 +170,7 @@ int jbig2_image_compose_unopt(Jbig2Ctx *ctx,
 	    for (j = 0; j < sh; j++) {
 		for (i = 0; i < sw; i++) {
 		    jbig2_image_set_pixel(dst, i+x, j+y,
-			~(jbig2_image_get_pixel(src, i+sx, j+sy) ^
+			!(jbig2_image_get_pixel(src, i+sx, j+sy) ^
 			jbig2_image_get_pixel(dst, i+x, j+y)));
 		}
     	    }
@@ -174,96 +188,140 @@ int jbig2_image_compose_unopt(Jbig2Ctx *ctx,
     return 0;
 }
 
-/* composite one jbig2_image onto another */
+/* fetch the 8 pixels of a source row starting at pixel @bit,
+   which may lie partly outside the row; those pixels read as 0 */
+static uint8_t
+jbig2_image_fetch_byte(const uint8_t *row, int stride, int bit)
+{
+    const int byte = (bit + 8) / 8 - 1;	/* floor, since bit >= -8 */
+    const int shift = bit & 7;
+    const int hi = (byte >= 0 && byte < stride) ? row[byte] : 0;
+    const int lo = (byte + 1 >= 0 && byte + 1 < stride) ? row[byte + 1] : 0;
+
+    return (uint8_t)((hi << shift) | (lo >> (8 - shift)));
+}
+
+/* the body of the compositor, expanded once for each operator so
+   the operation is resolved outside the inner loops. the first and
+   last destination bytes of each row are masked and fetched with
+   bounds checks; the bytes in between are whole, and the source
+   bits for them are always inside the source row. */
+#define JBIG2_COMPOSE_ROWS(OP) \
+    for (j = 0; j < h; j++) { \
+        const uint8_t *s = src->data + (sy + j) * src->stride; \
+        uint8_t *d = dst->data + (y + j) * dst->stride + leftbyte; \
+        int bit = sbit; \
+        uint8_t v = jbig2_image_fetch_byte(s, src->stride, bit); \
+        if (leftbyte == rightbyte) { \
+            *d = (*d & ~mask) | (OP(*d, v) & mask); \
+            continue; \
+        } \
+        *d = (*d & ~leftmask) | (OP(*d, v) & leftmask); \
+        d++; \
+        bit += 8; \
+        if (shift == 0) { \
+            const uint8_t *sp = s + (bit >> 3); \
+            for (i = leftbyte + 1; i < rightbyte; i++, d++, sp++) \
+                *d = OP(*d, *sp); \
+        } else { \
+            const uint8_t *sp = s + (bit >> 3); \
+            for (i = leftbyte + 1; i < rightbyte; i++, d++, sp++) { \
+                v = (uint8_t)((sp[0] << shift) | (sp[1] >> (8 - shift))); \
+                *d = OP(*d, v); \
+            } \
+        } \
+        bit += (rightbyte - leftbyte - 1) << 3; \
+        v = jbig2_image_fetch_byte(s, src->stride, bit); \
+        *d = (*d & ~rightmask) | (OP(*d, v) & rightmask); \
+    }
+
+#define JBIG2_OP_OR(d, s) ((d) | (s))
+#define JBIG2_OP_AND(d, s) ((d) & (s))
+#define JBIG2_OP_XOR(d, s) ((d) ^ (s))
+#define JBIG2_OP_XNOR(d, s) (~((d) ^ (s)))
+#define JBIG2_OP_REPLACE(d, s) (s)
+
+/* composite one jbig2_image onto another, 8 pixels at a time */
 int jbig2_image_compose(Jbig2Ctx *ctx, Jbig2Image *dst, Jbig2Image *src,
 			int x, int y, Jbig2ComposeOp op)
 {
     int i, j;
     int w, h;
+    int sx = 0, sy = 0;
     int leftbyte, rightbyte;
-    int shift;
-    uint8_t *s, *ss;
-    uint8_t *d, *dd;
-    uint8_t mask, rightmask;
-
-    if (op != JBIG2_COMPOSE_OR) {
-	/* hand off the the general routine */
-	return jbig2_image_compose_unopt(ctx, dst, src, x, y, op);
-    }
+    int sbit, shift;
+    uint8_t leftmask, rightmask, mask;
 
-    /* clip */
+    /* clip to the dst image boundaries, moving the source
+       origin along with the destination */
     w = src->width;
     h = src->height;
-    ss = src->data;
-    /* FIXME: this isn't sufficient for the < 0 cases */
-    if (x < 0) { w += x; x = 0; }
-    if (y < 0) { h += y; y = 0; }
-    w = (x + w < dst->width) ? w : dst->width - x;
-    h = (y + h < dst->height) ? h : dst->height - y;
+    if (x < 0) { sx = -x; w += x; x = 0; }
+    if (y < 0) { sy = -y; h += y; y = 0; }
+    if (x + w > dst->width) w = dst->width - x;
+    if (y + h > dst->height) h = dst->height - y;
+    if (w <= 0 || h <= 0)
+        return 0;
 #ifdef JBIG2_DEBUG
     jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
       "composting %dx%d at (%d, %d) after clipping\n",
         w, h, x, y);
 #endif
 
-#if 0
-    /* special case complete/strip replacement */
-    /* disabled because it's only safe to do when the destination
-       buffer is all-blank. */
-    if ((x == 0) && (w == src->width)) {
-        memcpy(dst->data + y*dst->stride, src->data, h*src->stride);
-        return 0;
-    }
-#endif
-
     leftbyte = x >> 3;
     rightbyte = (x + w - 1) >> 3;
-    shift = x & 7;
-
-    /* general OR case */
-    s = ss;
-    d = dd = dst->data + y*dst->stride + leftbyte;
-    if (leftbyte == rightbyte) {
-	mask = 0x100 - (0x100 >> w);
-        for (j = 0; j < h; j++) {
-            *d |= (*s & mask) >> shift;
-            d += dst->stride;
-            s += src->stride;
-        }
-    } else if (shift == 0) {
-	rightmask = (w & 7) ? 0x100 - (1 << (8 - (w & 7))) : 0xFF;
-        for (j = 0; j < h; j++) {
-	    for (i = leftbyte; i < rightbyte; i++)
-		*d++ |= *s++;
-	    *d |= *s & rightmask;
-            d = (dd += dst->stride);
-            s = (ss += src->stride);
-	}
-    } else {
-	bool overlap = (((w + 7) >> 3) < ((x + w + 7) >> 3) - (x >> 3));
-	mask = 0x100 - (1 << shift);
-	if (overlap)
-	    rightmask = (0x100 - (0x100 >> ((x + w) & 7))) >> (8 - shift);
-	else
-	    rightmask = 0x100 - (0x100 >> (w & 7));
-        for (j = 0; j < h; j++) {
-	    *d++ |= (*s & mask) >> shift;
-            for(i = leftbyte; i < rightbyte - 1; i++) {
-		*d |= ((*s++ & ~mask) << (8 - shift));
-		*d++ |= ((*s & mask) >> shift);
-	    }
-	    if (overlap)
-		*d |= (*s & rightmask) << (8 - shift);
-	    else
-		*d |= ((s[0] & ~mask) << (8 - shift)) |
-		    ((s[1] & rightmask) >> shift);
-	    d = (dd += dst->stride);
-	    s = (ss += src->stride);
-	}
+    leftmask = 0xFF >> (x & 7);
+    rightmask = (0xFF00 >> (((x + w - 1) & 7) + 1)) & 0xFF;
+    mask = leftmask & rightmask;
+
+    /* the source pixel which lines up with the first pixel of
+       the leftmost destination byte, and its alignment */
+    sbit = sx - (x & 7);
+    shift = sbit & 7;
+
+    switch (op) {
+    case JBIG2_COMPOSE_OR:
+        JBIG2_COMPOSE_ROWS(JBIG2_OP_OR)
+        break;
+    case JBIG2_COMPOSE_AND:
+        JBIG2_COMPOSE_ROWS(JBIG2_OP_AND)
+        break;
+    case JBIG2_COMPOSE_XOR:
+        JBIG2_COMPOSE_ROWS(JBIG2_OP_XOR)
+        break;
+    case JBIG2_COMPOSE_XNOR:
+        JBIG2_COMPOSE_ROWS(JBIG2_OP_XNOR)
+        break;
+    case JBIG2_COMPOSE_REPLACE:
+        JBIG2_COMPOSE_ROWS(JBIG2_OP_REPLACE)
+        break;
     }
 
     return 0;
 }
+/* OR or XOR an image onto dst at a byte-aligned column @x (a multiple
+   of 8), whole bytes at a time and without clipping. used for glyphs
+   which have been pre-shifted to their destination alignment, so the
+   caller must ensure every byte of every row lies inside dst and that
+   any padding pixels in src are 0 */
+void jbig2_image_compose_aligned(Jbig2Image *dst, Jbig2Image *src,
+                        int x, int y, Jbig2ComposeOp op)
+{
+    const int bytes = src->stride;
+    const uint8_t *s = src->data;
+    uint8_t *d = dst->data + y * dst->stride + (x >> 3);
+    int i, j;
+
+    if (op == JBIG2_COMPOSE_XOR) {
+        for (j = 0; j < src->height; j++, s += bytes, d += dst->stride)
+            for (i = 0; i < bytes; i++)
+                d[i] ^= s[i];
+    } else {
+        for (j = 0; j < src->height; j++, s += bytes, d += dst->stride)
+            for (i = 0; i < bytes; i++)
+                d[i] |= s[i];
+    }
+}
 
 
 /* initialize an image bitmap to a constant value */
@@ -274,6 +332,139 @@ void jbig2_image_clear(Jbig2Ctx *ctx, Jbig2Image *image, int value)
     memset(image->data, fill, image->stride*image->height);
 }
 
+/* reverse the order of the bits in a byte */
+static uint8_t
+jbig2_reverse_bits(uint8_t b)
+{
+    b = (b >> 4) | (b << 4);
+    b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+    return ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+}
+
+/* swap the bytes of each 32 bit word of a row, when the host is
+   little endian */
+static void
+jbig2_image_output_swap(uint8_t *row, int len)
+{
+    const uint32_t one = 1;
+    int i;
+
+    if (*(const uint8_t *)&one != 1)
+        return;
+    for (i = 0; i < len; i += 4) {
+        uint8_t t = row[i];
+        row[i] = row[i + 3];
+        row[i + 3] = t;
+        t = row[i + 1];
+        row[i + 1] = row[i + 2];
+        row[i + 2] = t;
+    }
+}
+
+/* reduce rows of an image by the output scale, setting each output
+   pixel to the share of black pixels in its block. blocks at the
+   right and bottom edges only count the pixels of the image they
+   cover. @first_row is a multiple of the scale */
+static void
+jbig2_image_output_reduced(Jbig2Image *image, int first_row, int n_rows,
+                           const Jbig2PageOutput *output)
+{
+    static const uint8_t bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    const int scale = output->scale;
+    const uint8_t field = 0xFF >> (8 - scale);
+    const int invert = (output->flags & JBIG2_OUTPUT_INVERT) ? 0xFF : 0;
+    int width = (image->width + scale - 1) / scale;
+    int len, i, j, k;
+
+    if (width > output->width)
+        width = output->width;
+    len = (output->flags & JBIG2_OUTPUT_NATIVE_WORDS) ? (width + 3) & ~3 : width;
+
+    for (j = first_row; j < first_row + n_rows && j / scale < output->height; j += scale) {
+        const int rows = j + scale <= first_row + n_rows ? scale : first_row + n_rows - j;
+        uint8_t *dst = output->data + (j / scale) * output->stride;
+
+        for (i = 0; i < width; i++) {
+            const int x = i * scale;
+            const int shift = 8 - scale - (x & 7);
+            const int cols = x + scale <= image->width ? scale : image->width - x;
+            /* the pixels of this block, past the right edge cleared */
+            const uint8_t mask = (field << (scale - cols)) & field;
+            const uint8_t *src = image->data + j * image->stride + (x >> 3);
+            int count = 0, area = rows * cols;
+
+            for (k = 0; k < rows; k++, src += image->stride) {
+                const uint8_t v = (*src >> shift) & mask;
+                count += bits[v & 15] + bits[v >> 4];
+            }
+            dst[i] = ((count * 255 + area / 2) / area) ^ invert;
+        }
+        memset(dst + width, invert, len - width);
+        if (output->flags & JBIG2_OUTPUT_NATIVE_WORDS)
+            jbig2_image_output_swap(dst, len);
+    }
+}
+
+/* convert rows of an image to the layout of a client's page output
+   buffer, writing them to the same rows there */
+void jbig2_image_output_rows(Jbig2Image *image, int first_row, int n_rows,
+                             const Jbig2PageOutput *output)
+{
+    const int width = image->width < output->width ? image->width : output->width;
+    const int n_bytes = (width + 7) >> 3;
+    const uint8_t mask = 0xFF << ((8 - (width & 7)) & 7);
+    const uint8_t black = (output->flags & JBIG2_OUTPUT_INVERT) ? 0x00 : 0xFF;
+    const bool swap = (output->flags & JBIG2_OUTPUT_NATIVE_WORDS) != 0;
+    int len = output->depth == 8 ? width : n_bytes;
+    int i, j;
+
+    if (output->scale > 1) {
+        jbig2_image_output_reduced(image, first_row, n_rows, output);
+        return;
+    }
+    if (width <= 0)
+        return;
+    if (first_row + n_rows > output->height)
+        n_rows = output->height - first_row;
+    /* whole words are swapped, so fill out the last one */
+    if (swap)
+        len = (len + 3) & ~3;
+
+    for (j = first_row; j < first_row + n_rows; j++) {
+        const uint8_t *src = image->data + j * image->stride;
+        uint8_t *dst = output->data + j * output->stride;
+
+        if (output->depth == 8) {
+            const uint8_t white = ~black;
+            for (i = 0; i + 8 <= width; i += 8) {
+                const uint8_t b = src[i >> 3];
+                dst[i] = -(b >> 7) ^ white;
+                dst[i + 1] = -((b >> 6) & 1) ^ white;
+                dst[i + 2] = -((b >> 5) & 1) ^ white;
+                dst[i + 3] = -((b >> 4) & 1) ^ white;
+                dst[i + 4] = -((b >> 3) & 1) ^ white;
+                dst[i + 5] = -((b >> 2) & 1) ^ white;
+                dst[i + 6] = -((b >> 1) & 1) ^ white;
+                dst[i + 7] = -(b & 1) ^ white;
+            }
+            for (; i < width; i++)
+                dst[i] = ((src[i >> 3] >> (7 - (i & 7))) & 1) ? black : white;
+            memset(dst + width, white, len - width);
+        } else {
+            for (i = 0; i < n_bytes - 1; i++)
+                dst[i] = src[i] ^ ~black;
+            dst[i] = (src[i] & mask) ^ ~black;
+            if (output->flags & JBIG2_OUTPUT_LSB_FIRST)
+                for (i = 0; i < n_bytes; i++)
+                    dst[i] = jbig2_reverse_bits(dst[i]);
+            memset(dst + n_bytes, ~black, len - n_bytes);
+        }
+
+        if (swap)
+            jbig2_image_output_swap(dst, len);
+    }
+}
+
 /* look up a pixel value in an image.
    returns 0 outside the image frame for the convenience of
    the template code
@@ -311,3 +502,70 @@ int jbig2_image_set_pixel(Jbig2Image *image, int x, int y, bool value)
 
   return 1;
 }
+
+#ifdef TEST
+/* check the word-parallel compositor against the pixel-at-a-time
+   reference for random images, offsets and operators */
+
+static unsigned int test_seed = 1;
+
+static int
+test_rand(int n)
+{
+  test_seed = test_seed * 1103515245 + 12345;
+  return (test_seed >> 16) % n;
+}
+
+/* random content, including the padding bits at the end of each row */
+static Jbig2Image *
+test_random_image(Jbig2Ctx *ctx, int width, int height)
+{
+  Jbig2Image *image = jbig2_image_new(ctx, width, height);
+  int i;
+
+  if (image != NULL)
+    for (i = 0; i < image->stride * height; i++)
+      image->data[i] = test_rand(256);
+  return image;
+}
+
+int
+main(int argc, char **argv)
+{
+  Jbig2Ctx *ctx = jbig2_ctx_new(NULL, 0, NULL, NULL, NULL);
+  int failures = 0;
+  int n;
+
+  for (n = 0; n < 50000; n++)
+    {
+      const int sw = 1 + test_rand(48), sh = 1 + test_rand(5);
+      const int dw = 1 + test_rand(48), dh = 1 + test_rand(5);
+      const int x = test_rand(sw + dw + 16) - sw - 8;
+      const int y = test_rand(sh + dh + 2) - sh - 1;
+      const Jbig2ComposeOp op = (Jbig2ComposeOp)test_rand(5);
+      Jbig2Image *src = test_random_image(ctx, sw, sh);
+      Jbig2Image *dst = test_random_image(ctx, dw, dh);
+      Jbig2Image *ref = jbig2_image_new(ctx, dw, dh);
+
+      if (src == NULL || dst == NULL || ref == NULL)
+        return 1;
+      memcpy(ref->data, dst->data, dst->stride * dh);
+      jbig2_image_compose(ctx, dst, src, x, y, op);
+      jbig2_image_compose_unopt(ctx, ref, src, x, y, op);
+      if (memcmp(dst->data, ref->data, dst->stride * dh))
+        {
+          if (failures++ < 10)
+            fprintf(stderr, "mismatch: src %dx%d onto dst %dx%d at (%d,%d) op %d\n",
+                    sw, sh, dw, dh, x, y, (int)op);
+        }
+      jbig2_image_release(ctx, ref);
+      jbig2_image_release(ctx, dst);
+      jbig2_image_release(ctx, src);
+    }
+
+  printf("%d random compositions, %d mismatches\n", n, failures);
+  jbig2_ctx_free(ctx);
+
+  return failures ? 1 : 0;
+}
+#endif
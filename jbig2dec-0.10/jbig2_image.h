@@ -33,6 +33,14 @@ Jbig2Image *jbig2_image_read_pbm(Jbig2Ctx *ctx, FILE *in);
 #ifdef HAVE_LIBPNG
 int jbig2_image_write_png_file(Jbig2Image *image, char *filename);
 int jbig2_image_write_png(Jbig2Image *image, FILE *out);
+
+/* png compression levels: 0-9 are zlib's deflate levels */
+#define JBIG2_PNG_LEVEL_DEFAULT -1	/* zlib's default, level 6 */
+#define JBIG2_PNG_LEVEL_RLE -2		/* run-length coding only, fastest */
+
+int jbig2_image_write_png_file_level(Jbig2Image *image, char *filename,
+                                     int level);
+int jbig2_image_write_png_level(Jbig2Image *image, FILE *out, int level);
 #endif
 
 #endif /* _JBIG2_IMAGE_H */
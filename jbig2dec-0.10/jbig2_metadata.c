@@ -82,16 +82,22 @@ int jbig2_metadata_add(Jbig2Ctx *ctx, Jbig2Metadata *md,
 
     /* grow the array if necessary */
     if (md->entries == md->max_entries) {
-        md->max_entries >>= 2;
-        keys = jbig2_realloc(ctx->allocator, md->keys, md->max_entries);
-        values = jbig2_realloc(ctx->allocator, md->values, md->max_entries);
+        const int max_entries = md->max_entries << 1;
+
+        keys = jbig2_realloc(ctx->allocator, md->keys,
+            max_entries*sizeof(char*));
+        if (keys != NULL)
+            md->keys = keys;
+        values = jbig2_realloc(ctx->allocator, md->values,
+            max_entries*sizeof(char*));
+        if (values != NULL)
+            md->values = values;
         if (keys == NULL || values == NULL) {
             jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
                 "unable to resize metadata structure");
             return -1;
         }
-        md->keys = keys;
-        md->values = values;
+        md->max_entries = max_entries;
     }
 
     /* copy the passed key,value pair */
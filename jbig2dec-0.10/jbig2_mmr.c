@@ -731,31 +731,76 @@ const mmr_table_node jbig2_mmr_black_decode[] = {
 
 #define getbit(buf, x) ( ( buf[x >> 3] >> ( 7 - (x & 7) ) ) & 1 )
 
+/* masks for the bits of a byte at and after a given bit position */
+static const byte lm[8] = { 0xFF, 0x7F, 0x3F, 0x1F, 0x0F, 0x07, 0x03, 0x01 };
+static const byte rm[8] = { 0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE };
+
+/* the number of leading zero bits in each byte value */
+static const byte jbig2_mmr_clz[256] = {
+	8, 7, 6, 6, 5, 5, 5, 5, 4, 4, 4, 4, 4, 4, 4, 4,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/* find the first pixel after x whose colour differs from the one
+   at x, or from white when x is -1. rather than testing one pixel
+   at a time, the line is xored with the colour being skipped so
+   that the first set bit marks the change; whole bytes and runs
+   of four bytes of that colour are stepped over at once. */
 static int
 jbig2_find_changing_element(const byte *line, int x, int w)
 {
-	int a, b;
+	const int n_bytes = (w + 7) >> 3;
+	byte skip;
+	byte b;
+	int i;
 
 	if (line == 0)
 		return w;
 
 	if (x == -1) {
-		a = 0;
+		skip = 0;
 		x = 0;
 	}
+	else if (x >= w)
+		return w;
 	else {
-		a = getbit(line, x);
+		skip = getbit(line, x) ? 0xFF : 0x00;
 		x ++;
+		if (x >= w)
+			return w;
 	}
 
-	while (x < w) {
-		b = getbit(line, x);
-		if (a != b)
-			break;
-		x++;
+	/* the rest of the first byte */
+	i = x >> 3;
+	b = (line[i] ^ skip) & lm[x & 7];
+	if (b == 0) {
+		for (i++; i + 4 <= n_bytes; i += 4)
+			if ((line[i] ^ skip) | (line[i + 1] ^ skip) |
+			    (line[i + 2] ^ skip) | (line[i + 3] ^ skip))
+				break;
+		for (; i < n_bytes; i++)
+			if ((b = line[i] ^ skip) != 0)
+				break;
+		if (i == n_bytes)
+			return w;
 	}
 
-	return x;
+	x = (i << 3) + jbig2_mmr_clz[b];
+	return x < w ? x : w;
 }
 
 static int
@@ -769,8 +814,18 @@ jbig2_find_changing_element_of_color(const byte *line, int x, int w, int color)
 	return x;
 }
 
-static const byte lm[8] = { 0xFF, 0x7F, 0x3F, 0x1F, 0x0F, 0x07, 0x03, 0x01 };
-static const byte rm[8] = { 0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE };
+/* check whether a decoded line has no black pixels */
+static int
+jbig2_mmr_line_is_white(const byte *line, int w)
+{
+	const int n_bytes = (w + 7) >> 3;
+	byte acc = 0;
+	int i;
+
+	for (i = 0; i < n_bytes; i++)
+		acc |= line[i];
+	return acc == 0;
+}
 
 static void
 jbig2_set_bits(byte *line, int x0, int x1)
@@ -987,12 +1042,18 @@ jbig2_decode_generic_mmr(Jbig2Ctx *ctx,
 	jbig2_decode_mmr_init(&mmr, image->width, image->height, data, size);
 
 	for (y = 0; y < image->height; y++) {
+		if (jbig2_poll_rows(ctx, y))
+			return -1;
 		memset(dst, 0, rowstride);
 		jbig2_decode_mmr_line(&mmr, ref, dst);
-		ref = dst;
+		/* an all-white line has no changing elements, which is
+		   what the decoder assumes for a missing reference line */
+		ref = jbig2_mmr_line_is_white(dst, image->width) ? NULL : dst;
 		dst += rowstride;
 	}
 
+	ctx->coded_bytes += mmr.data_index < size ? mmr.data_index : size;
+
 	return 0;
 }
 
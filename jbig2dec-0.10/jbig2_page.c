@@ -19,6 +19,7 @@
 #include "os_types.h"
 
 #include <stdlib.h>
+#include <string.h> /* memcpy() */
 
 #include "jbig2.h"
 #include "jbig2_priv.h"
@@ -53,6 +54,195 @@ dump_page_info(Jbig2Ctx *ctx, Jbig2Segment *segment, Jbig2Page *page)
     }
 }
 
+/* allocate a page image, reusing the pooled buffer of a released
+   page when it has the same dimensions */
+static Jbig2Image *
+jbig2_page_image_new(Jbig2Ctx *ctx, int width, int height)
+{
+    Jbig2Image *image = ctx->page_pool;
+
+    if (image != NULL) {
+        ctx->page_pool = NULL;
+        if (image->width == width && image->height == height) {
+            jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
+                "reusing pooled %dx%d page image", width, height);
+            return image;
+        }
+        jbig2_image_release(ctx, image);
+    }
+
+    return jbig2_image_new(ctx, width, height);
+}
+
+/* set up the client's output buffer for a page, if it wants one, and
+   wrap it in the page image when it can be decoded into directly */
+static Jbig2Image *
+jbig2_page_output_new(Jbig2Ctx *ctx, Jbig2Segment *segment, Jbig2Page *page)
+{
+    Jbig2PageOutput *output = &page->output;
+    const int height = page->height == 0xFFFFFFFF ? -1 : (int)page->height;
+    Jbig2Image *image;
+
+    memset(output, 0, sizeof(*output));
+    page->output_direct = FALSE;
+    if (ctx->output_callback == NULL)
+        return NULL;
+
+    ctx->output_callback(ctx->output_callback_data, page->number,
+        page->width, height, output);
+    if (output->data == NULL)
+        return NULL;
+    if (output->scale == 0)
+        output->scale = 1;
+    if ((output->depth != 1 && output->depth != 8) ||
+            (output->scale != 1 && (output->depth != 8 ||
+                (output->scale != 2 && output->scale != 4 && output->scale != 8))) ||
+            output->stride < (output->depth == 8 ? output->width :
+                ((output->width + 7) >> 3)) ||
+            ((output->flags & JBIG2_OUTPUT_NATIVE_WORDS) && (output->stride & 3))) {
+        jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
+            "ignoring unusable %dx%d %d bpp output buffer for page %d",
+            output->width, output->height, output->depth, page->number);
+        output->data = NULL;
+        return NULL;
+    }
+
+    if (output->depth != 1 || output->flags != 0 || height < 0 ||
+            output->scale != 1 ||
+            output->width < (int)page->width || output->height < height)
+        return NULL;
+
+    image = jbig2_new(ctx, Jbig2Image, 1);
+    if (image == NULL)
+        return NULL;
+    image->width = page->width;
+    image->height = height;
+    image->stride = output->stride;
+    image->data = output->data;
+    image->refcount = 1;
+    page->output_direct = TRUE;
+    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
+        "decoding page %d directly into the output buffer", page->number);
+
+    return image;
+}
+
+/* drop a page's image. one decoded into the client's output
+   buffer only owns its structure */
+void
+jbig2_page_free_image(Jbig2Ctx *ctx, Jbig2Page *page)
+{
+    if (page->output_direct)
+        jbig2_free(ctx->allocator, page->image);
+    else
+        jbig2_image_release(ctx, page->image);
+    page->image = NULL;
+}
+
+/* pass rows up to @end of the page image which haven't yet been
+   passed on to the client: converted into its output buffer, then to the
+   stripe callback. a reduced output only takes whole blocks of rows
+   until the page is complete */
+static void
+jbig2_page_stripe_out(Jbig2Ctx *ctx, Jbig2Page *page, int end)
+{
+    Jbig2Image *image = page->image;
+
+    if (image == NULL)
+        return;
+    if (end > image->height)
+        end = image->height;
+
+    if (page->output.data != NULL && !page->output_direct) {
+        int rows = end;
+
+        if (page->state != JBIG2_PAGE_COMPLETE)
+            rows -= rows % page->output.scale;
+        if (rows > page->rows_converted) {
+            jbig2_image_output_rows(image, page->rows_converted,
+                rows - page->rows_converted, &page->output);
+            page->rows_converted = rows;
+        }
+    }
+
+    if (ctx->stripe_callback != NULL && end > page->rows_out) {
+        jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
+            "page %d rows %d to %d out to the stripe callback",
+            page->number, page->rows_out, end - 1);
+        ctx->stripe_callback(ctx->stripe_callback_data, page->number,
+            image->data + page->rows_out * image->stride, page->rows_out,
+            end - page->rows_out, image->width, image->stride);
+        page->rows_out = end;
+    }
+}
+
+/* make the page image at least @height rows tall, for striped pages
+   whose stripes run past the rows seen so far. the buffer is reserved
+   geometrically, so a page of unknown height made of many stripes is
+   only copied a few times rather than once per stripe. new rows are
+   filled with the default pixel value. */
+static int
+jbig2_page_grow(Jbig2Ctx *ctx, Jbig2Page *page, int height)
+{
+    Jbig2Image *image = page->image;
+
+    /* the client's buffer can't grow; anything below it is clipped */
+    if (height <= image->height || page->output_direct)
+        return 0;
+
+    if (height > page->capacity) {
+        int capacity = page->capacity * 2;
+        uint8_t *data;
+
+        if (capacity < height)
+            capacity = height;
+        data = jbig2_realloc(ctx->allocator, image->data,
+            (size_t)capacity * image->stride);
+        if (data == NULL && capacity > height) {
+            /* doubling may be too much under a memory limit */
+            capacity = height;
+            data = jbig2_realloc(ctx->allocator, image->data,
+                (size_t)capacity * image->stride);
+        }
+        if (data == NULL)
+            return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+                "failed to grow page buffer to %d rows", capacity);
+        jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
+            "growing page buffer to %d rows to accomodate new stripe",
+            capacity);
+        image->data = data;
+        page->capacity = capacity;
+    }
+
+    memset(image->data + image->height * image->stride,
+        (page->flags & 4) ? 0xFF : 0,
+        (height - image->height) * image->stride);
+    image->height = height;
+
+    return 0;
+}
+
+/**
+ * jbig2_set_stripe_callback: deliver page rows as stripes complete
+ **/
+void
+jbig2_set_stripe_callback(Jbig2Ctx *ctx, Jbig2StripeCallback callback, void *data)
+{
+    ctx->stripe_callback = callback;
+    ctx->stripe_callback_data = data;
+}
+
+/**
+ * jbig2_set_page_output_callback: decode pages into client buffers
+ **/
+void
+jbig2_set_page_output_callback(Jbig2Ctx *ctx, Jbig2PageOutputCallback callback,
+                               void *data)
+{
+    ctx->output_callback = callback;
+    ctx->output_callback_data = data;
+}
+
 /**
  * jbig2_read_page_info: parse page info segment
  *
@@ -72,6 +262,7 @@ jbig2_parse_page_info (Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segm
         page->state = JBIG2_PAGE_COMPLETE;
         jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
             "unexpected page info segment, marking previous page finished");
+        jbig2_page_stripe_out(ctx, page, page->image ? page->image->height : 0);
     }
 
     /* find a free page */
@@ -82,8 +273,13 @@ jbig2_parse_page_info (Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segm
             index++;
             if (index >= ctx->max_page_index) { /* FIXME: should also look for freed pages? */
                 /* grow the list */
-		ctx->pages = jbig2_realloc(ctx->allocator, ctx->pages,
-			(ctx->max_page_index <<= 2) * sizeof(Jbig2Page));
+                Jbig2Page *pages = jbig2_renew(ctx, ctx->pages, Jbig2Page,
+                    ctx->max_page_index << 2);
+                if (pages == NULL)
+                    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+                        "failed to grow the page list");
+                ctx->pages = pages;
+                ctx->max_page_index <<= 2;
                 for (j=index; j < ctx->max_page_index; j++) {
                     /* note to raph: and look, it gets worse! */
                     ctx->pages[j].state = JBIG2_PAGE_FREE;
@@ -97,6 +293,8 @@ jbig2_parse_page_info (Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segm
         ctx->current_page = index;
         page->state = JBIG2_PAGE_NEW;
         page->number = segment->page_association;
+        page->output.data = NULL;
+        page->output_direct = FALSE;
     }
 
     /* FIXME: would be nice if we tried to work around this */
@@ -130,6 +328,9 @@ jbig2_parse_page_info (Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segm
         page->striped = TRUE;
     }
     page->end_row = 0;
+    page->dirty_rows = 0;
+    page->rows_out = 0;
+    page->rows_converted = 0;
 
     if (segment->data_length > 19) {
         jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
@@ -140,16 +341,20 @@ jbig2_parse_page_info (Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segm
 
     /* allocate an approprate page image buffer */
     /* 7.4.8.2 */
-    if (page->height == 0xFFFFFFFF) {
-        page->image = jbig2_image_new(ctx, page->width, page->stripe_size);
-    } else {
-        page->image = jbig2_image_new(ctx, page->width, page->height);
+    page->image = jbig2_page_output_new(ctx, segment, page);
+    if (page->image == NULL) {
+        if (page->height == 0xFFFFFFFF)
+            page->image = jbig2_page_image_new(ctx, page->width, page->stripe_size);
+        else
+            page->image = jbig2_page_image_new(ctx, page->width, page->height);
     }
     if (page->image == NULL) {
-        jbig2_free(ctx->allocator, page);
+        /* the page stays in the list without an image: its regions
+           are dropped and it isn't returned to the client */
         return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
             "failed to allocate buffer for page image");
     } else {
+        page->capacity = page->image->height;
 	/* 8.2 (3) fill the page with the default pixel value */
 	jbig2_image_clear(ctx, page->image, (page->flags & 4));
         jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
@@ -167,21 +372,35 @@ jbig2_parse_page_info (Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segm
 int
 jbig2_parse_end_of_stripe(Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segment_data)
 {
-    Jbig2Page page = ctx->pages[ctx->current_page];
+    Jbig2Page *page = &ctx->pages[ctx->current_page];
     int end_row;
 
+    if (segment->data_length < 4)
+        return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+            "end of stripe segment too short");
+
     end_row = jbig2_get_int32(segment_data);
-    if (end_row < page.end_row) {
+    if (end_row < page->end_row) {
 	jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
 	    "end of stripe segment with non-positive end row advance"
 	    " (new end row %d vs current end row %d)",
-	    end_row, page.end_row);
+	    end_row, page->end_row);
     } else {
 	jbig2_error(ctx, JBIG2_SEVERITY_INFO, segment->number,
 	    "end of stripe: advancing end row to %d", end_row);
     }
 
-    page.end_row = end_row;
+    page->end_row = end_row;
+
+    /* the stripe ends the page so far, even if its bottom
+       rows were left at the default pixel value */
+    if (page->height == 0xFFFFFFFF && page->image != NULL &&
+            jbig2_page_grow(ctx, page, end_row + 1) < 0)
+        return -1;
+
+    /* 7.4.10: regions which follow lie below the end row, so
+       everything up to and including it is final */
+    jbig2_page_stripe_out(ctx, page, end_row + 1);
 
     return 0;
 }
@@ -197,6 +416,7 @@ jbig2_parse_end_of_stripe(Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *s
 int
 jbig2_complete_page (Jbig2Ctx *ctx)
 {
+    Jbig2Page *page;
 
     /* check for unfinished segments */
     if (ctx->segment_index != ctx->n_segments) {
@@ -210,12 +430,31 @@ jbig2_complete_page (Jbig2Ctx *ctx)
           "File has an invalid segment data length!"
           " Trying to decode using the available data.");
         segment->data_length = ctx->buf_wr_ix - ctx->buf_rd_ix;
-        code = jbig2_parse_segment(ctx, segment, ctx->buf + ctx->buf_rd_ix);
+        ctx->interrupted = FALSE;
+        code = jbig2_parse_segment_polled(ctx, segment,
+            ctx->buf + ctx->buf_rd_ix);
+        if (ctx->interrupted) {
+          /* leave the page to be completed by another call */
+          segment->data_length = 0xffffffff;
+          return JBIG2_INTERRUPTED;
+        }
         ctx->buf_rd_ix += segment->data_length;
         ctx->segment_index++;
       }
     }
-    ctx->pages[ctx->current_page].state = JBIG2_PAGE_COMPLETE;
+    page = &ctx->pages[ctx->current_page];
+    page->state = JBIG2_PAGE_COMPLETE;
+
+    /* give back the rows reserved for stripes which never came */
+    if (page->image != NULL && page->capacity > page->image->height) {
+        uint8_t *data = jbig2_realloc(ctx->allocator, page->image->data,
+            (size_t)page->image->height * page->image->stride);
+        if (data != NULL) {
+            page->image->data = data;
+            page->capacity = page->image->height;
+        }
+    }
+    jbig2_page_stripe_out(ctx, page, page->image ? page->image->height : 0);
 
     return 0;
 }
@@ -256,24 +495,83 @@ int
 jbig2_page_add_result(Jbig2Ctx *ctx, Jbig2Page *page, Jbig2Image *image,
 		      int x, int y, Jbig2ComposeOp op)
 {
+    if (page->image == NULL)
+        return jbig2_error(ctx, JBIG2_SEVERITY_WARNING, -1,
+            "no page image to add the region to, dropping it");
+
     /* grow the page to accomodate a new stripe if necessary */
-    if (page->striped) {
-	int new_height = y + image->height + page->end_row;
-	if (page->image->height < new_height) {
-	    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
-		"growing page buffer to %d rows "
-		"to accomodate new stripe", new_height);
-	    jbig2_image_resize(ctx, page->image,
-		page->image->width, new_height);
-	}
-    }
+    if (page->striped && jbig2_page_grow(ctx, page, y + image->height) < 0)
+        return -1;
 
+    /* region y offsets are relative to the top of the page,
+       not to the current stripe */
     jbig2_image_compose(ctx, page->image, image,
-                        x, y + page->end_row, JBIG2_COMPOSE_OR);
+                        x, y, JBIG2_COMPOSE_OR);
+    if (page->dirty_rows < y + image->height)
+        page->dirty_rows = y + image->height;
 
     return 0;
 }
 
+/**
+ * jbig2_page_region_in_place: decode a region straight into the page
+ *
+ * when a region spans the full width of the page, lies below any rows
+ * earlier regions have touched, and composing it would just copy it
+ * (OR or REPLACE onto a page cleared to 0), there is no need for a
+ * separate region buffer. in that case @region is set up as a view of
+ * the page rows it covers and TRUE is returned; the caller decodes
+ * into it, calls jbig2_page_region_in_place_done() and does not call
+ * jbig2_page_add_result(). otherwise FALSE is returned.
+ **/
+bool
+jbig2_page_region_in_place(Jbig2Ctx *ctx, Jbig2Page *page, Jbig2Image *region,
+                           int x, int y, int width, int height,
+                           Jbig2ComposeOp op)
+{
+    Jbig2Image *image = page->image;
+
+    if (image == NULL || x != 0 || width != image->width || height <= 0)
+        return FALSE;
+    if ((op != JBIG2_COMPOSE_OR && op != JBIG2_COMPOSE_REPLACE) ||
+            (page->flags & 4))
+        return FALSE;
+    if (y < 0 || y < page->dirty_rows)
+        return FALSE;
+    if (page->striped && jbig2_page_grow(ctx, page, y + height) < 0)
+        return FALSE;
+    if (y + height > image->height)
+        return FALSE;
+
+    region->width = width;
+    region->height = height;
+    region->stride = image->stride;
+    region->data = image->data + y * image->stride;
+    region->refcount = 1;
+    page->dirty_rows = y + height;
+
+    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
+        "decoding %d x %d region directly into page rows %d to %d",
+        width, height, y, y + height - 1);
+
+    return TRUE;
+}
+
+/* clear any padding bits the region decoder left at the end of each
+   row, which composing would have masked off */
+void
+jbig2_page_region_in_place_done(Jbig2Ctx *ctx, Jbig2Page *page, Jbig2Image *region)
+{
+    const uint8_t mask = 0xFF << ((8 - (region->width & 7)) & 7);
+    uint8_t *last = region->data + ((region->width - 1) >> 3);
+    int j;
+
+    if (mask == 0xFF)
+        return;
+    for (j = 0; j < region->height; j++, last += region->stride)
+        *last &= mask;
+}
+
 /**
  * jbig2_get_page: return the next available page image buffer
  *
@@ -293,6 +591,11 @@ Jbig2Image *jbig2_page_out(Jbig2Ctx *ctx)
     /* search for a completed page */
     for (index=0; index < ctx->max_page_index; index++) {
         if (ctx->pages[index].state == JBIG2_PAGE_COMPLETE) {
+            if (ctx->pages[index].image == NULL) {
+                /* its page info segment failed; there's nothing to return */
+                ctx->pages[index].state = JBIG2_PAGE_RELEASED;
+                continue;
+            }
             ctx->pages[index].state = JBIG2_PAGE_RETURNED;
             jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
                 "page %d returned to the client", ctx->pages[index].number);
@@ -311,11 +614,23 @@ int jbig2_release_page(Jbig2Ctx *ctx, Jbig2Image *image)
 {
     int index;
 
-    /* find the matching page struct and mark it released */
+    if (image == NULL)
+        return 1;
+
+    /* find the matching page struct, mark it released and drop
+       its image, keeping the buffer in the pool if requested */
     for (index = 0; index < ctx->max_page_index; index++) {
         if (ctx->pages[index].image == image) {
-            /* todo: free associated image */
             ctx->pages[index].state = JBIG2_PAGE_RELEASED;
+            if ((ctx->options & JBIG2_OPTIONS_PAGE_POOL) && image->refcount == 1 &&
+                    !ctx->pages[index].output_direct) {
+                ctx->pages[index].image = NULL;
+                if (ctx->page_pool != NULL)
+                    jbig2_image_release(ctx, ctx->page_pool);
+                ctx->page_pool = image;
+            } else {
+                jbig2_page_free_image(ctx, &ctx->pages[index]);
+            }
             jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
                 "page %d released by the client", ctx->pages[index].number);
             return 0;
@@ -327,3 +642,252 @@ int jbig2_release_page(Jbig2Ctx *ctx, Jbig2Image *image)
         "jbig2_release_page called on unknown page");
     return 1;
 }
+
+static int
+jbig2_page_index_compare(const void *a, const void *b)
+{
+    uint32_t pa = ((const Jbig2PageIndex *)a)->number;
+    uint32_t pb = ((const Jbig2PageIndex *)b)->number;
+
+    return (pa > pb) - (pa < pb);
+}
+
+static int
+jbig2_int_compare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static Jbig2PageIndex *
+jbig2_page_index_find(Jbig2Ctx *ctx, uint32_t page_number)
+{
+    Jbig2PageIndex key;
+
+    key.number = page_number;
+    return bsearch(&key, ctx->page_index, ctx->n_page_index,
+                   sizeof(Jbig2PageIndex), jbig2_page_index_compare);
+}
+
+/**
+ * jbig2_build_page_index: index the segments of a random-access file
+ *
+ * records where each segment body starts relative to the end of the
+ * headers, and for each page the list of segments that must be
+ * decoded to render it: the segments associated with the page plus
+ * everything they refer to, directly or through other segments.
+ **/
+static int
+jbig2_build_page_index(Jbig2Ctx *ctx)
+{
+    const int n = ctx->n_segments;
+    Jbig2PageIndex *index;
+    int n_index = 0;
+    int *mark = NULL, *list = NULL;
+    size_t offset = 0;
+    int i, j, k;
+
+    ctx->segment_offsets = jbig2_new(ctx, size_t, n);
+    ctx->segment_decoded = jbig2_new(ctx, byte, n);
+    /* one entry per page at most per segment; trimmed below */
+    index = jbig2_new(ctx, Jbig2PageIndex, n);
+    mark = jbig2_new(ctx, int, n);
+    list = jbig2_new(ctx, int, n);
+    if (ctx->segment_offsets == NULL || ctx->segment_decoded == NULL ||
+            index == NULL || mark == NULL || list == NULL) {
+        jbig2_free(ctx->allocator, index);
+        jbig2_free(ctx->allocator, mark);
+        jbig2_free(ctx->allocator, list);
+        return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+            "failed to allocate page index");
+    }
+
+    for (i = 0; i < n; i++) {
+        Jbig2Segment *segment = ctx->segments[i];
+
+        ctx->segment_offsets[i] = offset;
+        offset += segment->data_length;
+        ctx->segment_decoded[i] = FALSE;
+        mark[i] = -1;
+
+        /* collect the distinct page numbers */
+        if (segment->page_association != 0) {
+            for (j = 0; j < n_index; j++)
+                if (index[j].number == segment->page_association)
+                    break;
+            if (j == n_index) {
+                index[n_index].number = segment->page_association;
+                index[n_index].n_segments = 0;
+                index[n_index].segments = NULL;
+                n_index++;
+            }
+        }
+    }
+    qsort(index, n_index, sizeof(Jbig2PageIndex), jbig2_page_index_compare);
+    ctx->page_index = index;
+    ctx->n_page_index = n_index;
+
+    /* count each page's own segments */
+    for (i = 0; i < n; i++)
+        if (ctx->segments[i]->page_association != 0)
+            jbig2_page_index_find(ctx, ctx->segments[i]->page_association)->n_segments++;
+
+    for (k = 0; k < n_index; k++) {
+        Jbig2PageIndex *page = &index[k];
+        int n_list = 0;
+        int top;
+
+        for (i = 0; i < n && n_list < page->n_segments; i++)
+            if (ctx->segments[i]->page_association == page->number) {
+                mark[i] = k;
+                list[n_list++] = i;
+            }
+
+        /* walk the referred-to segments, using list as the work queue */
+        for (top = 0; top < n_list; top++) {
+            Jbig2Segment *segment = ctx->segments[list[top]];
+
+            for (j = 0; j < segment->referred_to_segment_count; j++) {
+                int r = jbig2_segment_lookup_index(ctx,
+                    segment->referred_to_segments[j], list[top]);
+                if (r >= 0 && mark[r] != k) {
+                    mark[r] = k;
+                    list[n_list++] = r;
+                }
+            }
+        }
+
+        qsort(list, n_list, sizeof(int), jbig2_int_compare);
+        page->segments = jbig2_new(ctx, int, n_list);
+        if (page->segments == NULL) {
+            jbig2_free(ctx->allocator, mark);
+            jbig2_free(ctx->allocator, list);
+            return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, -1,
+                "failed to allocate page index");
+        }
+        memcpy(page->segments, list, n_list * sizeof(int));
+        page->n_segments = n_list;
+        jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
+            "page %d needs %d segments", page->number, n_list);
+    }
+
+    jbig2_free(ctx->allocator, mark);
+    jbig2_free(ctx->allocator, list);
+
+    return 0;
+}
+
+/* throw away a page whose decoding was interrupted so another page
+   can be decoded: its image is freed and the segments which drew on
+   it are decoded again if it is asked for later. segments which keep
+   a result, like dictionaries, stay decoded */
+static void
+jbig2_page_rollback(Jbig2Ctx *ctx, uint32_t page_number)
+{
+    Jbig2PageIndex *page = jbig2_page_index_find(ctx, page_number);
+    int i;
+
+    for (i = 0; page != NULL && i < page->n_segments; i++) {
+        int index = page->segments[i];
+        if (ctx->segments[index]->page_association == page_number &&
+                ctx->segments[index]->result == NULL)
+            ctx->segment_decoded[index] = FALSE;
+    }
+    for (i = 0; i < ctx->max_page_index; i++) {
+        if (ctx->pages[i].number == page_number &&
+                ctx->pages[i].state == JBIG2_PAGE_NEW) {
+            if (ctx->pages[i].image != NULL)
+                jbig2_page_free_image(ctx, &ctx->pages[i]);
+            ctx->pages[i].state = JBIG2_PAGE_FREE;
+            ctx->pages[i].number = 0;
+        }
+    }
+    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
+        "discarded partly decoded page %d", page_number);
+}
+
+/**
+ * jbig2_decode_page: decode a single page of a random-access file
+ *
+ * decodes the segments the given page depends on which haven't
+ * already been decoded for an earlier request, in stream order.
+ * Global segments such as shared symbol dictionaries are thus
+ * decoded once and reused. The page can then be retrieved with
+ * jbig2_page_out(). If the abort callback interrupts decoding,
+ * JBIG2_INTERRUPTED is returned and calling this again for the
+ * same page carries on from the segment it stopped in, which is
+ * then decoded to the end whatever the callback says. Asking for
+ * another page instead discards the partly decoded one.
+ **/
+int
+jbig2_decode_page(Jbig2Ctx *ctx, uint32_t page_number)
+{
+    Jbig2PageIndex *page;
+    int saved_index = ctx->segment_index;
+    int code = 0;
+    int i;
+
+    ctx->interrupted = FALSE;
+    if (!(ctx->options & JBIG2_OPTIONS_RANDOM_ACCESS) ||
+            ctx->state != JBIG2_FILE_RANDOM_BODIES) {
+        jbig2_error(ctx, JBIG2_SEVERITY_WARNING, -1,
+            "jbig2_decode_page requires the headers of a random-access"
+            " file opened with JBIG2_OPTIONS_RANDOM_ACCESS");
+        return -1;
+    }
+
+    if (ctx->page_index == NULL) {
+        code = jbig2_build_page_index(ctx);
+        if (code < 0)
+            return code;
+    }
+
+    page = jbig2_page_index_find(ctx, page_number);
+    if (page == NULL) {
+        jbig2_error(ctx, JBIG2_SEVERITY_WARNING, -1,
+            "jbig2_decode_page called for unknown page %d", page_number);
+        return -1;
+    }
+
+    /* make sure we have all the data before changing any state */
+    for (i = 0; i < page->n_segments; i++) {
+        int index = page->segments[i];
+        if (ctx->buf_rd_ix + ctx->segment_offsets[index] +
+                ctx->segments[index]->data_length > ctx->buf_wr_ix) {
+            jbig2_error(ctx, JBIG2_SEVERITY_WARNING, -1,
+                "not enough data to decode page %d", page_number);
+            return -1;
+        }
+    }
+
+    if (ctx->partial_page != 0 && ctx->partial_page != page_number)
+        jbig2_page_rollback(ctx, ctx->partial_page);
+    ctx->partial_page = 0;
+
+    for (i = 0; i < page->n_segments; i++) {
+        int index = page->segments[i];
+        Jbig2Segment *segment = ctx->segments[index];
+
+        if (ctx->segment_decoded[index])
+            continue;
+        ctx->segment_decoded[index] = TRUE;
+
+        /* only earlier segments are visible to jbig2_find_segment(),
+           just as in sequential decoding */
+        ctx->segment_index = index;
+        code = jbig2_parse_segment_polled(ctx, segment,
+            ctx->buf + ctx->buf_rd_ix + ctx->segment_offsets[index]);
+        if (ctx->interrupted) {
+            /* decoded again by the next call for the page */
+            ctx->segment_decoded[index] = FALSE;
+            code = JBIG2_INTERRUPTED;
+            break;
+        }
+        if (code < 0)
+            break;
+    }
+    if (code == JBIG2_INTERRUPTED)
+        ctx->partial_page = page_number;
+    ctx->segment_index = saved_index;
+
+    return code;
+}
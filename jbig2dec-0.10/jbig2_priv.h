@@ -38,12 +38,57 @@ typedef enum {
   JBIG2_FILE_EOF
 } Jbig2FileState;
 
+/* an arena allocator: memory is handed out from large blocks obtained
+   from the parent allocator and is only returned, all at once, by
+   jbig2_arena_free(). the first member makes an arena usable wherever
+   a Jbig2Allocator is expected; freeing through it does nothing. */
+typedef struct _Jbig2ArenaBlock Jbig2ArenaBlock;
+typedef struct _Jbig2Arena Jbig2Arena;
+
+struct _Jbig2Arena {
+  Jbig2Allocator allocator;
+  Jbig2Allocator *parent;
+  Jbig2ArenaBlock *blocks;	/* the current block first */
+  Jbig2Arena *next;
+};
+
+/* an entry in the segment number lookup index. entries are kept
+   sorted by segment number so jbig2_find_segment() can do a binary
+   search instead of walking the whole segment list. */
+typedef struct {
+  uint32_t number;
+  int index;	/* position in the ctx->segments array */
+} Jbig2SegmentLookup;
+
+/* the segments needed to decode one page of a random-access file,
+   including any global segments it refers to directly or indirectly */
+typedef struct {
+  uint32_t number;
+  int n_segments;
+  int *segments;	/* indices into ctx->segments, in stream order */
+} Jbig2PageIndex;
+
+/* the allocator a context makes its allocations through. it keeps
+   the size of each one in a header, so that it can count the bytes
+   in use and hold them to a limit, and passes the requests on to the
+   client's allocator */
+typedef struct {
+  Jbig2Allocator allocator;
+  Jbig2Allocator *parent;
+  Jbig2Ctx *ctx;
+  size_t used;
+  size_t peak;
+  size_t limit;	/* 0 for none */
+} Jbig2Accounting;
+
 struct _Jbig2Ctx {
   Jbig2Allocator *allocator;
+  Jbig2Accounting accounting;
   Jbig2Options options;
   const Jbig2Ctx *global_ctx;
   Jbig2ErrorCallback error_callback;
   void *error_callback_data;
+  Jbig2Severity min_severity;	/* messages below this are dropped */
 
   byte *buf;
   size_t buf_size;
@@ -51,6 +96,7 @@ struct _Jbig2Ctx {
   unsigned int buf_wr_ix;
 
   Jbig2FileState state;
+  bool frozen;	/* read-only global context, see jbig2_make_global_ctx() */
 
   uint8_t file_header_flags;
   int32_t n_pages;
@@ -59,12 +105,37 @@ struct _Jbig2Ctx {
   Jbig2Segment **segments;
   int n_segments;	/* index of last segment header parsed */
   int segment_index;    /* index of last segment body parsed */
+  Jbig2SegmentLookup *segment_lookup; /* sorted by number, n_segments long */
 
   /* list of decoded pages, including the one in progress,
      currently stored as a contiguous, 0-indexed array. */
   int current_page;
   int max_page_index;
   Jbig2Page *pages;
+  Jbig2Image *page_pool;	/* last released page image, for reuse */
+  Jbig2StripeCallback stripe_callback;
+  void *stripe_callback_data;
+  Jbig2PageOutputCallback output_callback;
+  void *output_callback_data;
+  Jbig2SegmentCallback segment_callback;
+  void *segment_callback_data;
+  Jbig2AbortCallback abort_callback;
+  void *abort_callback_data;
+  bool interrupted;	/* the abort callback asked to stop */
+  Jbig2Segment *restarted;	/* segment an interrupt stopped at, or NULL */
+  size_t coded_bytes;	/* read by the decoders from the current segment */
+
+  /* arenas holding decoded symbol dictionaries, with
+     JBIG2_OPTIONS_ARENA. freed after all the segments */
+  Jbig2Arena *arenas;
+
+  /* index for decoding individual pages of a random-access file,
+     built on the first call to jbig2_decode_page() */
+  int n_page_index;
+  Jbig2PageIndex *page_index;
+  size_t *segment_offsets;	/* body offsets relative to buf_rd_ix */
+  byte *segment_decoded;
+  uint32_t partial_page;	/* page left half decoded by an interrupt, or 0 */
 };
 
 int32_t
@@ -83,6 +154,12 @@ jbig2_free (Jbig2Allocator *allocator, void *p);
 void *
 jbig2_realloc (Jbig2Allocator *allocator, void *p, size_t size);
 
+Jbig2Arena *
+jbig2_arena_new (Jbig2Allocator *parent);
+
+void
+jbig2_arena_free (Jbig2Arena *arena);
+
 #define jbig2_new(ctx, t, size) ((t *)jbig2_alloc(ctx->allocator, (size) * sizeof(t)))
 
 #define jbig2_renew(ctx, p, t, size) ((t *)jbig2_realloc(ctx->allocator, (p), (size) * sizeof(t)))
@@ -91,6 +168,26 @@ int
 jbig2_error (Jbig2Ctx *ctx, Jbig2Severity severity, int32_t seg_idx,
 	     const char *fmt, ...);
 
+/* poll the abort callback. Once it has asked to stop, this keeps
+   returning TRUE and the decoders give up on the current segment,
+   which is decoded again from the start when decoding resumes. */
+bool
+jbig2_interrupted (Jbig2Ctx *ctx);
+
+/* decode a segment body after polling the abort callback. The
+   segment an interrupt stopped at, before or inside its body, is
+   decoded to the end the next time without polling, so every call
+   resuming decoding makes progress. Callers check ctx->interrupted
+   rather than the return code. */
+int
+jbig2_parse_segment_polled (Jbig2Ctx *ctx, Jbig2Segment *segment,
+			    const uint8_t *segment_data);
+
+/* the region decoders poll once every JBIG2_POLL_ROWS rows */
+#define JBIG2_POLL_ROWS 64
+#define jbig2_poll_rows(ctx, y) \
+  (((y) & (JBIG2_POLL_ROWS - 1)) == JBIG2_POLL_ROWS - 1 && jbig2_interrupted(ctx))
+
 /* the page structure handles decoded page
    results. it's allocated by a 'page info'
    segement and marked complete by an 'end of page'
@@ -115,8 +212,18 @@ struct _Jbig2Page {
     int end_row;
     uint8_t flags;
     Jbig2Image *image;
+    int capacity;	/* rows allocated for the image, at least its height */
+    int dirty_rows;	/* rows at the top which regions may have written */
+    int rows_out;	/* rows already passed to the stripe callback */
+    int rows_converted;	/* rows already written to the output buffer */
+    Jbig2PageOutput output;	/* client buffer, or output.data is NULL */
+    bool output_direct;	/* image->data is output.data */
 };
 
+void jbig2_segment_lookup_add(Jbig2Ctx *ctx, int index);
+void jbig2_freeze_segment(Jbig2Ctx *ctx, Jbig2Segment *segment, bool frozen);
+int jbig2_segment_lookup_index(const Jbig2Ctx *ctx, uint32_t number, int limit);
+
 int jbig2_parse_page_info (Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segment_data);
 int jbig2_parse_end_of_stripe(Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segment_data);
 int jbig2_parse_end_of_page(Jbig2Ctx *ctx, Jbig2Segment *segment, const uint8_t *segment_data);
@@ -131,7 +238,12 @@ typedef enum {
 } Jbig2ComposeOp;
 
 int jbig2_image_compose(Jbig2Ctx *ctx, Jbig2Image *dst, Jbig2Image *src, int x, int y, Jbig2ComposeOp op);
+void jbig2_image_compose_aligned(Jbig2Image *dst, Jbig2Image *src, int x, int y, Jbig2ComposeOp op);
+void jbig2_image_output_rows(Jbig2Image *image, int first_row, int n_rows, const Jbig2PageOutput *output);
 int jbig2_page_add_result(Jbig2Ctx *ctx, Jbig2Page *page, Jbig2Image *src, int x, int y, Jbig2ComposeOp op);
+void jbig2_page_free_image(Jbig2Ctx *ctx, Jbig2Page *page);
+bool jbig2_page_region_in_place(Jbig2Ctx *ctx, Jbig2Page *page, Jbig2Image *region, int x, int y, int width, int height, Jbig2ComposeOp op);
+void jbig2_page_region_in_place_done(Jbig2Ctx *ctx, Jbig2Page *page, Jbig2Image *region);
 
 /* region segment info */
 
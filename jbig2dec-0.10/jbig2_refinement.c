@@ -66,6 +66,8 @@ jbig2_decode_refinement_template0_unopt(Jbig2Ctx *ctx,
   bool bit;
 
   for (y = 0; y < GRH; y++) {
+    if (jbig2_poll_rows(ctx, y))
+      return -1;
     for (x = 0; x < GRW; x++) {
       CONTEXT = 0;
       CONTEXT |= jbig2_image_get_pixel(image, x - 1, y + 0) << 0;
@@ -121,6 +123,8 @@ jbig2_decode_refinement_template1_unopt(Jbig2Ctx *ctx,
   bool bit;
 
   for (y = 0; y < GRH; y++) {
+    if (jbig2_poll_rows(ctx, y))
+      return -1;
     for (x = 0; x < GRW; x++) {
       CONTEXT = 0;
       CONTEXT |= jbig2_image_get_pixel(image, x - 1, y + 0) << 0;
@@ -178,6 +182,9 @@ jbig2_decode_refinement_template1(Jbig2Ctx *ctx,
     uint32_t refline_1;  /* next line of the reference bitmap */
     uint32_t line_m1;    /* previous line of the decoded bitmap */
 
+    if (jbig2_poll_rows(ctx, y))
+      return -1;
+
     line_m1 = (y >= 1) ? grreg_line[-stride] : 0;
     refline_m1 = ((y-dy) >= 1) ? grref_line[(-1-dy)*stride] << 2: 0;
     refline_0  = (((y-dy) > 0) && ((y-dy) < GRH)) ? grref_line[(0-dy)*stride] << 4 : 0;
@@ -324,6 +331,7 @@ jbig2_refinement_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
   Jbig2RegionSegmentInfo rsi;
   int offset = 0;
   byte seg_flags;
+  Jbig2Segment *ref = NULL;
 
   /* 7.4.7 */
   if (segment->data_length < 18)
@@ -366,8 +374,6 @@ jbig2_refinement_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 
   /* 7.4.7.4 - set up the reference image */
   if (segment->referred_to_segment_count) {
-    Jbig2Segment *ref;
-
     ref = jbig2_region_find_referred(ctx, segment);
     if (ref == NULL)
       return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
@@ -384,6 +390,9 @@ jbig2_refinement_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
       "found reference bitmap in segment %d", ref->number);
   } else {
     /* the reference is just (a subset of) the page buffer */
+    if (ctx->pages[ctx->current_page].image == NULL)
+      return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+        "no page image to refine");
     params.reference = jbig2_image_clone(ctx,
       ctx->pages[ctx->current_page].image);
     /* TODO: subset the image if appropriate */
@@ -401,27 +410,45 @@ jbig2_refinement_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
     int code;
 
     image = jbig2_image_new(ctx, rsi.width, rsi.height);
-    if (image == NULL)
+    if (image == NULL) {
+      jbig2_image_release(ctx, params.reference);
       return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
                "unable to allocate image storage");
+    }
     jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
       "allocated %d x %d image buffer for region decode results",
           rsi.width, rsi.height);
 
     stats_size = params.GRTEMPLATE ? 1 << 10 : 1 << 13;
     GR_stats = jbig2_alloc(ctx->allocator, stats_size);
-    memset(GR_stats, 0, stats_size);
-
     ws = jbig2_word_stream_buf_new(ctx, segment_data + offset,
            segment->data_length - offset);
     as = jbig2_arith_new(ctx, ws);
-    code = jbig2_decode_refinement_region(ctx, segment, &params,
-                              as, image, GR_stats);
+    if (GR_stats == NULL || as == NULL)
+      code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+        "failed to allocate refinement region decoding state");
+    else {
+      memset(GR_stats, 0, stats_size);
+      code = jbig2_decode_refinement_region(ctx, segment, &params,
+                                as, image, GR_stats);
+    }
 
     jbig2_free(ctx->allocator, as);
     jbig2_word_stream_buf_free(ctx, ws);
     jbig2_free(ctx->allocator, GR_stats);
 
+    if (ctx->interrupted) {
+      /* decoded again when decoding resumes, which needs the
+         intermediate region back */
+      jbig2_image_release(ctx, image);
+      if (ref != NULL)
+        ref->result = params.reference;
+      else
+        jbig2_image_release(ctx, params.reference);
+      return code;
+    }
+    jbig2_image_release(ctx, params.reference);
+
     if ((segment->flags & 63) == 40) {
         /* intermediate region. save the result for later */
 	segment->result = image;
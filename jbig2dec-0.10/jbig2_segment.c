@@ -22,6 +22,8 @@
 
 #include "jbig2.h"
 #include "jbig2_priv.h"
+#include "jbig2_arith.h"
+#include "jbig2_huffman.h"
 #include "jbig2_symbol_dict.h"
 #include "jbig2_metadata.h"
 
@@ -30,6 +32,8 @@ jbig2_parse_segment_header (Jbig2Ctx *ctx, uint8_t *buf, size_t buf_size,
 			    size_t *p_header_size)
 {
   Jbig2Segment *result;
+  uint32_t number;
+  uint8_t flags;
   uint8_t rtscarf;
   uint32_t rtscarf_long;
   uint32_t *referred_to_segments;
@@ -39,17 +43,15 @@ jbig2_parse_segment_header (Jbig2Ctx *ctx, uint8_t *buf, size_t buf_size,
   int offset;
 
   /* minimum possible size of a jbig2 segment header */
+  *p_header_size = 0;
   if (buf_size < 11)
     return NULL;
 
-  result = (Jbig2Segment *)jbig2_alloc(ctx->allocator,
-					     sizeof(Jbig2Segment));
-
   /* 7.2.2 */
-  result->number = jbig2_get_int32(buf);
+  number = jbig2_get_int32(buf);
 
   /* 7.2.3 */
-  result->flags = buf[4];
+  flags = buf[4];
 
   /* 7.2.4 referred-to segments */
   rtscarf = buf[5];
@@ -64,26 +66,44 @@ jbig2_parse_segment_header (Jbig2Ctx *ctx, uint8_t *buf, size_t buf_size,
       referred_to_segment_count = (rtscarf >> 5);
       offset = 5 + 1;
     }
-  result->referred_to_segment_count = referred_to_segment_count;
 
   /* we now have enough information to compute the full header length */
-  referred_to_segment_size = result->number <= 256 ? 1:
-        result->number <= 65536 ? 2 : 4;  /* 7.2.5 */
-  pa_size = result->flags & 0x40 ? 4 : 1; /* 7.2.6 */
-  if (offset + referred_to_segment_count*referred_to_segment_size + pa_size + 4 > buf_size)
+  referred_to_segment_size = number <= 256 ? 1:
+        number <= 65536 ? 2 : 4;  /* 7.2.5 */
+  pa_size = flags & 0x40 ? 4 : 1; /* 7.2.6 */
+  if (offset + (size_t)referred_to_segment_count*referred_to_segment_size + pa_size + 4 > buf_size)
     {
-      jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, result->number,
+      jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, number,
         "jbig2_parse_segment_header() called with insufficient data", -1);
-      jbig2_free (ctx->allocator, result);
       return NULL;
     }
 
+  /* the whole header is there, so failing from here on is an error
+     rather than a need for more data */
+  *p_header_size = offset + referred_to_segment_count*referred_to_segment_size + pa_size + 4;
+  result = (Jbig2Segment *)jbig2_alloc(ctx->allocator,
+					     sizeof(Jbig2Segment));
+  if (result == NULL) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, number,
+      "failed to allocate segment header");
+    return NULL;
+  }
+  result->number = number;
+  result->flags = flags;
+  result->referred_to_segment_count = referred_to_segment_count;
+
   /* 7.2.5 */
   if (referred_to_segment_count)
     {
       int i;
 
       referred_to_segments = jbig2_alloc(ctx->allocator, referred_to_segment_count * referred_to_segment_size * sizeof(uint32_t));
+      if (referred_to_segments == NULL) {
+        jbig2_error(ctx, JBIG2_SEVERITY_FATAL, result->number,
+          "failed to allocate referred to segment list");
+        jbig2_free(ctx->allocator, result);
+        return NULL;
+      }
 
       for (i = 0; i < referred_to_segment_count; i++) {
         referred_to_segments[i] =
@@ -134,13 +154,23 @@ jbig2_free_segment (Jbig2Ctx *ctx, Jbig2Segment *segment)
      brittle special casing */
     switch (segment->flags & 63) {
 	case 0:  /* symbol dictionary */
-	  jbig2_sd_release(ctx, segment->result);
+	  if (ctx->options & JBIG2_OPTIONS_ARENA) {
+	    /* the dictionary lives in an arena; just drop its references */
+	    Jbig2Allocator *allocator = ctx->allocator;
+	    ctx->allocator = &ctx->arenas->allocator;
+	    jbig2_sd_release(ctx, segment->result);
+	    ctx->allocator = allocator;
+	  } else
+	    jbig2_sd_release(ctx, segment->result);
 	  break;
 	case 4:  /* intermediate text region */
 	case 40: /* intermediate refinement region */
 	  if (segment->result != NULL)
 	    jbig2_image_release(ctx, segment->result);
 	  break;
+	case 53: /* code table */
+	  jbig2_table_free(ctx, segment->result);
+	  break;
 	case 62:
 	  jbig2_metadata_free(ctx, segment->result);
 	  break;
@@ -151,25 +181,138 @@ jbig2_free_segment (Jbig2Ctx *ctx, Jbig2Segment *segment)
   jbig2_free (ctx->allocator, segment);
 }
 
+static void
+jbig2_freeze_image (Jbig2Image *image, bool frozen)
+{
+  /* images may be shared between segments, so this must be idempotent */
+  if (image != NULL && (image->refcount < 0) != frozen)
+    image->refcount = -image->refcount;
+}
+
+/* mark the images in a segment's result as frozen, or thaw them again.
+   frozen images are shared by reference without touching their
+   reference count; see jbig2_image_clone() */
+void
+jbig2_freeze_segment (Jbig2Ctx *ctx, Jbig2Segment *segment, bool frozen)
+{
+  int i;
+
+  if (segment->result == NULL)
+    return;
+  switch (segment->flags & 63) {
+    case 0:  /* symbol dictionary */
+      {
+        Jbig2SymbolDict *dict = (Jbig2SymbolDict *)segment->result;
+        for (i = 0; i < dict->n_symbols; i++)
+          jbig2_freeze_image(dict->glyphs[i], frozen);
+      }
+      break;
+    case 4:  /* intermediate text region */
+    case 40: /* intermediate refinement region */
+      jbig2_freeze_image((Jbig2Image *)segment->result, frozen);
+      break;
+    default:
+      break;
+  }
+}
+
+/* decode a symbol dictionary with all its allocations, including the
+   glyphs and the decoding state, made from a new arena. the arena is
+   freed along with the context */
+static int
+jbig2_symbol_dictionary_arena (Jbig2Ctx *ctx, Jbig2Segment *segment,
+                               const uint8_t *segment_data)
+{
+  Jbig2Allocator *allocator = ctx->allocator;
+  Jbig2Arena *arena = jbig2_arena_new(allocator);
+  int code;
+
+  if (arena == NULL)
+    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+      "could not allocate arena for symbol dictionary");
+  arena->next = ctx->arenas;
+  ctx->arenas = arena;
+
+  ctx->allocator = &arena->allocator;
+  code = jbig2_symbol_dictionary(ctx, segment, segment_data);
+  ctx->allocator = allocator;
+
+  /* nothing decoded into the arena is kept */
+  if (ctx->interrupted) {
+    ctx->arenas = arena->next;
+    jbig2_arena_free(arena);
+  }
+
+  return code;
+}
+
+/* add the segment header at @index in ctx->segments to the number
+   lookup index. Segments nearly always arrive in increasing number
+   order, so this is normally an append; out of order numbers are
+   inserted after any existing entries with the same number so that
+   those are ordered by their position in the stream. */
+void
+jbig2_segment_lookup_add(Jbig2Ctx *ctx, int index)
+{
+    Jbig2SegmentLookup *lookup = ctx->segment_lookup;
+    uint32_t number = ctx->segments[index]->number;
+    int i = ctx->n_segments - 1;
+
+    while (i > 0 && lookup[i - 1].number > number) {
+        lookup[i] = lookup[i - 1];
+        i--;
+    }
+    lookup[i].number = number;
+    lookup[i].index = index;
+}
+
+/* binary search a context's lookup index for a segment that precedes
+   position @limit in ctx->segments, returning its position or -1.
+   When a number is repeated the latest such segment wins, as with
+   the old linear scan. */
+int
+jbig2_segment_lookup_index(const Jbig2Ctx *ctx, uint32_t number, int limit)
+{
+    const Jbig2SegmentLookup *lookup = ctx->segment_lookup;
+    int lo = 0, hi = ctx->n_segments;
+
+    /* find the first entry with a greater segment number */
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (lookup[mid].number <= number)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (lo--; lo >= 0 && lookup[lo].number == number; lo--)
+        if (lookup[lo].index < limit)
+            return lookup[lo].index;
+
+    return -1;
+}
+
+/* find a segment whose body has already been parsed */
+static Jbig2Segment *
+jbig2_segment_lookup_find(const Jbig2Ctx *ctx, uint32_t number)
+{
+    int index = jbig2_segment_lookup_index(ctx, number, ctx->segment_index);
+
+    return index < 0 ? NULL : ctx->segments[index];
+}
+
 /* find a segment by number */
 Jbig2Segment *
 jbig2_find_segment(Jbig2Ctx *ctx, uint32_t number)
 {
-    int index, index_max = ctx->segment_index - 1;
     const Jbig2Ctx *global_ctx = ctx->global_ctx;
+    Jbig2Segment *segment;
 
-    /* FIXME: binary search would be better */
-    for (index = index_max; index >= 0; index--)
-        if (ctx->segments[index]->number == number)
-            return (ctx->segments[index]);
+    segment = jbig2_segment_lookup_find(ctx, number);
+    if (segment == NULL && global_ctx)
+        segment = jbig2_segment_lookup_find(global_ctx, number);
 
-    if (global_ctx)
-	for (index = global_ctx->segment_index - 1; index >= 0; index--)
-	    if (global_ctx->segments[index]->number == number)
-		return (global_ctx->segments[index]);
-
-    /* didn't find a match */
-    return NULL;
+    return segment;
 }
 
 /* parse the generic portion of a region segment data header */
@@ -220,17 +363,16 @@ int jbig2_parse_extension_segment(Jbig2Ctx *ctx, Jbig2Segment *segment,
     return 0;
 }
 
-/* general segment parsing dispatch */
-int jbig2_parse_segment (Jbig2Ctx *ctx, Jbig2Segment *segment,
-			 const uint8_t *segment_data)
+/* decode a segment body according to its type */
+static int
+jbig2_decode_segment (Jbig2Ctx *ctx, Jbig2Segment *segment,
+		      const uint8_t *segment_data)
 {
-  jbig2_error(ctx, JBIG2_SEVERITY_INFO, segment->number,
-	      "Segment %d, flags=%x, type=%d, data_length=%d",
-	      segment->number, segment->flags, segment->flags & 63,
-	      segment->data_length);
   switch (segment->flags & 63)
     {
     case 0:
+      if (ctx->options & JBIG2_OPTIONS_ARENA)
+        return jbig2_symbol_dictionary_arena(ctx, segment, segment_data);
       return jbig2_symbol_dictionary(ctx, segment, segment_data);
     case 4: /* intermediate text region */
     case 6: /* immediate text region */
@@ -281,8 +423,7 @@ int jbig2_parse_segment (Jbig2Ctx *ctx, Jbig2Segment *segment,
       return jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
         "unhandled segment type 'profile'");
     case 53:
-      return jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
-        "unhandled table segment");
+      return jbig2_table(ctx, segment, segment_data);
     case 62:
       return jbig2_parse_extension_segment(ctx, segment, segment_data);
     default:
@@ -291,3 +432,34 @@ int jbig2_parse_segment (Jbig2Ctx *ctx, Jbig2Segment *segment,
     }
   return 0;
 }
+
+/* general segment parsing dispatch */
+int jbig2_parse_segment (Jbig2Ctx *ctx, Jbig2Segment *segment,
+			 const uint8_t *segment_data)
+{
+  int code;
+
+  jbig2_error(ctx, JBIG2_SEVERITY_INFO, segment->number,
+	      "Segment %d, flags=%x, type=%d, data_length=%d",
+	      segment->number, segment->flags, segment->flags & 63,
+	      segment->data_length);
+  if (ctx->segment_callback == NULL)
+    return jbig2_decode_segment(ctx, segment, segment_data);
+
+  ctx->coded_bytes = 0;
+  ctx->segment_callback(ctx->segment_callback_data, segment, segment_data,
+			FALSE, 0, 0);
+  code = jbig2_decode_segment(ctx, segment, segment_data);
+  ctx->segment_callback(ctx->segment_callback_data, segment, segment_data,
+			TRUE, code, ctx->coded_bytes);
+  return code;
+}
+
+/* report each segment decoded to the client */
+void
+jbig2_set_segment_callback (Jbig2Ctx *ctx, Jbig2SegmentCallback callback,
+			    void *data)
+{
+  ctx->segment_callback = callback;
+  ctx->segment_callback_data = data;
+}
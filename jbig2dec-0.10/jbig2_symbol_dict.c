@@ -97,6 +97,10 @@ jbig2_sd_new(Jbig2Ctx *ctx, int n_symbols)
      new->glyphs = (Jbig2Image **)jbig2_alloc(ctx->allocator,
      				n_symbols*sizeof(Jbig2Image*));
      new->n_symbols = n_symbols;
+     new->GB_stats = NULL;
+     new->GR_stats = NULL;
+     new->GB_stats_size = 0;
+     new->GR_stats_size = 0;
    } else {
      return NULL;
    }
@@ -121,6 +125,8 @@ jbig2_sd_release(Jbig2Ctx *ctx, Jbig2SymbolDict *dict)
    for (i = 0; i < dict->n_symbols; i++)
      if (dict->glyphs[i]) jbig2_image_release(ctx, dict->glyphs[i]);
    jbig2_free(ctx->allocator, dict->glyphs);
+   jbig2_free(ctx->allocator, dict->GB_stats);
+   jbig2_free(ctx->allocator, dict->GR_stats);
    jbig2_free(ctx->allocator, dict);
 }
 
@@ -159,6 +165,11 @@ jbig2_sd_list_referred(Jbig2Ctx *ctx, Jbig2Segment *segment)
     int dindex = 0;
 
     dicts = jbig2_alloc(ctx->allocator, sizeof(Jbig2SymbolDict *) * n_dicts);
+    if (dicts == NULL) {
+        jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+            "could not allocate referred symbol dictionary list");
+        return NULL;
+    }
     for (index = 0; index < segment->referred_to_segment_count; index++) {
         rsegment = jbig2_find_segment(ctx, segment->referred_to_segments[index]);
         if (rsegment && ((rsegment->flags & 63) == 0)) {
@@ -214,8 +225,8 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 			 Jbig2ArithCx *GB_stats,
 			 Jbig2ArithCx *GR_stats)
 {
-  Jbig2SymbolDict *SDNEWSYMS;
-  Jbig2SymbolDict *SDEXSYMS;
+  Jbig2SymbolDict *SDNEWSYMS = NULL;
+  Jbig2SymbolDict *SDEXSYMS = NULL;
   int32_t HCHEIGHT;
   uint32_t NSYMSDECODED;
   int32_t SYMWIDTH, TOTWIDTH;
@@ -234,7 +245,7 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
   Jbig2ArithIntCtx *IARDX = NULL;
   Jbig2ArithIntCtx *IARDY = NULL;
   int code = 0;
-  Jbig2SymbolDict **refagg_dicts;
+  Jbig2SymbolDict **refagg_dicts = NULL;
   int n_refagg_dicts = 1;
 
   Jbig2TextRegionParams *tparams = NULL;
@@ -270,17 +281,29 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	  if (SDNEWSYMWIDTHS == NULL) {
 	    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"could not allocate storage for symbol widths");
-	    return NULL;
+	    goto cleanup;
 	  }
       }
   }
 
   SDNEWSYMS = jbig2_sd_new(ctx, params->SDNUMNEWSYMS);
+  if (ws == NULL || SDNEWSYMS == NULL ||
+      (params->SDHUFF ? hs == NULL || SDHUFFRDX == NULL :
+       as == NULL || IADH == NULL || IADW == NULL ||
+       IAEX == NULL || IAAI == NULL ||
+       (params->SDREFAGG && (IAID == NULL || IARDX == NULL || IARDY == NULL)))) {
+      jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	"could not allocate symbol dictionary decoder state");
+      goto cleanup;
+  }
 
   /* 6.5.5 (4a) */
   while (NSYMSDECODED < params->SDNUMNEWSYMS) {
       int32_t HCDH, DW;
 
+      if (jbig2_interrupted(ctx))
+	goto cleanup;
+
       /* 6.5.6 */
       if (params->SDHUFF) {
 	  HCDH = jbig2_huffman_get(hs, params->SDHUFFDH, &code);
@@ -288,6 +311,11 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	  code = jbig2_arith_int_decode(IADH, as, &HCDH);
       }
 
+      if (code < 0) {
+	code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	  "error decoding height class delta");
+	goto cleanup;
+      }
       if (code != 0) {
 	jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
 	  "error or OOB decoding height class delta (%d)\n", code);
@@ -300,10 +328,9 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
       HCFIRSTSYM = NSYMSDECODED;
 
       if (HCHEIGHT < 0) {
-	  /* todo: mem cleanup */
 	  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 			   "Invalid HCHEIGHT value");
-          return NULL;
+          goto cleanup;
       }
 #ifdef JBIG2_DEBUG
       jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
@@ -328,6 +355,12 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	      code = jbig2_arith_int_decode(IADW, as, &DW);
 	  }
 
+	  if (code < 0) {
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	      "error decoding symbol width delta");
+	    goto cleanup;
+	  }
+
 	  /* 6.5.5 (4c.i) */
 	  if (code == 1) {
 	    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
@@ -337,10 +370,9 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	  SYMWIDTH = SYMWIDTH + DW;
 	  TOTWIDTH = TOTWIDTH + SYMWIDTH;
 	  if (SYMWIDTH < 0) {
-	      /* todo: mem cleanup */
               code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
                 "Invalid SYMWIDTH value (%d) at symbol %d", SYMWIDTH, NSYMSDECODED+1);
-              return NULL;
+              goto cleanup;
           }
 #ifdef JBIG2_DEBUG
 	  jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
@@ -367,6 +399,11 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 		  memcpy(region_params.gbat, params->sdat, sdat_bytes);
 
 		  image = jbig2_image_new(ctx, SYMWIDTH, HCHEIGHT);
+		  if (image == NULL) {
+		      jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			"could not allocate symbol image");
+		      goto cleanup;
+		  }
 
 		  code = jbig2_decode_generic_region(ctx, segment, &region_params,
 						     as, image, GB_stats);
@@ -386,11 +423,13 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 		  if (code || (int32_t)REFAGGNINST <= 0) {
 		      code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 			"invalid number of symbols or OOB in aggregate glyph");
-		      return NULL;
+		      goto cleanup;
 		  }
 
+#ifdef JBIG2_DEBUG
 		  jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
 		    "aggregate symbol coding (%d instances)", REFAGGNINST);
+#endif
 
 		  if (REFAGGNINST > 1) {
 		      Jbig2Image *image;
@@ -405,14 +444,14 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 		          if (refagg_dicts == NULL) {
 			      code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 			       "Out of memory allocating dictionary array");
-		              return NULL;
+		              goto cleanup;
 		          }
 		          refagg_dicts[0] = jbig2_sd_new(ctx, params->SDNUMINSYMS + params->SDNUMNEWSYMS);
 		          if (refagg_dicts[0] == NULL) {
 			      code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 			       "Out of memory allocating symbol dictionary");
 		              jbig2_free(ctx->allocator, refagg_dicts);
-		              return NULL;
+		              goto cleanup;
 		          }
 		          refagg_dicts[0]->n_symbols = params->SDNUMINSYMS + params->SDNUMNEWSYMS;
 		          for (i=0;i < params->SDNUMINSYMS;i++)
@@ -426,7 +465,7 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 			      "Out of memory creating text region params");
 			      jbig2_sd_release(ctx, refagg_dicts[0]);
 			      jbig2_free(ctx->allocator, refagg_dicts);
-			      return NULL;
+			      goto cleanup;
 			  }
     		          if (!params->SDHUFF) {
 			      /* Values from Table 17, section 6.5.8.2 (2) */
@@ -443,6 +482,15 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 			      tparams->IARDH = jbig2_arith_int_ctx_new(ctx);
 			      tparams->IARDX = jbig2_arith_int_ctx_new(ctx);
 			      tparams->IARDY = jbig2_arith_int_ctx_new(ctx);
+			      if (tparams->IADT == NULL || tparams->IAFS == NULL ||
+				  tparams->IADS == NULL || tparams->IAIT == NULL ||
+				  tparams->IAID == NULL || tparams->IARI == NULL ||
+				  tparams->IARDW == NULL || tparams->IARDH == NULL ||
+				  tparams->IARDX == NULL || tparams->IARDY == NULL) {
+				  jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+				    "Out of memory creating aggregate symbol contexts");
+				  goto cleanup;
+			      }
 			  } else {
 			      tparams->SBHUFFFS = jbig2_build_huffman_table(ctx,
 				&jbig2_huffman_params_F);   /* Table B.6 */
@@ -458,6 +506,14 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 				&jbig2_huffman_params_O); /* Table B.15 */
 			      tparams->SBHUFFRDY = jbig2_build_huffman_table(ctx,
 				&jbig2_huffman_params_O); /* Table B.15 */
+			      if (tparams->SBHUFFFS == NULL || tparams->SBHUFFDS == NULL ||
+				  tparams->SBHUFFDT == NULL || tparams->SBHUFFRDW == NULL ||
+				  tparams->SBHUFFRDH == NULL || tparams->SBHUFFRDX == NULL ||
+				  tparams->SBHUFFRDY == NULL) {
+				  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+				    "could not build aggregate symbol huffman tables");
+				  goto cleanup;
+			      }
 			  }
 			  tparams->SBHUFF = params->SDHUFF;
 			  tparams->SBREFINE = 1;
@@ -475,10 +531,7 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 		      if (image == NULL) {
 			  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 			   "Out of memory creating symbol image");
-		          jbig2_free(ctx->allocator, tparams);
-			  jbig2_sd_release(ctx, refagg_dicts[0]);
-		          jbig2_free(ctx->allocator, refagg_dicts);
-		          return NULL;
+		          goto cleanup;
 		      }
 
 		      /* multiple symbols are handled as a text region */
@@ -499,7 +552,13 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 		      if (params->SDHUFF) {
 			  ID = jbig2_huffman_get_bits(hs, SBSYMCODELEN);
 			  RDX = jbig2_huffman_get(hs, SDHUFFRDX, &code);
-			  RDY = jbig2_huffman_get(hs, SDHUFFRDX, &code);
+			  if (code >= 0)
+			      RDY = jbig2_huffman_get(hs, SDHUFFRDX, &code);
+			  if (code < 0) {
+			      code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+				"error decoding symbol refinement offset");
+			      goto cleanup;
+			  }
 		      } else {
 			  code = jbig2_arith_iaid_decode(IAID, as, (int32_t*)&ID);
 		          code = jbig2_arith_int_decode(IARDX, as, &RDX);
@@ -509,14 +568,21 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 		      if (ID >= ninsyms+NSYMSDECODED) {
 			code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 			  "refinement references unknown symbol %d", ID);
-			return NULL;
+			goto cleanup;
 		      }
 
+#ifdef JBIG2_DEBUG
 		      jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
 			"symbol is a refinement of id %d with the refinement applied at (%d,%d)",
 			ID, RDX, RDY);
+#endif
 
 		      image = jbig2_image_new(ctx, SYMWIDTH, HCHEIGHT);
+		      if (image == NULL) {
+			  jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			    "could not allocate refined symbol image");
+			  goto cleanup;
+		      }
 
 		      /* Table 18 */
 		      rparams.GRTEMPLATE = params->SDRTEMPLATE;
@@ -551,15 +617,21 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 
 	  }
 
+	  /* by the region decoders */
+	  if (ctx->interrupted)
+	    goto cleanup;
+
 	  /* 6.5.5 (4c.iii) */
 	  if (params->SDHUFF && !params->SDREFAGG) {
 	    SDNEWSYMWIDTHS[NSYMSDECODED] = SYMWIDTH;
 	  }
 
+#ifdef JBIG2_DEBUG
 	  jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
             "decoded symbol %d of %d (%dx%d)",
 		NSYMSDECODED, params->SDNUMNEWSYMS,
 		SYMWIDTH, HCHEIGHT);
+#endif
 
 	  /* 6.5.5 (4c.iv) */
 	  NSYMSDECODED = NSYMSDECODED + 1;
@@ -576,8 +648,7 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	if (code || (BMSIZE < 0)) {
 	  jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	    "error decoding size of collective bitmap!");
-	  /* todo: memory cleanup */
-	  return NULL;
+	  goto cleanup;
 	}
 
 	/* skip any bits before the next byte boundary */
@@ -587,8 +658,7 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	if (image == NULL) {
 	  jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	    "could not allocate collective bitmap image!");
-	  /* todo: memory cleanup */
-	  return NULL;
+	  goto cleanup;
 	}
 
 	if (BMSIZE == 0) {
@@ -620,10 +690,11 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	  code = jbig2_decode_generic_mmr(ctx, segment, &rparams,
 	    data + jbig2_huffman_offset(hs), BMSIZE, image);
 	  if (code) {
-	    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-	      "error decoding MMR bitmap image!");
-	    /* todo: memory cleanup */
-	    return NULL;
+	    if (!ctx->interrupted)
+	      jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	        "error decoding MMR bitmap image!");
+	    jbig2_image_release(ctx, image);
+	    goto cleanup;
 	  }
 	}
 
@@ -635,6 +706,12 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 	for (j = HCFIRSTSYM; j < NSYMSDECODED; j++) {
 	  Jbig2Image *glyph;
 	  glyph = jbig2_image_new(ctx, SDNEWSYMWIDTHS[j], HCHEIGHT);
+	  if (glyph == NULL) {
+	    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	      "could not allocate symbol image");
+	    jbig2_image_release(ctx, image);
+	    goto cleanup;
+	  }
 	  jbig2_image_compose(ctx, glyph, image,
 		-x, 0, JBIG2_COMPOSE_REPLACE);
 	  x += SDNEWSYMWIDTHS[j];
@@ -645,42 +722,12 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
 
   } /* end of symbol decode loop */
 
-  if (tparams != NULL)
-  {
-      if (!params->SDHUFF)
-      {
-          jbig2_arith_int_ctx_free(ctx, tparams->IADT);
-          jbig2_arith_int_ctx_free(ctx, tparams->IAFS);
-          jbig2_arith_int_ctx_free(ctx, tparams->IADS);
-          jbig2_arith_int_ctx_free(ctx, tparams->IAIT);
-          jbig2_arith_iaid_ctx_free(ctx, tparams->IAID);
-          jbig2_arith_int_ctx_free(ctx, tparams->IARI);
-          jbig2_arith_int_ctx_free(ctx, tparams->IARDW);
-          jbig2_arith_int_ctx_free(ctx, tparams->IARDH);
-          jbig2_arith_int_ctx_free(ctx, tparams->IARDX);
-          jbig2_arith_int_ctx_free(ctx, tparams->IARDY);
-      }
-      else
-      {
-          jbig2_release_huffman_table(ctx, tparams->SBHUFFFS);
-          jbig2_release_huffman_table(ctx, tparams->SBHUFFDS);
-          jbig2_release_huffman_table(ctx, tparams->SBHUFFDT);
-          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDX);
-          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDY);
-          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDW);
-          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDH);
-      }
-      jbig2_free(ctx->allocator, tparams);
-      tparams = NULL;
-      jbig2_sd_release(ctx, refagg_dicts[0]);
-      jbig2_free(ctx->allocator, refagg_dicts);
-  }
-
-  jbig2_free(ctx->allocator, GB_stats);
-
   /* 6.5.10 */
   SDEXSYMS = jbig2_sd_new(ctx, params->SDNUMEXSYMS);
-  {
+  if (SDEXSYMS == NULL) {
+    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+      "could not allocate exported symbol dictionary");
+  } else {
     int i = 0;
     int j = 0;
     int k, m, exflag = 0;
@@ -716,6 +763,38 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
     }
   }
 
+cleanup:
+  if (tparams != NULL)
+  {
+      if (!params->SDHUFF)
+      {
+          jbig2_arith_int_ctx_free(ctx, tparams->IADT);
+          jbig2_arith_int_ctx_free(ctx, tparams->IAFS);
+          jbig2_arith_int_ctx_free(ctx, tparams->IADS);
+          jbig2_arith_int_ctx_free(ctx, tparams->IAIT);
+          jbig2_arith_iaid_ctx_free(ctx, tparams->IAID);
+          jbig2_arith_int_ctx_free(ctx, tparams->IARI);
+          jbig2_arith_int_ctx_free(ctx, tparams->IARDW);
+          jbig2_arith_int_ctx_free(ctx, tparams->IARDH);
+          jbig2_arith_int_ctx_free(ctx, tparams->IARDX);
+          jbig2_arith_int_ctx_free(ctx, tparams->IARDY);
+      }
+      else
+      {
+          jbig2_release_huffman_table(ctx, tparams->SBHUFFFS);
+          jbig2_release_huffman_table(ctx, tparams->SBHUFFDS);
+          jbig2_release_huffman_table(ctx, tparams->SBHUFFDT);
+          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDX);
+          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDY);
+          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDW);
+          jbig2_release_huffman_table(ctx, tparams->SBHUFFRDH);
+      }
+      jbig2_free(ctx->allocator, tparams);
+      tparams = NULL;
+      jbig2_sd_release(ctx, refagg_dicts[0]);
+      jbig2_free(ctx->allocator, refagg_dicts);
+  }
+
   jbig2_sd_release(ctx, SDNEWSYMS);
 
   if (!params->SDHUFF) {
@@ -730,7 +809,7 @@ jbig2_decode_symbol_dict(Jbig2Ctx *ctx,
       }
       jbig2_free(ctx->allocator, as);
   } else {
-      if (params->SDREFAGG) {
+      if (!params->SDREFAGG) {
 	jbig2_free(ctx->allocator, SDNEWSYMWIDTHS);
       }
       jbig2_release_huffman_table(ctx, SDHUFFRDX);
@@ -753,6 +832,17 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
   int offset;
   Jbig2ArithCx *GB_stats = NULL;
   Jbig2ArithCx *GR_stats = NULL;
+  int GB_stats_size = 0, GR_stats_size = 0;
+  const Jbig2HuffmanParams *huffman_params;
+  int table_index = 0;
+  Jbig2SymbolDict *last_dict = NULL;
+  int code = 0;
+
+  params.SDHUFFDH = NULL;
+  params.SDHUFFDW = NULL;
+  params.SDHUFFBMSIZE = NULL;
+  params.SDHUFFAGGINST = NULL;
+  params.SDINSYMS = NULL;
 
   if (segment->data_length < 10)
     goto too_short;
@@ -764,11 +854,6 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
   params.SDTEMPLATE = (flags >> 10) & 3;
   params.SDRTEMPLATE = (flags >> 12) & 1;
 
-  params.SDHUFFDH = NULL;
-  params.SDHUFFDW = NULL;
-  params.SDHUFFBMSIZE = NULL;
-  params.SDHUFFAGGINST = NULL;
-
   if (params.SDHUFF) {
     switch ((flags & 0x000c) >> 2) {
       case 0: /* Table B.4 */
@@ -780,14 +865,19 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		                       &jbig2_huffman_params_E);
 	break;
       case 3: /* Custom table from referred segment */
-	/* We handle this case later by leaving the table as NULL */
-	return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-	    "symbol dictionary uses custom DH huffman table (NYI)");
+	huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	if (huffman_params == NULL) {
+	  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    "symbol dictionary custom DH huffman table not found");
+	  goto cleanup;
+	}
+	params.SDHUFFDH = jbig2_build_huffman_table(ctx, huffman_params);
+	break;
       case 2:
       default:
-	return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	    "symbol dictionary specified invalid huffman table");
-	break;
+	goto cleanup;
     }
     switch ((flags & 0x0030) >> 4) {
       case 0: /* Table B.2 */
@@ -799,19 +889,29 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		                       &jbig2_huffman_params_C);
 	break;
       case 3: /* Custom table from referred segment */
-	/* We handle this case later by leaving the table as NULL */
-	return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-	    "symbol dictionary uses custom DW huffman table (NYI)");
+	huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	if (huffman_params == NULL) {
+	  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    "symbol dictionary custom DW huffman table not found");
+	  goto cleanup;
+	}
+	params.SDHUFFDW = jbig2_build_huffman_table(ctx, huffman_params);
+	break;
       case 2:
       default:
-	return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	    "symbol dictionary specified invalid huffman table");
-	break;
+	goto cleanup;
     }
     if (flags & 0x0040) {
         /* Custom table from referred segment */
-	return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-	    "symbol dictionary uses custom BMSIZE huffman table (NYI)");
+	huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	if (huffman_params == NULL) {
+	  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    "symbol dictionary custom BMSIZE huffman table not found");
+	  goto cleanup;
+	}
+	params.SDHUFFBMSIZE = jbig2_build_huffman_table(ctx, huffman_params);
     } else {
 	/* Table B.1 */
 	params.SDHUFFBMSIZE = jbig2_build_huffman_table(ctx,
@@ -819,13 +919,24 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
     }
     if (flags & 0x0080) {
         /* Custom table from referred segment */
-	return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-	    "symbol dictionary uses custom REFAGG huffman table (NYI)");
+	huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	if (huffman_params == NULL) {
+	  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    "symbol dictionary custom REFAGG huffman table not found");
+	  goto cleanup;
+	}
+	params.SDHUFFAGGINST = jbig2_build_huffman_table(ctx, huffman_params);
     } else {
 	/* Table B.1 */
 	params.SDHUFFAGGINST = jbig2_build_huffman_table(ctx,
 					&jbig2_huffman_params_A);
     }
+    if (params.SDHUFFDH == NULL || params.SDHUFFDW == NULL ||
+	params.SDHUFFBMSIZE == NULL || params.SDHUFFAGGINST == NULL) {
+      code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	"could not build symbol dictionary huffman tables");
+      goto cleanup;
+    }
   }
 
   /* FIXME: there are quite a few of these conditions to check */
@@ -841,11 +952,6 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
     }
   }
 
-  if (flags & 0x0080) {
-      jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
-        "bitmap coding context is used (NYI) symbol data likely to be garbage!");
-  }
-
   /* 7.4.2.1.2 */
   sdat_bytes = params.SDHUFF ? 0 : params.SDTEMPLATE == 0 ? 8 : 2;
   memcpy(params.sdat, segment_data + 2, sdat_bytes);
@@ -881,10 +987,20 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
     int n_dicts = jbig2_sd_count_referred(ctx, segment);
     Jbig2SymbolDict **dicts = NULL;
 
-    params.SDINSYMS = NULL;
     if (n_dicts > 0) {
       dicts = jbig2_sd_list_referred(ctx, segment);
+      if (dicts == NULL) {
+        code = -1;
+        goto cleanup;
+      }
       params.SDINSYMS = jbig2_sd_cat(ctx, n_dicts, dicts);
+      last_dict = dicts[n_dicts - 1];
+      jbig2_free(ctx->allocator, dicts);
+      if (params.SDINSYMS == NULL) {
+        code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+          "could not allocate input symbol list");
+        goto cleanup;
+      }
     }
     if (params.SDINSYMS != NULL) {
       params.SDNUMINSYMS = params.SDINSYMS->n_symbols;
@@ -893,22 +1009,50 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
     }
   }
 
-  /* 7.4.2.2 (4) */
+  /* 7.4.2.2 (3, 4) */
   if (!params.SDHUFF) {
-      int stats_size = params.SDTEMPLATE == 0 ? 65536 :
+      GB_stats_size = params.SDTEMPLATE == 0 ? 65536 :
 	params.SDTEMPLATE == 1 ? 8192 : 1024;
-      GB_stats = jbig2_alloc(ctx->allocator, stats_size);
-      memset(GB_stats, 0, stats_size);
+      GB_stats = jbig2_alloc(ctx->allocator, GB_stats_size);
       if (params.SDREFAGG) {
-	stats_size = params.SDRTEMPLATE ? 1 << 10 : 1 << 13;
-	GR_stats = jbig2_alloc(ctx->allocator, stats_size);
-	memset(GR_stats, 0, stats_size);
+	GR_stats_size = params.SDRTEMPLATE ? 1 << 10 : 1 << 13;
+	GR_stats = jbig2_alloc(ctx->allocator, GR_stats_size);
       }
-  }
-
-  if (flags & 0x0100) {
+      if (GB_stats == NULL || (params.SDREFAGG && GR_stats == NULL)) {
+	code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	  "could not allocate symbol dictionary coding contexts");
+	goto cleanup;
+      }
+      memset(GB_stats, 0, GB_stats_size);
+      if (GR_stats != NULL)
+	memset(GR_stats, 0, GR_stats_size);
+      if (flags & 0x0100) {
+	/* start from the contexts the last referred
+	   dictionary left behind, rather than from zero */
+	if (last_dict == NULL || last_dict->GB_stats == NULL) {
+	  jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
+	    "bitmap coding context is used, but no retained context "
+	    "was found; starting from a fresh context");
+	} else {
+	  if (last_dict->GB_stats_size == GB_stats_size)
+	    memcpy(GB_stats, last_dict->GB_stats, GB_stats_size);
+	  else
+	    jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
+	      "retained generic context does not match SDTEMPLATE %d",
+	      params.SDTEMPLATE);
+	  if (GR_stats != NULL && last_dict->GR_stats != NULL) {
+	    if (last_dict->GR_stats_size == GR_stats_size)
+	      memcpy(GR_stats, last_dict->GR_stats, GR_stats_size);
+	    else
+	      jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
+	        "retained refinement context does not match SDRTEMPLATE %d",
+		params.SDRTEMPLATE);
+	  }
+	}
+      }
+  } else if (flags & 0x0300) {
       jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
-        "segment marks bitmap coding context as retained (NYI)");
+	"bitmap coding context flags are set, but SDHUFF is 1");
   }
 
   segment->result = (void *)jbig2_decode_symbol_dict(ctx, segment,
@@ -920,18 +1064,33 @@ jbig2_symbol_dictionary(Jbig2Ctx *ctx, Jbig2Segment *segment,
   if (segment->result) jbig2_dump_symbol_dict(ctx, segment);
 #endif
 
-  if (params.SDHUFF) {
-      jbig2_release_huffman_table(ctx, params.SDHUFFDH);
-      jbig2_release_huffman_table(ctx, params.SDHUFFDW);
-      jbig2_release_huffman_table(ctx, params.SDHUFFBMSIZE);
-      jbig2_release_huffman_table(ctx, params.SDHUFFAGGINST);
+  /* 7.4.2.2: keep the contexts for a later dictionary */
+  if ((flags & 0x0200) && segment->result != NULL) {
+      Jbig2SymbolDict *dict = (Jbig2SymbolDict *)segment->result;
+      dict->GB_stats = GB_stats;
+      dict->GR_stats = GR_stats;
+      dict->GB_stats_size = GB_stats_size;
+      dict->GR_stats_size = GR_stats_size;
+      GB_stats = NULL;
+      GR_stats = NULL;
   }
 
-  /* todo: retain or free GB_stats, GR_stats */
-
-  return (segment->result != NULL) ? 0 : -1;
+  code = (segment->result != NULL) ? 0 : -1;
+  goto cleanup;
 
  too_short:
-  return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		     "Segment too short");
+
+ cleanup:
+  /* the exported symbols hold their own references to the inputs */
+  jbig2_sd_release(ctx, params.SDINSYMS);
+  jbig2_release_huffman_table(ctx, params.SDHUFFDH);
+  jbig2_release_huffman_table(ctx, params.SDHUFFDW);
+  jbig2_release_huffman_table(ctx, params.SDHUFFBMSIZE);
+  jbig2_release_huffman_table(ctx, params.SDHUFFAGGINST);
+  jbig2_free(ctx->allocator, GB_stats);
+  jbig2_free(ctx->allocator, GR_stats);
+
+  return code;
 }
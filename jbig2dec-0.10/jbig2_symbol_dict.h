@@ -19,6 +19,11 @@
 typedef struct {
     int n_symbols;
     Jbig2Image **glyphs;
+    /* bitmap coding contexts kept for a later dictionary
+       when the segment marks them as retained (7.4.2.2) */
+    Jbig2ArithCx *GB_stats;
+    Jbig2ArithCx *GR_stats;
+    int GB_stats_size, GR_stats_size;
 } Jbig2SymbolDict;
 
 /* decode a symbol dictionary segment and store the results */
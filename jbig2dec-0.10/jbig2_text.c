@@ -31,6 +31,174 @@
 #include "jbig2_symbol_dict.h"
 #include "jbig2_text.h"
 
+/* return a copy of a glyph shifted right by @shift pixels, so that
+   placing it at a destination column with the same alignment is a
+   plain byte-wise operation. copies are made on first use and kept
+   in @cache, which has 8 entries per symbol id. */
+static Jbig2Image *
+jbig2_text_shifted_glyph(Jbig2Ctx *ctx, Jbig2Image **cache,
+                         uint32_t id, Jbig2Image *glyph, int shift)
+{
+    Jbig2Image **slot = &cache[(id << 3) + shift];
+
+    if (*slot == NULL) {
+        Jbig2Image *image = jbig2_image_new(ctx, glyph->width + shift, glyph->height);
+        if (image == NULL)
+            return NULL;
+        jbig2_image_clear(ctx, image, 0);
+        jbig2_image_compose(ctx, image, glyph, shift, 0, JBIG2_COMPOSE_OR);
+        *slot = image;
+    }
+
+    return *slot;
+}
+
+static void
+jbig2_text_free_glyph_cache(Jbig2Ctx *ctx, Jbig2Image **cache, uint32_t n)
+{
+    uint32_t i;
+
+    if (cache == NULL)
+        return;
+    for (i = 0; i < n; i++)
+        if (cache[i] != NULL)
+            jbig2_image_release(ctx, cache[i]);
+    jbig2_free(ctx->allocator, cache);
+}
+
+/* a decoded symbol instance, waiting to be drawn into the region */
+typedef struct {
+    int x, y;
+    uint32_t ID;
+    Jbig2Image *IB;
+    bool refined;	/* IB is a refined copy owned by the instance */
+} Jbig2TextInstance;
+
+/* the region is drawn in bands of this many rows, so the part of the
+   region image being written stays in cache */
+#define JBIG2_TEXT_BAND_HEIGHT 128
+
+static void
+jbig2_text_free_instances(Jbig2Ctx *ctx, Jbig2TextInstance *instances, uint32_t n)
+{
+    uint32_t i;
+
+    if (instances == NULL)
+        return;
+    for (i = 0; i < n; i++)
+        if (instances[i].refined)
+            jbig2_image_release(ctx, instances[i].IB);
+    jbig2_free(ctx->allocator, instances);
+}
+
+/* draw one instance into a band of the region image, with its
+   coordinates relative to the band */
+static void
+jbig2_text_place_instance(Jbig2Ctx *ctx, Jbig2Image *band,
+                          const Jbig2TextInstance *instance, int x, int y,
+                          Jbig2ComposeOp op, Jbig2Image **glyph_cache)
+{
+    Jbig2Image *IB = instance->IB;
+
+    if (glyph_cache != NULL && !instance->refined && x >= 0 && y >= 0 &&
+            x + IB->width <= band->width && y + IB->height <= band->height) {
+        Jbig2Image *shifted = jbig2_text_shifted_glyph(ctx,
+            glyph_cache, instance->ID, IB, x & 7);
+        if (shifted != NULL) {
+            jbig2_image_compose_aligned(band, shifted, x & ~7, y, op);
+            return;
+        }
+    }
+    jbig2_image_compose(ctx, band, IB, x, y, op);
+}
+
+/* 6.4.5 (3c.ix) - draw the decoded instances into the region image.
+   the instances are bucketed by the bands they overlap and each
+   band is drawn in turn, clipping instances which straddle bands.
+   every pixel belongs to a single band and the instances in a band
+   keep their stream order, so the result is the same as drawing the
+   instances one after another for any combination operator. */
+static void
+jbig2_text_render_instances(Jbig2Ctx *ctx, Jbig2Image *image,
+                            const Jbig2TextInstance *instances, uint32_t n,
+                            Jbig2ComposeOp op, Jbig2Image **glyph_cache)
+{
+    const int n_bands = (image->height + JBIG2_TEXT_BAND_HEIGHT - 1) /
+        JBIG2_TEXT_BAND_HEIGHT;
+    uint32_t *start = NULL, *list = NULL;
+    uint32_t i, total;
+    Jbig2Image band;
+    int b;
+
+    if (n_bands > 1)
+        start = jbig2_new(ctx, uint32_t, n_bands + 1);
+    if (start == NULL) {
+        /* draw the whole region as a single band */
+        for (i = 0; i < n; i++)
+            jbig2_text_place_instance(ctx, image, &instances[i],
+                instances[i].x, instances[i].y, op, glyph_cache);
+        return;
+    }
+
+    /* count the instances overlapping each band */
+    memset(start, 0, (n_bands + 1) * sizeof(uint32_t));
+    for (i = 0; i < n; i++) {
+        int y0 = instances[i].y;
+        int y1 = y0 + instances[i].IB->height - 1;
+
+        if (y0 < 0) y0 = 0;
+        if (y1 >= image->height) y1 = image->height - 1;
+        for (b = y0 / JBIG2_TEXT_BAND_HEIGHT; y0 <= y1 &&
+                b <= y1 / JBIG2_TEXT_BAND_HEIGHT; b++)
+            start[b + 1]++;
+    }
+    for (b = 0; b < n_bands; b++)
+        start[b + 1] += start[b];
+    total = start[n_bands];
+
+    list = jbig2_new(ctx, uint32_t, total > 0 ? total : 1);
+    if (list == NULL) {
+        jbig2_free(ctx->allocator, start);
+        for (i = 0; i < n; i++)
+            jbig2_text_place_instance(ctx, image, &instances[i],
+                instances[i].x, instances[i].y, op, glyph_cache);
+        return;
+    }
+
+    /* fill the buckets in stream order, using start[b] as the
+       insertion point; afterwards it is the end of bucket b */
+    for (i = 0; i < n; i++) {
+        int y0 = instances[i].y;
+        int y1 = y0 + instances[i].IB->height - 1;
+
+        if (y0 < 0) y0 = 0;
+        if (y1 >= image->height) y1 = image->height - 1;
+        for (b = y0 / JBIG2_TEXT_BAND_HEIGHT; y0 <= y1 &&
+                b <= y1 / JBIG2_TEXT_BAND_HEIGHT; b++)
+            list[start[b]++] = i;
+    }
+
+    band.width = image->width;
+    band.stride = image->stride;
+    band.refcount = 1;
+    for (b = 0; b < n_bands; b++) {
+        const int band_y = b * JBIG2_TEXT_BAND_HEIGHT;
+        uint32_t first = b > 0 ? start[b - 1] : 0;
+
+        band.data = image->data + band_y * image->stride;
+        band.height = image->height - band_y;
+        if (band.height > JBIG2_TEXT_BAND_HEIGHT)
+            band.height = JBIG2_TEXT_BAND_HEIGHT;
+        for (i = first; i < start[b]; i++) {
+            const Jbig2TextInstance *instance = &instances[list[i]];
+            jbig2_text_place_instance(ctx, &band, instance,
+                instance->x, instance->y - band_y, op, glyph_cache);
+        }
+    }
+
+    jbig2_free(ctx->allocator, list);
+    jbig2_free(ctx->allocator, start);
+}
 
 /**
  * jbig2_decode_text_region: decode a text region segment
@@ -74,6 +242,12 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
     Jbig2Image *IB;
     Jbig2HuffmanState *hs = NULL;
     Jbig2HuffmanTable *SBSYMCODES = NULL;
+    Jbig2HuffmanTable *runcodes = NULL;
+    Jbig2HuffmanLine *symcodelengths = NULL;
+    Jbig2Image **SBSYMS = NULL;
+    Jbig2Image **glyph_cache = NULL;
+    Jbig2TextInstance *instances = NULL;
+    uint32_t n_instances_max = 0;
     int code = 0;
     int RI;
 
@@ -84,17 +258,22 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
     jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
         "symbol list contains %d glyphs in %d dictionaries", SBNUMSYMS, n_dicts);
 
+    NINSTANCES = 0;
+
     if (params->SBHUFF) {
-	Jbig2HuffmanTable *runcodes;
 	Jbig2HuffmanParams runcodeparams;
 	Jbig2HuffmanLine runcodelengths[35];
-	Jbig2HuffmanLine *symcodelengths;
 	Jbig2HuffmanParams symcodeparams;
-	int code, err, len, range, r;
+	int runcode, err, len, range, r;
 
 	jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
 	  "huffman coded text region");
 	hs = jbig2_huffman_new(ctx, ws);
+	if (hs == NULL) {
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		"could not allocate huffman state for text region");
+	    goto cleanup;
+	}
 
 	/* 7.4.3.1.7 - decode symbol ID Huffman table */
 	/* this is actually part of the segment header, but it is more
@@ -105,56 +284,59 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 	  runcodelengths[index].PREFLEN = jbig2_huffman_get_bits(hs, 4);
 	  runcodelengths[index].RANGELEN = 0;
 	  runcodelengths[index].RANGELOW = index;
+#ifdef JBIG2_DEBUG
 	  jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
 	    "  read runcode%d length %d", index, runcodelengths[index].PREFLEN);
+#endif
 	}
 	runcodeparams.HTOOB = 0;
 	runcodeparams.lines = runcodelengths;
 	runcodeparams.n_lines = 35;
 	runcodes = jbig2_build_huffman_table(ctx, &runcodeparams);
 	if (runcodes == NULL) {
-	  jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	    "error constructing symbol id runcode table!");
-	  return -1;
+	  goto cleanup;
 	}
 
 	/* decode the symbol id codelengths using the runlength table */
 	symcodelengths = jbig2_alloc(ctx->allocator, SBNUMSYMS*sizeof(Jbig2HuffmanLine));
 	if (symcodelengths == NULL) {
-	  jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	  code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	    "memory allocation failure reading symbol ID huffman table!");
-	  return -1;
+	  goto cleanup;
 	}
 	index = 0;
 	while (index < SBNUMSYMS) {
-	  code = jbig2_huffman_get(hs, runcodes, &err);
-	  if (err != 0 || code < 0 || code >= 35) {
-	    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	  runcode = jbig2_huffman_get(hs, runcodes, &err);
+	  if (err != 0 || runcode < 0 || runcode >= 35) {
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	      "error reading symbol ID huffman table!");
-	    return err ? err : -1;
+	    goto cleanup;
 	  }
 
-	  if (code < 32) {
-	    len = code;
+	  if (runcode < 32) {
+	    len = runcode;
 	    range = 1;
 	  } else {
-	    if (code == 32) {
-	      len = symcodelengths[index-1].PREFLEN;
+	    if (runcode == 32) {
 	      if (index < 1) {
-		jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 	 	  "error decoding symbol id table: run length with no antecedent!");
-	        /* todo: memory cleanup */
-	        return -1;
+	        goto cleanup;
 	      }
+	      len = symcodelengths[index-1].PREFLEN;
 	    } else {
-	      len = 0; /* code == 33 or 34 */
+	      len = 0; /* runcode == 33 or 34 */
 	    }
-	    if (code == 32) range = jbig2_huffman_get_bits(hs, 2) + 3;
-	    else if (code == 33) range = jbig2_huffman_get_bits(hs, 3) + 3;
-	    else if (code == 34) range = jbig2_huffman_get_bits(hs, 7) + 11;
+	    if (runcode == 32) range = jbig2_huffman_get_bits(hs, 2) + 3;
+	    else if (runcode == 33) range = jbig2_huffman_get_bits(hs, 3) + 3;
+	    else range = jbig2_huffman_get_bits(hs, 7) + 11;
 	  }
+#ifdef JBIG2_DEBUG
 	  jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
-	    "  read runcode%d at index %d (length %d range %d)", code, index, len, range);
+	    "  read runcode%d at index %d (length %d range %d)", runcode, index, len, range);
+#endif
 	  if (index+range > SBNUMSYMS) {
 	    jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
 	      "runlength extends %d entries beyond the end of symbol id table!",
@@ -182,46 +364,86 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 
 	/* finally, construct the symbol id huffman table itself */
 	SBSYMCODES = jbig2_build_huffman_table(ctx, &symcodeparams);
-
-	jbig2_free(ctx->allocator, symcodelengths);
-	jbig2_release_huffman_table(ctx, runcodes);
-
 	if (SBSYMCODES == NULL) {
-	    jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"could not construct Symbol ID huffman table!");
-	    return -1;
+	    goto cleanup;
 	}
     }
 
     /* 6.4.5 (1) */
     jbig2_image_clear(ctx, image, params->SBDEFPIXEL);
 
+    /* flatten the symbol dictionaries into a single table of glyphs
+       indexed by symbol id. the dictionaries hold references to the
+       glyphs for the duration of the region, so no further ones are
+       taken for each instance. */
+    SBSYMS = jbig2_new(ctx, Jbig2Image *, SBNUMSYMS);
+    if (SBSYMS == NULL) {
+	code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    "could not allocate symbol table for text region");
+	goto cleanup;
+    }
+    {
+	uint32_t n = 0;
+	int i;
+
+	for (index = 0; index < n_dicts; index++)
+	    for (i = 0; i < dicts[index]->n_symbols; i++)
+		SBSYMS[n++] = dicts[index]->glyphs[i];
+    }
+
+    /* pre-shifted glyphs only pay off when glyphs are reused, and
+       can only be placed with operators for which 0 is an identity */
+    if (params->SBNUMINSTANCES > SBNUMSYMS &&
+            (params->SBCOMBOP == JBIG2_COMPOSE_OR ||
+             params->SBCOMBOP == JBIG2_COMPOSE_XOR)) {
+        glyph_cache = jbig2_new(ctx, Jbig2Image *, SBNUMSYMS << 3);
+        if (glyph_cache != NULL)
+            memset(glyph_cache, 0, (SBNUMSYMS << 3) * sizeof(Jbig2Image *));
+    }
+
     /* 6.4.6 */
     if (params->SBHUFF) {
         STRIPT = jbig2_huffman_get(hs, params->SBHUFFDT, &code);
     } else {
         code = jbig2_arith_int_decode(params->IADT, as, &STRIPT);
     }
+    if (code < 0) {
+        code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+            "error decoding initial strip T");
+        goto cleanup;
+    }
 
     /* 6.4.5 (2) */
     STRIPT *= -(params->SBSTRIPS);
     FIRSTS = 0;
-    NINSTANCES = 0;
 
     /* 6.4.5 (3) */
     while (NINSTANCES < params->SBNUMINSTANCES) {
+        if (jbig2_interrupted(ctx))
+            break;
+
         /* (3b) */
         if (params->SBHUFF) {
             DT = jbig2_huffman_get(hs, params->SBHUFFDT, &code);
         } else {
             code = jbig2_arith_int_decode(params->IADT, as, &DT);
         }
+        if (code < 0) {
+            code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+                "error decoding strip delta T");
+            goto cleanup;
+        }
         DT *= params->SBSTRIPS;
         STRIPT += DT;
 
 	first_symbol = TRUE;
 	/* 6.4.5 (3c) - decode symbols in strip */
 	for (;;) {
+	    if (ctx->interrupted)
+		break; /* by a refinement */
+
 	    /* (3c.i) */
 	    if (first_symbol) {
 		/* 6.4.7 */
@@ -230,6 +452,11 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		} else {
 		    code = jbig2_arith_int_decode(params->IAFS, as, &DFS);
 		}
+		if (code < 0) {
+		    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			"error decoding first symbol S");
+		    goto cleanup;
+		}
 		FIRSTS += DFS;
 		CURS = FIRSTS;
 		first_symbol = FALSE;
@@ -241,6 +468,11 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		} else {
 		    code = jbig2_arith_int_decode(params->IADS, as, &IDS);
 		}
+		if (code < 0) {
+		    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			"error decoding symbol S delta");
+		    goto cleanup;
+		}
 		if (code) {
 		    break;
 		}
@@ -263,20 +495,19 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 	    } else {
 		code = jbig2_arith_iaid_decode(params->IAID, as, (int *)&ID);
 	    }
+	    if (code < 0) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "error decoding symbol id");
+		goto cleanup;
+	    }
 	    if (ID >= SBNUMSYMS) {
-		return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
                     "symbol id out of range! (%d/%d)", ID, SBNUMSYMS);
+		goto cleanup;
 	    }
 
 	    /* (3c.v) / 6.4.11 - look up the symbol bitmap IB */
-	    {
-		uint32_t id = ID;
-
-		index = 0;
-		while (id >= dicts[index]->n_symbols)
-		    id -= dicts[index++]->n_symbols;
-		IB = jbig2_image_clone(ctx, dicts[index]->glyphs[id]);
-	    }
+	    IB = SBSYMS[ID];
 	    if (params->SBREFINE) {
 	      if (params->SBHUFF) {
 		RI = jbig2_huffman_get_bits(hs, 1);
@@ -301,10 +532,19 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		  code = jbig2_arith_int_decode(params->IARDY, as, &RDY);
 		} else {
 		  RDW = jbig2_huffman_get(hs, params->SBHUFFRDW, &code);
-		  RDH = jbig2_huffman_get(hs, params->SBHUFFRDH, &code);
-		  RDX = jbig2_huffman_get(hs, params->SBHUFFRDX, &code);
-		  RDY = jbig2_huffman_get(hs, params->SBHUFFRDY, &code);
-		  BMSIZE = jbig2_huffman_get(hs, params->SBHUFFRSIZE, &code);
+		  if (code >= 0)
+		    RDH = jbig2_huffman_get(hs, params->SBHUFFRDH, &code);
+		  if (code >= 0)
+		    RDX = jbig2_huffman_get(hs, params->SBHUFFRDX, &code);
+		  if (code >= 0)
+		    RDY = jbig2_huffman_get(hs, params->SBHUFFRDY, &code);
+		  if (code >= 0)
+		    BMSIZE = jbig2_huffman_get(hs, params->SBHUFFRSIZE, &code);
+		  if (code < 0) {
+		    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			"error decoding symbol refinement parameters");
+		    goto cleanup;
+		  }
 		  jbig2_huffman_skip(hs);
 		}
 
@@ -312,6 +552,11 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		IBO = IB;
 		refimage = jbig2_image_new(ctx, IBO->width + RDW,
 						IBO->height + RDH);
+		if (refimage == NULL) {
+		    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			"could not allocate refined symbol image");
+		    goto cleanup;
+		}
 
 		/* Table 12 */
 		rparams.GRTEMPLATE = params->SBRTEMPLATE;
@@ -324,8 +569,6 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		    &rparams, as, refimage, GR_stats);
 		IB = refimage;
 
-		jbig2_image_release(ctx, IBO);
-
 		/* 6.4.11 (7) */
 		if (params->SBHUFF) {
 		  jbig2_huffman_advance(hs, BMSIZE);
@@ -360,14 +603,34 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 		}
 	    }
 
-	    /* (3c.ix) */
+	    /* (3c.ix) - the instances are drawn once they are all decoded */
 #ifdef JBIG2_DEBUG
 	    jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
-			"composing glyph id %d: %dx%d @ (%d,%d) symbol %d/%d",
+			"decoded glyph id %d: %dx%d @ (%d,%d) symbol %d/%d",
 			ID, IB->width, IB->height, x, y, NINSTANCES + 1,
 			params->SBNUMINSTANCES);
 #endif
-	    jbig2_image_compose(ctx, image, IB, x, y, params->SBCOMBOP);
+	    if (NINSTANCES == n_instances_max) {
+		Jbig2TextInstance *grown;
+
+		n_instances_max = n_instances_max ? n_instances_max << 1 : 256;
+		if (n_instances_max > params->SBNUMINSTANCES)
+		    n_instances_max = params->SBNUMINSTANCES;
+		grown = jbig2_renew(ctx, instances, Jbig2TextInstance, n_instances_max);
+		if (grown == NULL) {
+		    if (RI)
+			jbig2_image_release(ctx, IB);
+		    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			"could not allocate text region instance list");
+		    goto cleanup;
+		}
+		instances = grown;
+	    }
+	    instances[NINSTANCES].x = x;
+	    instances[NINSTANCES].y = y;
+	    instances[NINSTANCES].ID = ID;
+	    instances[NINSTANCES].IB = IB;
+	    instances[NINSTANCES].refined = RI ? TRUE : FALSE;
 
 	    /* (3c.x) */
 	    if ((!params->TRANSPOSED) && (params->REFCORNER < 2)) {
@@ -378,18 +641,41 @@ jbig2_decode_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment,
 
 	    /* (3c.xi) */
 	    NINSTANCES++;
-
-	    jbig2_image_release(ctx, IB);
 	}
         /* end strip */
     }
     /* 6.4.5 (4) */
 
-    if (params->SBHUFF) {
-      jbig2_release_huffman_table(ctx, SBSYMCODES);
-    }
+    if (!ctx->interrupted)
+        jbig2_text_render_instances(ctx, image, instances, NINSTANCES,
+            params->SBCOMBOP, glyph_cache);
+    code = ctx->interrupted ? -1 : 0;
+
+cleanup:
+    jbig2_text_free_instances(ctx, instances, NINSTANCES);
+    jbig2_text_free_glyph_cache(ctx, glyph_cache, SBNUMSYMS << 3);
+    jbig2_free(ctx->allocator, SBSYMS);
+    jbig2_free(ctx->allocator, symcodelengths);
+    jbig2_release_huffman_table(ctx, runcodes);
+    jbig2_release_huffman_table(ctx, SBSYMCODES);
+    jbig2_huffman_free(ctx, hs);
+
+    return code;
+}
 
-    return 0;
+/* release the huffman tables a text region header selects; tables
+   that were never built are NULL */
+static void
+jbig2_text_release_huffman_tables(Jbig2Ctx *ctx, Jbig2TextRegionParams *params)
+{
+    jbig2_release_huffman_table(ctx, params->SBHUFFFS);
+    jbig2_release_huffman_table(ctx, params->SBHUFFDS);
+    jbig2_release_huffman_table(ctx, params->SBHUFFDT);
+    jbig2_release_huffman_table(ctx, params->SBHUFFRDX);
+    jbig2_release_huffman_table(ctx, params->SBHUFFRDY);
+    jbig2_release_huffman_table(ctx, params->SBHUFFRDW);
+    jbig2_release_huffman_table(ctx, params->SBHUFFRDH);
+    jbig2_release_huffman_table(ctx, params->SBHUFFRSIZE);
 }
 
 /**
@@ -402,10 +688,16 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
     Jbig2RegionSegmentInfo region_info;
     Jbig2TextRegionParams params;
     Jbig2Image *image;
+    Jbig2Image page_rows;
+    bool in_place = FALSE;
+    bool no_state = FALSE;
+    Jbig2Arena *arena = NULL;
     Jbig2SymbolDict **dicts;
     int n_dicts;
     uint16_t flags;
     uint16_t huffman_flags = 0;
+    const Jbig2HuffmanParams *huffman_params;
+    int table_index = 0;
     Jbig2ArithCx *GR_stats = NULL;
     int code = 0;
     Jbig2WordStream *ws = NULL;
@@ -472,6 +764,15 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
     params.SBNUMINSTANCES = jbig2_get_int32(segment_data + offset);
     offset += 4;
 
+    params.SBHUFFFS = NULL;
+    params.SBHUFFDS = NULL;
+    params.SBHUFFDT = NULL;
+    params.SBHUFFRDW = NULL;
+    params.SBHUFFRDH = NULL;
+    params.SBHUFFRDX = NULL;
+    params.SBHUFFRDY = NULL;
+    params.SBHUFFRSIZE = NULL;
+
     if (params.SBHUFF) {
         /* 7.4.3.1.5 - Symbol ID Huffman table */
 	/* ...this is handled in the segment body decoder */
@@ -487,15 +788,19 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_G);
 	    break;
 	  case 3: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom FS huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom FS huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFFS = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	  case 2: /* invalid */
 	  default:
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"text region specified invalid FS huffman table");
-	    break;
+	    goto fail;
 	}
 	switch ((huffman_flags & 0x000c) >> 2) {
 	  case 0: /* Table B.8 */
@@ -511,9 +816,13 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_J);
 	    break;
 	  case 3: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom DS huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom DS huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFDS = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	}
 	switch ((huffman_flags & 0x0030) >> 4) {
@@ -530,9 +839,13 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_M);
 	    break;
 	  case 3: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom DT huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom DT huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFDT = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	}
 	switch ((huffman_flags & 0x00c0) >> 6) {
@@ -545,15 +858,19 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_O);
 	    break;
 	  case 3: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom RDW huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom RDW huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFRDW = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	  case 2: /* invalid */
 	  default:
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"text region specified invalid RDW huffman table");
-	    break;
+	    goto fail;
 	}
 	switch ((huffman_flags & 0x0300) >> 8) {
 	  case 0: /* Table B.14 */
@@ -565,15 +882,19 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_O);
 	    break;
 	  case 3: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom RDH huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom RDH huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFRDH = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	  case 2: /* invalid */
 	  default:
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"text region specified invalid RDH huffman table");
-	    break;
+	    goto fail;
 	}
         switch ((huffman_flags & 0x0c00) >> 10) {
 	  case 0: /* Table B.14 */
@@ -585,15 +906,19 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_O);
 	    break;
 	  case 3: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom RDX huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom RDX huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFRDX = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	  case 2: /* invalid */
 	  default:
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"text region specified invalid RDX huffman table");
-	    break;
+	    goto fail;
 	}
 	switch ((huffman_flags & 0x3000) >> 12) {
 	  case 0: /* Table B.14 */
@@ -605,15 +930,19 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_O);
 	    break;
 	  case 3: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom RDY huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom RDY huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFRDY = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	  case 2: /* invalid */
 	  default:
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"text region specified invalid RDY huffman table");
-	    break;
+	    goto fail;
 	}
 	switch ((huffman_flags & 0x4000) >> 14) {
 	  case 0: /* Table B.1 */
@@ -621,12 +950,25 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 			&jbig2_huffman_params_A);
 	    break;
 	  case 1: /* Custom table from referred segment */
-	    /* We handle this case later by leaving the table as NULL */
-	    return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-		"text region uses custom RSIZE huffman table (NYI)");
+	    huffman_params = jbig2_find_table(ctx, segment, table_index++);
+	    if (huffman_params == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		    "text region custom RSIZE huffman table not found");
+		goto fail;
+	    }
+	    params.SBHUFFRSIZE = jbig2_build_huffman_table(ctx, huffman_params);
 	    break;
 	}
 
+        if (params.SBHUFFFS == NULL || params.SBHUFFDS == NULL ||
+            params.SBHUFFDT == NULL || params.SBHUFFRDW == NULL ||
+            params.SBHUFFRDH == NULL || params.SBHUFFRDX == NULL ||
+            params.SBHUFFRDY == NULL || params.SBHUFFRSIZE == NULL) {
+            code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+                "could not build text region huffman tables");
+            goto fail;
+        }
+
         if (huffman_flags & 0x8000) {
 	  jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
  	    "text region huffman flags bit 15 is set, contrary to spec");
@@ -646,19 +988,23 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
     if (n_dicts != 0) {
         dicts = jbig2_sd_list_referred(ctx, segment);
     } else {
-        return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+        code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
                 "text region refers to no symbol dictionaries!");
+        goto fail;
     }
     if (dicts == NULL) {
-	return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+	code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
 		"unable to retrive symbol dictionaries!"
 		" previous parsing error?");
+	goto fail;
     } else {
 	int index;
 	if (dicts[0] == NULL) {
-	    return jbig2_error(ctx, JBIG2_SEVERITY_WARNING,
+	    jbig2_free(ctx->allocator, dicts);
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_WARNING,
 			segment->number,
                         "unable to find first referenced symbol dictionary!");
+	    goto fail;
 	}
 	for (index = 1; index < n_dicts; index++)
 	    if (dicts[index] == NULL) {
@@ -672,10 +1018,24 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
     if (!params.SBHUFF && params.SBREFINE) {
 	int stats_size = params.SBRTEMPLATE ? 1 << 10 : 1 << 13;
 	GR_stats = jbig2_alloc(ctx->allocator, stats_size);
+	if (GR_stats == NULL) {
+	    jbig2_free(ctx->allocator, dicts);
+	    code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+		"could not allocate text region refinement contexts");
+	    goto fail;
+	}
 	memset(GR_stats, 0, stats_size);
     }
 
-    image = jbig2_image_new(ctx, region_info.width, region_info.height);
+    if ((segment->flags & 63) != 4)
+        in_place = jbig2_page_region_in_place(ctx,
+            &ctx->pages[ctx->current_page], &page_rows,
+            region_info.x, region_info.y,
+            region_info.width, region_info.height, region_info.op);
+    if (in_place)
+        image = &page_rows;
+    else
+        image = jbig2_image_new(ctx, region_info.width, region_info.height);
 
     ws = jbig2_word_stream_buf_new(ctx, segment_data + offset, segment->data_length - offset);
     if (!params.SBHUFF) {
@@ -686,7 +1046,6 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 	}
 
 	as = jbig2_arith_new(ctx, ws);
-	ws = 0;
 
         params.IADT = jbig2_arith_int_ctx_new(ctx);
         params.IAFS = jbig2_arith_int_ctx_new(ctx);
@@ -700,26 +1059,47 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 	params.IARDH = jbig2_arith_int_ctx_new(ctx);
 	params.IARDX = jbig2_arith_int_ctx_new(ctx);
 	params.IARDY = jbig2_arith_int_ctx_new(ctx);
+	if (as == NULL || params.IADT == NULL || params.IAFS == NULL ||
+		params.IADS == NULL || params.IAIT == NULL ||
+		params.IAID == NULL || params.IARI == NULL ||
+		params.IARDW == NULL || params.IARDH == NULL ||
+		params.IARDX == NULL || params.IARDY == NULL)
+	    no_state = TRUE;
     }
-
-    code = jbig2_decode_text_region(ctx, segment, &params,
+    if (image == NULL || ws == NULL)
+        no_state = TRUE;
+
+    if (ctx->options & JBIG2_OPTIONS_ARENA && !no_state)
+        arena = jbig2_arena_new(ctx->allocator);
+    if (no_state) {
+        code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+            "could not allocate text region decoder state");
+    } else if (arena != NULL) {
+        /* everything the decoder allocates, such as the instance
+           list, refined symbols and pre-shifted glyphs, is scratch
+           which can go all at once */
+        Jbig2Allocator *allocator = ctx->allocator;
+
+        ctx->allocator = &arena->allocator;
+        code = jbig2_decode_text_region(ctx, segment, &params,
+                (const Jbig2SymbolDict * const *)dicts, n_dicts, image,
+                segment_data + offset, segment->data_length - offset,
+		GR_stats, as, ws);
+        ctx->allocator = allocator;
+        jbig2_arena_free(arena);
+    } else {
+        code = jbig2_decode_text_region(ctx, segment, &params,
                 (const Jbig2SymbolDict * const *)dicts, n_dicts, image,
                 segment_data + offset, segment->data_length - offset,
 		GR_stats, as, ws);
+    }
 
     if (!params.SBHUFF && params.SBREFINE) {
 	jbig2_free(ctx->allocator, GR_stats);
     }
 
     if (params.SBHUFF) {
-      jbig2_release_huffman_table(ctx, params.SBHUFFFS);
-      jbig2_release_huffman_table(ctx, params.SBHUFFDS);
-      jbig2_release_huffman_table(ctx, params.SBHUFFDT);
-      jbig2_release_huffman_table(ctx, params.SBHUFFRDX);
-      jbig2_release_huffman_table(ctx, params.SBHUFFRDY);
-      jbig2_release_huffman_table(ctx, params.SBHUFFRDW);
-      jbig2_release_huffman_table(ctx, params.SBHUFFRDH);
-      jbig2_release_huffman_table(ctx, params.SBHUFFRSIZE);
+      jbig2_text_release_huffman_tables(ctx, &params);
     }
     else {
 	jbig2_arith_int_ctx_free(ctx, params.IADT);
@@ -733,16 +1113,30 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
 	jbig2_arith_int_ctx_free(ctx, params.IARDX);
 	jbig2_arith_int_ctx_free(ctx, params.IARDY);
 	jbig2_free(ctx->allocator, as);
-	jbig2_word_stream_buf_free(ctx, ws);
     }
+    jbig2_word_stream_buf_free(ctx, ws);
 
     jbig2_free(ctx->allocator, dicts);
 
+    if (no_state || ctx->interrupted) {
+        /* an interrupted region leaves the page as it found it, to
+           be decoded again when decoding resumes */
+        if (in_place)
+            jbig2_image_clear(ctx, image, 0);
+        else if (image != NULL)
+            jbig2_image_release(ctx, image);
+        return code;
+    }
+
     /* todo: check errors */
 
     if ((segment->flags & 63) == 4) {
         /* we have an intermediate region here. save it for later */
         segment->result = image;
+    } else if (in_place) {
+        /* decoded straight into the page */
+        jbig2_page_region_in_place_done(ctx,
+            &ctx->pages[ctx->current_page], image);
     } else {
         /* otherwise composite onto the page */
         jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
@@ -759,4 +1153,9 @@ jbig2_parse_text_region(Jbig2Ctx *ctx, Jbig2Segment *segment, const byte *segmen
     too_short:
         return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
                     "Segment too short");
+
+    fail:
+        /* nothing but the huffman tables is held yet */
+        jbig2_text_release_huffman_tables(ctx, &params);
+        return code;
 }
@@ -35,6 +35,27 @@
 # include "getopt.h"
 #endif
 
+#include <time.h>
+#if defined(HAVE_GETTIMEOFDAY) && defined(HAVE_SYS_TIME_H)
+# include <sys/time.h>
+# define USE_GETTIMEOFDAY
+#endif
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# define USE_MMAP
+#endif
+
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H) && defined(HAVE_UNISTD_H)
+# include <sys/types.h>
+# include <sys/wait.h>
+# include <unistd.h>
+# include <signal.h>
+# define USE_FORK
+#endif
+
 #include "os_types.h"
 #include "sha1.h"
 
@@ -58,8 +79,19 @@ typedef struct {
         SHA1_CTX *hash_ctx;
 	char *output_file;
 	jbig2dec_format output_format;
+	int batch, jobs;
+	char *list_file;
+	char *output_dir;
+	int png_level;
+	size_t memory_limit;
 } jbig2dec_params_t;
 
+/* a document to decode in batch mode */
+typedef struct {
+	char *fn;
+	char *fn_page;
+} jbig2dec_job_t;
+
 static int print_version(void);
 static int print_usage(void);
 
@@ -122,6 +154,21 @@ set_output_format(jbig2dec_params_t *params, const char *format)
     return 0;
 }
 
+/* parse a byte count with an optional k, m or g suffix */
+static size_t
+parse_size(const char *arg)
+{
+	char *end;
+	size_t size = strtoul(arg, &end, 10);
+
+	switch (*end) {
+		case 'g': case 'G': size <<= 10; /* fall through */
+		case 'm': case 'M': size <<= 10; /* fall through */
+		case 'k': case 'K': size <<= 10;
+	}
+	return size;
+}
+
 static int
 parse_options(int argc, char *argv[], jbig2dec_params_t *params)
 {
@@ -134,6 +181,11 @@ parse_options(int argc, char *argv[], jbig2dec_params_t *params)
                 {"hash", 0, NULL, 'm'},
 		{"output", 1, NULL, 'o'},
                 {"format", 1, NULL, 't'},
+		{"batch", 0, NULL, 'b'},
+		{"jobs", 1, NULL, 'j'},
+		{"list", 1, NULL, 'l'},
+		{"compression", 1, NULL, 'z'},
+		{"memory-limit", 1, NULL, 'M'},
 		{NULL, 0, NULL, 0}
 	};
 	int option_idx = 1;
@@ -141,7 +193,7 @@ parse_options(int argc, char *argv[], jbig2dec_params_t *params)
 
 	while (1) {
 		option = getopt_long(argc, argv,
-			"Vh?qvdo:t:", long_options, &option_idx);
+			"Vh?qvdo:t:bj:l:z:M:", long_options, &option_idx);
 		if (option == -1) break;
 
 		switch (option) {
@@ -179,6 +231,29 @@ parse_options(int argc, char *argv[], jbig2dec_params_t *params)
                         case 't':
                         	set_output_format(params, optarg);
                                 break;
+			case 'b':
+				params->batch = 1;
+				break;
+			case 'j':
+				params->jobs = atoi(optarg);
+				if (params->jobs < 1) params->jobs = 1;
+				break;
+			case 'l':
+				params->list_file = strdup(optarg);
+				params->batch = 1;
+				break;
+			case 'z':
+				params->png_level = atoi(optarg);
+#ifdef HAVE_LIBPNG
+				if (!strncmp(optarg, "rle", 4))
+					params->png_level = JBIG2_PNG_LEVEL_RLE;
+				else if (params->png_level < 0 || params->png_level > 9)
+					params->png_level = JBIG2_PNG_LEVEL_DEFAULT;
+#endif
+				break;
+			case 'M':
+				params->memory_limit = parse_size(optarg);
+				break;
 			default:
 				if (!params->verbose) fprintf(stdout,
 					"unrecognized option: -%c\n", option);
@@ -201,6 +276,8 @@ print_usage (void)
   fprintf(stderr,
     "Usage: jbig2dec [options] <file.jbig2>\n"
     "   or  jbig2dec [options] <global_stream> <page_stream>\n"
+    "   or  jbig2dec [options] --batch <file.jbig2>...\n"
+    "   or  jbig2dec [options] --list <manifest>\n"
     "\n"
     "  When invoked with a single file, it attempts to parse it as\n"
     "  a normal jbig2 file. Invoked with two files, it treats the\n"
@@ -208,23 +285,41 @@ print_usage (void)
     "  stream for a particular page. This is useful for examining\n"
     "  embedded streams.\n"
     "\n"
+    "  In batch mode each file is decoded as a separate document.\n"
+    "  A manifest lists one document per line, either a file or a\n"
+    "  global stream and a page stream separated by white space;\n"
+    "  '-' reads the manifest from stdin. Pages are written to the\n"
+    "  output directory as <file>.png (or .pbm), named after the\n"
+    "  file or the page stream, with the page number appended for\n"
+    "  pages after the first.\n"
+    "\n"
     "  available options:\n"
     "    -h --help	this usage summary\n"
     "    -q --quiet     suppress diagnostic output\n"
     "    -v --verbose   set the verbosity level\n"
-    "    -d --dump      print the structure of the jbig2 file\n"
-    "                   rather than explicitly decoding\n"
+    "    -d --dump      decode without output, printing each segment\n"
+    "                   with the time, coded bytes and allocations\n"
+    "                   it took\n"
     "       --version   program name and version information\n"
     "       --hash      print a hash of the decode document\n"
     "    -o <file>      send decoded output to <file>\n"
     "                   Defaults to the the input with a different\n"
     "                   extension. Pass '-' for stdout.\n"
+    "                   In batch mode, the output directory.\n"
     "    -t <type>      force a particular output file format\n"
  #ifdef HAVE_LIBPNG
     "                   supported options are 'png' and 'pbm'\n"
  #else
     "                   the only supported option is 'pbm'\n"
  #endif
+    "    -z --compression <level>\n"
+    "                   png compression, 0-9 or 'rle' (default 1)\n"
+    "    -b --batch     decode each file as a separate document\n"
+    "    -l --list <file> decode the documents listed in <file>\n"
+    "    -j --jobs <n>  decode batches with <n> worker processes\n"
+    "    -M --memory-limit <bytes>\n"
+    "                   fail segments which would take a document\n"
+    "                   past <bytes> (k, m and g suffixes allowed)\n"
     "\n"
   );
 
@@ -260,6 +355,17 @@ error_callback(void *error_callback_data, const char *buf, Jbig2Severity severit
     return 0;
 }
 
+/* map the verbosity level onto the library's message filter so that
+   messages we would throw away are never formatted */
+static Jbig2Severity
+min_severity(const jbig2dec_params_t *params)
+{
+    if (params->verbose >= 3) return JBIG2_SEVERITY_DEBUG;
+    if (params->verbose == 2) return JBIG2_SEVERITY_INFO;
+    if (params->verbose == 1) return JBIG2_SEVERITY_WARNING;
+    return JBIG2_SEVERITY_FATAL;
+}
+
 static char *
 make_output_filename(const char *input_filename, const char *extension)
 {
@@ -318,7 +424,7 @@ write_page_image(jbig2dec_params_t *params, Jbig2Image *image)
 	  switch (params->output_format) {
 #ifdef HAVE_LIBPNG
             case jbig2dec_format_png:
-              jbig2_image_write_png(image, stdout);
+              jbig2_image_write_png_level(image, stdout, params->png_level);
               break;
 #endif
             case jbig2dec_format_pbm:
@@ -336,7 +442,8 @@ write_page_image(jbig2dec_params_t *params, Jbig2Image *image)
           switch (params->output_format) {
 #ifdef HAVE_LIBPNG
             case jbig2dec_format_png:
-              jbig2_image_write_png_file(image, params->output_file);
+              jbig2_image_write_png_file_level(image, params->output_file,
+                                               params->png_level);
               break;
 #endif
             case jbig2dec_format_pbm:
@@ -351,155 +458,690 @@ write_page_image(jbig2dec_params_t *params, Jbig2Image *image)
   return 0;
 }
 
+/* submit the entire contents of a file to the decoder. where we can,
+   map the file and hand it over in one piece so that the library
+   decodes it in place rather than copying it into its own buffer. */
+static int
+data_in_file(Jbig2Ctx *ctx, FILE *f)
+{
+  uint8_t buf[4096];
+  int code = 0;
+
+#ifdef USE_MMAP
+  {
+    struct stat st;
+
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+      {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                          fileno(f), 0);
+        if (data != MAP_FAILED)
+          {
+            code = jbig2_data_in(ctx, data, st.st_size);
+            munmap(data, st.st_size);
+            return code;
+          }
+      }
+  }
+#endif
+
+  /* fall back to reading the file a block at a time */
+  for (;;)
+    {
+      int n_bytes = fread(buf, 1, sizeof(buf), f);
+      if (n_bytes <= 0)
+	break;
+      code = jbig2_data_in(ctx, buf, n_bytes);
+    }
+
+  return code;
+}
+
 static int
-write_document_hash(jbig2dec_params_t *params)
+write_document_hash(jbig2dec_params_t *params, const char *name)
 {
     FILE *out;
 
-    if (!strncmp(params->output_file, "-", 2)) {
+    if (params->output_file != NULL && !strncmp(params->output_file, "-", 2)) {
         out = stderr;
     } else {
         out = stdout;
     }
 
-    fprintf(out, "Hash of decoded document: ");
+    if (name != NULL)
+      fprintf(out, "Hash of %s: ", name);
+    else
+      fprintf(out, "Hash of decoded document: ");
     hash_print(params, out);
     fprintf(out, "\n");
 
     return 0;
 }
 
-int
-main (int argc, char **argv)
+/* --dump: a report of the segments decoded, with what each cost.
+   allocations are counted by wrapping the default allocator */
+typedef struct {
+  Jbig2Allocator allocator;
+  long n_allocs;
+  size_t alloc_bytes;
+  /* at the start of the current segment */
+  double start;
+  long start_allocs;
+  size_t start_bytes;
+  /* totals */
+  int n_segments;
+  double total_ms;
+  size_t total_coded;
+} jbig2dec_dump_t;
+
+static void *
+dump_alloc(Jbig2Allocator *allocator, size_t size)
 {
-  FILE *f = NULL, *f_page = NULL;
-  Jbig2Ctx *ctx;
-  uint8_t buf[4096];
-  jbig2dec_params_t params;
-  int filearg;
+  jbig2dec_dump_t *dump = (jbig2dec_dump_t *)allocator;
 
-  /* set defaults */
-  params.mode = render;
-  params.verbose = 1;
-  params.hash = 0;
-  params.output_file = NULL;
-  params.output_format = jbig2dec_format_none;
+  dump->n_allocs++;
+  dump->alloc_bytes += size;
+  return malloc(size);
+}
 
-  filearg = parse_options(argc, argv, &params);
+static void
+dump_free(Jbig2Allocator *allocator, void *p)
+{
+  free(p);
+}
 
-  if (params.hash) hash_init(&params);
+static void *
+dump_realloc(Jbig2Allocator *allocator, void *p, size_t size)
+{
+  jbig2dec_dump_t *dump = (jbig2dec_dump_t *)allocator;
 
-  switch (params.mode) {
-    case usage:
-        print_usage();
-        exit (0);
-        break;
-    case dump:
-        fprintf(stderr, "Sorry, segment dump not yet implemented\n");
+  dump->n_allocs++;
+  dump->alloc_bytes += size;
+  return realloc(p, size);
+}
+
+/* wall clock milliseconds */
+static double
+dump_time(void)
+{
+#ifdef USE_GETTIMEOFDAY
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#else
+  return clock() * 1000.0 / CLOCKS_PER_SEC;
+#endif
+}
+
+static const char *
+dump_segment_type(int type)
+{
+  switch (type) {
+    case 0: return "symbol dict";
+    case 4: return "text region (int)";
+    case 6: return "text region";
+    case 7: return "text region (ll)";
+    case 16: return "pattern dict";
+    case 20: return "halftone (int)";
+    case 22: return "halftone";
+    case 23: return "halftone (ll)";
+    case 36: return "generic (int)";
+    case 38: return "generic";
+    case 39: return "generic (ll)";
+    case 40: return "refinement (int)";
+    case 42: return "refinement";
+    case 43: return "refinement (ll)";
+    case 48: return "page info";
+    case 49: return "end of page";
+    case 50: return "end of stripe";
+    case 51: return "end of file";
+    case 52: return "profiles";
+    case 53: return "code table";
+    case 62: return "extension";
+  }
+  return "unknown";
+}
+
+static uint32_t
+dump_int32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* describe the coding parameters of a segment from its header fields */
+static void
+dump_segment_details(const Jbig2Segment *segment, const uint8_t *data, FILE *out)
+{
+  const int type = segment->flags & 63;
+  const size_t n = segment->data_length;
+  int i;
+
+  switch (type) {
+    case 0:
+      if (n >= 2) {
+        const int flags = (data[0] << 8) | data[1];
+        if (flags & 1)
+          fprintf(out, "huffman");
+        else
+          fprintf(out, "template %d", (flags >> 10) & 3);
+        if (flags & 2) fprintf(out, " refagg");
+        if (flags & 0x0100) fprintf(out, " ctx-used");
+        if (flags & 0x0200) fprintf(out, " ctx-retained");
+      }
+      break;
+    case 16:
+      if (n >= 3) {
+        if (data[0] & 1) fprintf(out, "mmr");
+        else fprintf(out, "template %d", (data[0] >> 1) & 3);
+        fprintf(out, " %dx%d patterns", data[1], data[2]);
+      }
+      break;
+    case 48:
+      if (n >= 19) {
+        fprintf(out, "%ux%u", dump_int32(data), dump_int32(data + 4));
+        if (data[17] & 0x80)
+          fprintf(out, " striped %d", ((data[17] & 0x7F) << 8) | data[18]);
+      }
+      break;
+    case 50:
+      if (n >= 4)
+        fprintf(out, "end row %u", dump_int32(data));
+      break;
+    case 4: case 6: case 7:
+    case 20: case 22: case 23:
+    case 36: case 38: case 39:
+    case 40: case 42: case 43:
+      if (n < 18)
         break;
-    case render:
+      /* 7.4.1 region segment information field */
+      fprintf(out, "%ux%u @%u,%u ", dump_int32(data), dump_int32(data + 4),
+        dump_int32(data + 8), dump_int32(data + 12));
+      if (type <= 7) {
+        if (n >= 19) {
+          const int flags = (data[17] << 8) | data[18];
+          fprintf(out, "%s", (flags & 1) ? "huffman" : "arith");
+          if (flags & 2) fprintf(out, " refine");
+        }
+      } else if (type <= 23) {
+        if (data[17] & 1) fprintf(out, "mmr");
+        else fprintf(out, "template %d", (data[17] >> 1) & 3);
+      } else if (type <= 39) {
+        if (data[17] & 1) fprintf(out, "mmr");
+        else fprintf(out, "template %d", (data[17] >> 1) & 3);
+        if (data[17] & 8) fprintf(out, " tpgdon");
+      } else {
+        fprintf(out, "template %d", data[17] & 1);
+        if (data[17] & 2) fprintf(out, " tpgron");
+      }
+      break;
+  }
 
-  if ((argc - filearg) == 1)
-  /* only one argument--open as a jbig2 file */
-    {
-      char *fn = argv[filearg];
+  for (i = 0; i < segment->referred_to_segment_count; i++)
+    fprintf(out, "%s%u", i ? "," : " refs ", segment->referred_to_segments[i]);
+}
 
-      f = fopen(fn, "rb");
-      if (f == NULL)
-	{
-	  fprintf(stderr, "error opening %s\n", fn);
-	  return 1;
-	}
+static void
+dump_segment(void *data, const Jbig2Segment *segment, const uint8_t *segment_data,
+             int done, int code, size_t coded_bytes)
+{
+  jbig2dec_dump_t *dump = (jbig2dec_dump_t *)data;
+  double ms;
+
+  if (!done) {
+    dump->start_allocs = dump->n_allocs;
+    dump->start_bytes = dump->alloc_bytes;
+    dump->start = dump_time();
+    return;
+  }
+
+  ms = dump_time() - dump->start;
+  fprintf(stdout, "%6u %-18s %4u %9lu %9.3f %9lu %6ld %9lu  ",
+    segment->number, dump_segment_type(segment->flags & 63),
+    segment->page_association, (unsigned long)segment->data_length, ms,
+    (unsigned long)coded_bytes, dump->n_allocs - dump->start_allocs,
+    (unsigned long)(dump->alloc_bytes - dump->start_bytes));
+  dump_segment_details(segment, segment_data, stdout);
+  if (code < 0)
+    fprintf(stdout, " FAILED");
+  fprintf(stdout, "\n");
+
+  dump->n_segments++;
+  dump->total_ms += ms;
+  dump->total_coded += coded_bytes;
+}
+
+static void
+dump_init(jbig2dec_dump_t *dump)
+{
+  memset(dump, 0, sizeof(*dump));
+  dump->allocator.alloc = dump_alloc;
+  dump->allocator.free = dump_free;
+  dump->allocator.realloc = dump_realloc;
+  fprintf(stdout, "%6s %-18s %4s %9s %9s %9s %6s %9s  %s\n",
+    "seg", "type", "page", "length", "ms", "coded", "allocs", "bytes", "details");
+}
+
+static void
+dump_totals(jbig2dec_dump_t *dump)
+{
+  fprintf(stdout, "%6d %-18s %4s %9s %9.3f %9lu %6ld %9lu\n",
+    dump->n_segments, "segments", "", "", dump->total_ms,
+    (unsigned long)dump->total_coded, dump->n_allocs,
+    (unsigned long)dump->alloc_bytes);
+}
+
+/* in batch mode pages go to the output directory, named after the
+   whole input file name, since streams pulled out of one document
+   often differ only in their extension. pages after the first have
+   the page number appended */
+static char *
+make_batch_filename(jbig2dec_params_t *params, const char *input_filename,
+                    int page)
+{
+    const char *ext = params->output_format == jbig2dec_format_png ?
+        ".png" : ".pbm";
+    const char *dir = params->output_dir != NULL ? params->output_dir : ".";
+    char suffix[32];
+    char *output_filename;
+    const char *c;
+
+    /* strip any leading path */
+    c = strrchr(input_filename, '/'); /* *nix */
+    if (c == NULL)
+      c = strrchr(input_filename, '\\'); /* win32/dos */
+    if (c != NULL)
+      c++; /* skip the path separator */
+    else
+      c = input_filename; /* no leading path */
+    if (*c == '\0')
+      c = "out";
+
+    if (page > 1)
+      snprintf(suffix, sizeof(suffix), "-%d%s", page, ext);
+    else
+      snprintf(suffix, sizeof(suffix), "%s", ext);
+
+    output_filename = malloc(strlen(dir) + strlen(c) + strlen(suffix) + 2);
+    if (output_filename == NULL) {
+        fprintf(stderr, "couldn't allocate memory for output_filename\n");
+        exit (1);
     }
-  else if ((argc - filearg) == 2)
-  /* two arguments open as separate global and page streams */
-    {
-      char *fn = argv[filearg];
-      char *fn_page = argv[filearg+1];
+    sprintf(output_filename, "%s/%s%s", dir, c, suffix);
 
-      f = fopen(fn, "rb");
-      if (f == NULL)
-	{
-	  fprintf(stderr, "error opening %s\n", fn);
-	  return 1;
-	}
+    return output_filename;
+}
+
+/* decode a document, given either as a jbig2 file or as a pair of
+   embedded global and page streams, and write out its pages */
+static int
+decode_document(jbig2dec_params_t *params, const char *fn, const char *fn_page)
+{
+  FILE *f, *f_page = NULL;
+  Jbig2Ctx *ctx;
+  Jbig2GlobalCtx *global_ctx = NULL;
+  jbig2dec_dump_t report;
+  Jbig2Allocator *allocator = NULL;
+  Jbig2Image *image;
+  const char *name = fn_page != NULL ? fn_page : fn;
+  int n_pages = 0;
+
+  f = fopen(fn, "rb");
+  if (f == NULL)
+    {
+      fprintf(stderr, "error opening %s\n", fn);
+      return 1;
+    }
 
+  if (fn_page != NULL)
+    {
       f_page = fopen(fn_page, "rb");
       if (f_page == NULL)
 	{
 	  fprintf(stderr, "error opening %s\n", fn_page);
+	  fclose(f);
 	  return 1;
 	}
     }
-  else
-  /* any other number of arguments */
-    return print_usage();
 
-  ctx = jbig2_ctx_new(NULL, f_page != NULL ? JBIG2_OPTIONS_EMBEDDED : 0,
-		      NULL,
-		      error_callback, &params);
+  if (params->batch && params->hash) hash_init(params);
 
-  /* pull the whole file/global stream into memory */
-  for (;;)
+  if (params->mode == dump)
     {
-      int n_bytes = fread(buf, 1, sizeof(buf), f);
-      if (n_bytes <= 0)
-	break;
-      jbig2_data_in(ctx, buf, n_bytes);
+      dump_init(&report);
+      allocator = &report.allocator;
     }
+
+  ctx = jbig2_ctx_new(allocator, f_page != NULL ? JBIG2_OPTIONS_EMBEDDED : 0,
+		      NULL,
+		      error_callback, params);
+  jbig2_set_min_severity(ctx, min_severity(params));
+  jbig2_set_memory_limit(ctx, params->memory_limit);
+  if (params->mode == dump)
+    jbig2_set_segment_callback(ctx, dump_segment, &report);
+
+  /* pull the whole file/global stream into memory */
+  data_in_file(ctx, f);
   fclose(f);
 
   /* if there's a local page stream read that in its entirety */
   if (f_page != NULL)
     {
-      Jbig2GlobalCtx *global_ctx = jbig2_make_global_ctx(ctx);
-      ctx = jbig2_ctx_new(NULL, JBIG2_OPTIONS_EMBEDDED, global_ctx,
-			 error_callback, &params);
-      for (;;)
-	{
-	  int n_bytes = fread(buf, 1, sizeof(buf), f_page);
-	  if (n_bytes <= 0)
-	    break;
-	  jbig2_data_in(ctx, buf, n_bytes);
-	}
+      global_ctx = jbig2_make_global_ctx(ctx);
+      ctx = jbig2_ctx_new(allocator, JBIG2_OPTIONS_EMBEDDED, global_ctx,
+			 error_callback, params);
+      jbig2_set_min_severity(ctx, min_severity(params));
+      jbig2_set_memory_limit(ctx, params->memory_limit);
+      if (params->mode == dump)
+        jbig2_set_segment_callback(ctx, dump_segment, &report);
+      data_in_file(ctx, f_page);
       fclose(f_page);
-      jbig2_global_ctx_free(global_ctx);
     }
 
   /* retrieve and output the returned pages */
-  {
-    Jbig2Image *image;
 
-    /* work around broken CVision embedded streams */
-    if (f_page != NULL)
-      jbig2_complete_page(ctx);
+  /* work around broken CVision embedded streams */
+  if (f_page != NULL)
+    jbig2_complete_page(ctx);
 
-    if (params.output_file == NULL)
-      {
+  if (params->mode == dump)
+    {
+      while ((image = jbig2_page_out(ctx)) != NULL) {
+        if (params->hash) hash_image(params, image);
+        jbig2_release_page(ctx, image);
+      }
+      dump_totals(&report);
+    }
+  else if (params->batch)
+    {
+      if (params->output_format == jbig2dec_format_none)
 #ifdef HAVE_LIBPNG
-        params.output_file = make_output_filename(argv[filearg], ".png");
-        params.output_format = jbig2dec_format_png;
+        params->output_format = jbig2dec_format_png;
 #else
-        params.output_file = make_output_filename(argv[filearg], ".pbm");
-        params.output_format = jbig2dec_format_pbm;
+        params->output_format = jbig2dec_format_pbm;
 #endif
-      } else {
-        int len = strlen(params.output_file);
-        if ((len >= 3) && (params.output_format == jbig2dec_format_none))
-          /* try to set the output type by the given extension */
-          set_output_format(&params, params.output_file + len - 3);
-      }
+    }
+  else if (params->output_file == NULL)
+    {
+#ifdef HAVE_LIBPNG
+      params->output_file = make_output_filename(fn, ".png");
+      params->output_format = jbig2dec_format_png;
+#else
+      params->output_file = make_output_filename(fn, ".pbm");
+      params->output_format = jbig2dec_format_pbm;
+#endif
+    } else {
+      int len = strlen(params->output_file);
+      if ((len >= 3) && (params->output_format == jbig2dec_format_none))
+        /* try to set the output type by the given extension */
+        set_output_format(params, params->output_file + len - 3);
+    }
 
-    /* retrieve and write out all the completed pages */
-    while ((image = jbig2_page_out(ctx)) != NULL) {
-      write_page_image(&params, image);
-      if (params.hash) hash_image(&params, image);
-      jbig2_release_page(ctx, image);
+  /* retrieve and write out all the completed pages */
+  while ((image = jbig2_page_out(ctx)) != NULL) {
+    if (params->batch) {
+      free(params->output_file);
+      params->output_file = make_batch_filename(params, name, ++n_pages);
     }
-    if (params.hash) write_document_hash(&params);
+    write_page_image(params, image);
+    if (params->hash) hash_image(params, image);
+    jbig2_release_page(ctx, image);
   }
+  if (params->hash) write_document_hash(params, params->batch ? name : NULL);
 
   jbig2_ctx_free(ctx);
+  /* the page context may refer to global symbols until it is freed */
+  if (global_ctx != NULL)
+    jbig2_global_ctx_free(global_ctx);
+
+  if (params->batch) {
+    free(params->output_file);
+    params->output_file = NULL;
+    if (params->hash) hash_free(params);
+    /* keep each document's report in one piece when workers share stdout */
+    fflush(stdout);
+  }
+
+  return 0;
+}
+
+/* add a document to the batch, growing the list as needed */
+static int
+add_job(jbig2dec_job_t **jobs, int *n_jobs, int *max_jobs,
+        const char *fn, const char *fn_page)
+{
+    jbig2dec_job_t *job;
+
+    if (*n_jobs == *max_jobs) {
+        int max = *max_jobs ? *max_jobs * 2 : 64;
+        job = realloc(*jobs, max * sizeof(jbig2dec_job_t));
+        if (job == NULL) {
+            fprintf(stderr, "couldn't allocate memory for the batch\n");
+            return 1;
+        }
+        *jobs = job;
+        *max_jobs = max;
+    }
+
+    job = &(*jobs)[*n_jobs];
+    job->fn = strdup(fn);
+    job->fn_page = fn_page != NULL ? strdup(fn_page) : NULL;
+    if (job->fn == NULL || (fn_page != NULL && job->fn_page == NULL)) {
+        fprintf(stderr, "couldn't allocate memory for the batch\n");
+        free(job->fn);
+        free(job->fn_page);
+        return 1;
+    }
+    (*n_jobs)++;
+
+    return 0;
+}
+
+/* read a manifest of documents, one per line: either a jbig2 file
+   or a global stream and a page stream. blank lines and lines
+   starting with '#' are skipped */
+static int
+read_job_list(const char *list_file, jbig2dec_job_t **jobs, int *n_jobs,
+              int *max_jobs)
+{
+    FILE *f;
+    char line[4096];
+    int code = 0;
+
+    if (!strncmp(list_file, "-", 2))
+      f = stdin;
+    else
+      f = fopen(list_file, "r");
+    if (f == NULL) {
+        fprintf(stderr, "error opening %s\n", list_file);
+        return 1;
+    }
+
+    while (code == 0 && fgets(line, sizeof(line), f) != NULL) {
+        char *fn = strtok(line, " \t\r\n");
+        char *fn_page;
+
+        if (fn == NULL || fn[0] == '#')
+          continue;
+        fn_page = strtok(NULL, " \t\r\n");
+        code = add_job(jobs, n_jobs, max_jobs, fn, fn_page);
+    }
+
+    if (f != stdin)
+      fclose(f);
+
+    return code;
+}
+
+#ifdef USE_FORK
+/* hand the documents out to a pool of worker processes through a
+   pipe. each worker decodes and writes whole documents, so one
+   worker's encoding and writing overlaps the others' decoding, and
+   a document that crashes the decoder only takes its worker down.
+   returns the number of failures, or -1 if no worker could start */
+static int
+run_batch_workers(jbig2dec_params_t *params, jbig2dec_job_t *jobs, int n_jobs)
+{
+  int fds[2];
+  int n_workers = params->jobs < n_jobs ? params->jobs : n_jobs;
+  int started = 0, failed = 0;
+  int i, status;
+
+  if (pipe(fds) < 0)
+    return -1;
+
+  /* don't let the workers inherit unwritten output */
+  fflush(stdout);
+  fflush(stderr);
+
+  for (i = 0; i < n_workers; i++) {
+    pid_t pid = fork();
+
+    if (pid < 0)
+      break;
+    if (pid == 0) {
+      int job, worker_failed = 0;
+
+      close(fds[1]);
+      while (read(fds[0], &job, sizeof(job)) == sizeof(job))
+        if (decode_document(params, jobs[job].fn, jobs[job].fn_page))
+          worker_failed++;
+      exit(worker_failed ? 1 : 0);
+    }
+    started++;
+  }
+  close(fds[0]);
+  if (started == 0) {
+    close(fds[1]);
+    return -1;
+  }
+
+  /* if every worker dies, find out from write() rather than a signal */
+  signal(SIGPIPE, SIG_IGN);
+  for (i = 0; i < n_jobs; i++)
+    if (write(fds[1], &i, sizeof(i)) != sizeof(i))
+      break;
+  close(fds[1]);
+  if (i < n_jobs) {
+    fprintf(stderr, "workers exited with %d documents undecoded\n", n_jobs - i);
+    failed++;
+  }
+
+  while (started-- > 0) {
+    if (wait(&status) < 0)
+      break;
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "worker killed by signal %d\n", WTERMSIG(status));
+      failed++;
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed++;
+  }
+
+  return failed;
+}
+#endif
+
+/* decode every document in the batch. returns the number of failures */
+static int
+run_batch(jbig2dec_params_t *params, jbig2dec_job_t *jobs, int n_jobs)
+{
+  int failed = 0;
+  int i;
+
+#ifdef USE_FORK
+  /* dump reports would interleave, so always decode those in order */
+  if (params->jobs > 1 && n_jobs > 1 && params->mode != dump) {
+    failed = run_batch_workers(params, jobs, n_jobs);
+    if (failed >= 0)
+      return failed;
+    fprintf(stderr, "unable to start workers, decoding serially\n");
+    failed = 0;
+  }
+#endif
+
+  for (i = 0; i < n_jobs; i++)
+    if (decode_document(params, jobs[i].fn, jobs[i].fn_page))
+      failed++;
+
+  return failed;
+}
+
+int
+main (int argc, char **argv)
+{
+  jbig2dec_params_t params;
+  int filearg;
+  int code = 0;
+
+  /* set defaults */
+  params.mode = render;
+  params.verbose = 1;
+  params.hash = 0;
+  params.output_file = NULL;
+  params.output_format = jbig2dec_format_none;
+  params.batch = 0;
+  params.jobs = 1;
+  params.list_file = NULL;
+  params.output_dir = NULL;
+  params.png_level = 1;
+  params.memory_limit = 0;
+
+  filearg = parse_options(argc, argv, &params);
+
+  if (params.hash && !params.batch) hash_init(&params);
+
+  switch (params.mode) {
+    case usage:
+        print_usage();
+        exit (0);
+        break;
+    case dump:
+    case render:
+
+  if (params.batch)
+  /* every argument, and every line of the list, is a document */
+    {
+      jbig2dec_job_t *jobs = NULL;
+      int n_jobs = 0, max_jobs = 0;
+      int i;
+
+      /* -o names the directory the pages are written to */
+      params.output_dir = params.output_file;
+      params.output_file = NULL;
+
+      if (params.list_file != NULL)
+        code = read_job_list(params.list_file, &jobs, &n_jobs, &max_jobs);
+      for (i = filearg; code == 0 && i < argc; i++)
+        code = add_job(&jobs, &n_jobs, &max_jobs, argv[i], NULL);
+      if (code == 0 && n_jobs == 0)
+        return print_usage();
+
+      if (code == 0 && run_batch(&params, jobs, n_jobs) > 0)
+        code = 1;
+
+      for (i = 0; i < n_jobs; i++) {
+        free(jobs[i].fn);
+        free(jobs[i].fn_page);
+      }
+      free(jobs);
+      free(params.list_file);
+      free(params.output_dir);
+    }
+  else if ((argc - filearg) == 1)
+  /* only one argument--open as a jbig2 file */
+    {
+      if (decode_document(&params, argv[filearg], NULL))
+        return 1;
+    }
+  else if ((argc - filearg) == 2)
+  /* two arguments open as separate global and page streams */
+    {
+      if (decode_document(&params, argv[filearg], argv[filearg+1]))
+        return 1;
+    }
+  else
+  /* any other number of arguments */
+    return print_usage();
 
   } /* end params.mode switch */
 
@@ -507,5 +1149,5 @@ main (int argc, char **argv)
   if (params.hash) hash_free(&params);
 
   /* fin */
-  return 0;
+  return code;
 }